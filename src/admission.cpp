@@ -0,0 +1,185 @@
+#include "admission.h"
+
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <algorithm>
+
+namespace admission_nms {
+
+namespace {
+
+inline void put_int4(string *s, uint32_t val) {
+    for(int shift = 24; 0 <= shift; shift -= 8){
+        s->push_back(static_cast<char>(val >> shift));
+    }
+}
+
+}
+
+string admission_stats_t::summary() const {
+    const uint64_t waited = queued.load(std::memory_order_relaxed);
+    const uint64_t out = timed_out.load(std::memory_order_relaxed);
+    return std::to_string(admitted.load(std::memory_order_relaxed)) + " admitted, "
+            + std::to_string(waited) + " queued, avg wait "
+            + std::to_string(waited - out ? wait_ns.load(std::memory_order_relaxed) / (waited - out) / 1000000 : 0)
+            + " ms, " + std::to_string(out) + " timed out, "
+            + std::to_string(rate_limited.load(std::memory_order_relaxed)) + " rate limited";
+}
+
+admission_t::admission_t(unsigned max_backends, unsigned wait_ms, unsigned rate, unsigned burst)
+    : max_backends_(max_backends), wait_ms_(wait_ms), rate_(rate), burst_(std::max(burst, 1u))
+    , start_(steady_clock::now()) {
+    for(auto &b : buckets_){
+        b.store(0, std::memory_order_relaxed);
+    }
+    if(max_backends_){
+        wakeup_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+}
+
+admission_t::~admission_t() {
+    for(int sock : reset()){
+        ::close(sock);
+    }
+    if(wakeup_fd_ != -1){
+        ::close(wakeup_fd_);
+    }
+}
+
+uint64_t admission_t::now_ms() const {
+    // never 0, that marks an unused bucket
+    return std::chrono::duration_cast<std::chrono::milliseconds>(steady_clock::now() - start_).count() + 1;
+}
+
+void admission_t::take_wakeup() {
+    uint64_t val;
+    while(::read(wakeup_fd_, &val, sizeof(val)) == -1 && errno == EINTR){}
+}
+
+bool admission_t::rate_ok(const sockaddr_storage &addr) {
+    if(!rate_ || addr.ss_family != AF_INET){
+        return true;
+    }
+    const uint32_t ip = reinterpret_cast<const sockaddr_in *>(&addr)->sin_addr.s_addr;
+    auto &bucket = buckets_[(ip * 2654435761u) % bucket_cnt];
+    const uint64_t full = uint64_t(burst_) * 1000;
+    const uint64_t now = now_ms() & 0xffffffff;
+    uint64_t cur = bucket.load(std::memory_order_relaxed);
+    for(;;){
+        uint64_t tokens = full;
+        if(cur){
+            const uint64_t elapsed = (now - (cur >> 32)) & 0xffffffff;
+            tokens = std::min(full, (cur & 0xffffffff) + elapsed * rate_);
+        }
+        if(tokens < 1000){
+            stats.rate_limited.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if(bucket.compare_exchange_weak(cur, now << 32 | (tokens - 1000), std::memory_order_relaxed)){
+            return true;
+        }
+    }
+}
+
+bool admission_t::try_acquire() {
+    if(!max_backends_){
+        stats.admitted.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    if(waiting_cnt_.load(std::memory_order_acquire)){
+        return false;
+    }
+    unsigned cur = active_.load(std::memory_order_relaxed);
+    while(cur < max_backends_){
+        if(active_.compare_exchange_weak(cur, cur + 1, std::memory_order_acq_rel)){
+            stats.admitted.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+void admission_t::release() {
+    if(!max_backends_){
+        return;
+    }
+    active_.fetch_sub(1, std::memory_order_acq_rel);
+    if(waiting_cnt_.load(std::memory_order_acquire)){
+        const uint64_t one = 1;
+        if(::write(wakeup_fd_, &one, sizeof(one)) == -1){
+            // the connectors look at the queue on their timeouts anyway
+        }
+    }
+}
+
+void admission_t::enqueue(const accepted_client_t &client) {
+    lock_guard<mutex> lg(mx_);
+    waiting_.push_back(client);
+    waiting_cnt_.fetch_add(1, std::memory_order_acq_rel);
+    stats.queued.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool admission_t::next(accepted_client_t *client, vector<int> *expired) {
+    if(!waiting_cnt_.load(std::memory_order_acquire)){
+        return false;
+    }
+    const auto now = steady_clock::now();
+    const auto deadline = now - std::chrono::milliseconds(wait_ms_);
+    lock_guard<mutex> lg(mx_);
+    while(!waiting_.empty() && waiting_.front().time < deadline){
+        expired->push_back(waiting_.front().sock);
+        waiting_.pop_front();
+        waiting_cnt_.fetch_sub(1, std::memory_order_acq_rel);
+        stats.timed_out.fetch_add(1, std::memory_order_relaxed);
+    }
+    if(waiting_.empty()){
+        return false;
+    }
+    unsigned cur = active_.load(std::memory_order_relaxed);
+    do{
+        if(max_backends_ <= cur){
+            return false;
+        }
+    } while(!active_.compare_exchange_weak(cur, cur + 1, std::memory_order_acq_rel));
+    *client = waiting_.front();
+    waiting_.pop_front();
+    waiting_cnt_.fetch_sub(1, std::memory_order_acq_rel);
+    stats.admitted.fetch_add(1, std::memory_order_relaxed);
+    stats.wait_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(now - client->time).count()
+                            , std::memory_order_relaxed);
+    return true;
+}
+
+vector<int> admission_t::reset() {
+    lock_guard<mutex> lg(mx_);
+    vector<int> res;
+    for(const auto &client : waiting_){
+        res.push_back(client.sock);
+    }
+    waiting_.clear();
+    waiting_cnt_.store(0, std::memory_order_release);
+    active_.store(0, std::memory_order_release);
+    for(auto &b : buckets_){
+        b.store(0, std::memory_order_relaxed);
+    }
+    return res;
+}
+
+void refuse(int sock, const char *reason) {
+    string body;
+    for(const char *field : { "SFATAL", "VFATAL", "C53300" }){
+        body.append(field).push_back('\0');
+    }
+    body.push_back('M');
+    body.append(reason).push_back('\0');
+    body.push_back('\0');
+    string msg(1, 'E');
+    put_int4(&msg, body.size() + 4);
+    msg += body;
+    if(::send(sock, msg.data(), msg.size(), MSG_DONTWAIT | MSG_NOSIGNAL) == -1){
+        // the client is gone or doesn't read, it's closed anyway
+    }
+}
+
+}
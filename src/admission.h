@@ -0,0 +1,115 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <cstdint>
+#include <string>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+namespace admission_nms {
+
+using std::string;
+using std::deque;
+using std::vector;
+using std::mutex;
+using std::lock_guard;
+using std::atomic;
+using std::atomic_uint;
+using std::chrono::steady_clock;
+
+struct accepted_client_t {
+    int sock;
+    sockaddr_storage addr;
+    steady_clock::time_point time;      // of the accept
+};
+
+struct admission_stats_t {
+    atomic<uint64_t> admitted = { 0 };
+    atomic<uint64_t> queued = { 0 };
+    atomic<uint64_t> wait_ns = { 0 };       // of the queued clients admitted
+    atomic<uint64_t> timed_out = { 0 };
+    atomic<uint64_t> rate_limited = { 0 };
+
+    string summary() const;
+
+    void reset() {
+        for(auto counter : { &admitted, &queued, &wait_ns, &timed_out, &rate_limited }){
+            counter->store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+// keeps the number of backend connections under a cap: the clients over it wait
+// in FIFO order until a peer is gone or their time is out, a wakeup descriptor tells
+// the connectors when a slot is free; new connections of a client address
+// are limited by a token bucket, the buckets are shared by the addresses hashed together
+class admission_t {
+    static const unsigned bucket_cnt = 4096;
+
+    const unsigned max_backends_;       // 0 - no cap
+    const unsigned wait_ms_;
+    const unsigned rate_;               // connections per second of an address, 0 - no limit
+    const unsigned burst_;
+    const steady_clock::time_point start_;
+    atomic_uint active_ = { 0 };
+    atomic_uint waiting_cnt_ = { 0 };
+    mutex mx_;
+    deque<accepted_client_t> waiting_;
+    int wakeup_fd_ = -1;
+    // (ms since the start << 32) | thousandths of a token, 0 for an unused bucket
+    atomic<uint64_t> buckets_[bucket_cnt];
+
+    uint64_t now_ms() const;
+
+public:
+
+    admission_stats_t stats;
+
+    admission_t(unsigned max_backends, unsigned wait_ms, unsigned rate, unsigned burst);
+
+    ~admission_t();
+
+    bool enabled() const { return max_backends_ || rate_; }
+
+    unsigned max_backends() const { return max_backends_; }
+
+    unsigned wait_ms() const { return wait_ms_; }
+
+    unsigned rate() const { return rate_; }
+
+    unsigned burst() const { return burst_; }
+
+    int wakeup_fd() const { return wakeup_fd_; }
+
+    void take_wakeup();
+
+    // takes a token of the client address, unix socket clients aren't limited
+    bool rate_ok(const sockaddr_storage &addr);
+
+    // a slot for a new client, none while others wait
+    bool try_acquire();
+
+    // for the peers taken over from another process
+    void acquire_forced() { active_.fetch_add(1, std::memory_order_acq_rel); }
+
+    void release();
+
+    void enqueue(const accepted_client_t &client);
+
+    // the first waiting client if a slot is free, the ones out of time are moved to expired
+    bool next(accepted_client_t *client, vector<int> *expired);
+
+    // gives the waiting clients back to be refused
+    vector<int> reset();
+};
+
+// answers the client with a FATAL too_many_connections error, best effort
+void refuse(int sock, const char *reason);
+
+}
+
+using admission_nms::admission_t;
+using admission_nms::accepted_client_t;
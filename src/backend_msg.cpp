@@ -0,0 +1,215 @@
+#include "backend_msg.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+namespace backend_msg_nms {
+
+using std::runtime_error;
+
+namespace {
+
+const char command_complete_id = 'C';
+const char data_row_id = 'D';
+const char error_id = 'E';
+const char empty_query_id = 'I';
+const char notice_id = 'N';
+const char ready_id = 'Z';
+
+inline uint32_t int4(const uint8_t *p) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+}
+
+inline bool kept(char type) {
+    switch(type){
+    case command_complete_id:
+    case error_id:
+    case empty_query_id:
+    case notice_id:
+    case ready_id:
+        return true;
+    }
+    return false;
+}
+
+struct saved_state_t {
+    uint8_t header[5];
+    unsigned header_len;
+    uint32_t remaining;
+    bool keep;
+    bool started;
+    bool lost;
+    uint64_t rows;
+};
+
+}
+
+string backend_stats_t::summary() const {
+    return "rows: " + std::to_string(rows.load(std::memory_order_relaxed))
+            + ", commands: " + std::to_string(commands.load(std::memory_order_relaxed))
+            + ", errors: " + std::to_string(errors.load(std::memory_order_relaxed))
+            + ", notices: " + std::to_string(notices.load(std::memory_order_relaxed));
+}
+
+// returns false if the stream can't be followed any more
+bool backend_scanner_t::on_header(const function<void (const backend_event_t &)> &event_f
+                                  , backend_stats_t *stats) {
+    uint32_t len = int4(header_ + 1);
+    if(len < 4){
+        lost_ = true;
+        return false;
+    }
+    remaining_ = len - 4;
+    keep_ = kept(header_[0]);
+    body_.clear();
+    if(header_[0] == data_row_id){
+        ++rows_;
+    }
+    if(remaining_ == 0){
+        on_message(event_f, stats);
+    }
+    return true;
+}
+
+void backend_scanner_t::on_message(const function<void (const backend_event_t &)> &event_f
+                                   , backend_stats_t *stats) {
+    header_len_ = 0;
+    if(!keep_){
+        return;
+    }
+    const char type = header_[0];
+    switch(type){
+    case command_complete_id:
+        stats->commands.fetch_add(1, std::memory_order_relaxed);
+        stats->rows.fetch_add(rows_, std::memory_order_relaxed);
+        break;
+    case error_id:
+        stats->errors.fetch_add(1, std::memory_order_relaxed);
+        break;
+    case notice_id:
+        stats->notices.fetch_add(1, std::memory_order_relaxed);
+        break;
+    }
+    event_f(backend_event_t{ type, body_, rows_ });
+    if(type != notice_id){
+        rows_ = 0;
+    }
+}
+
+void backend_scanner_t::scan(const int8_t *data, unsigned size
+                             , const function<void (const backend_event_t &)> &event_f
+                             , backend_stats_t *stats, const page_index_t *index, unsigned pos) {
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(data);
+    const uint8_t *end = p + size;
+    if(lost_ && index){
+        auto mark = index->first_from(pos, pos + size);
+        if(!mark){
+            return;
+        }
+        p += mark->offset - pos;
+        header_len_ = 0;
+        remaining_ = 0;
+        rows_ = 0;
+        started_ = true;
+        lost_ = false;
+    }
+    if(!started_ && p < end){
+        started_ = true;
+        // the one byte answer to an encryption request, a refusal is followed by the startup
+        if(*p == 'S' || *p == 'G'){
+            lost_ = true;
+        } else if(*p == 'N'){
+            ++p;
+        }
+    }
+    while(p < end && !lost_){
+        if(header_len_ == 0){
+            // whole messages in the data are skipped without being copied
+            while(5 <= end - p){
+                uint32_t len = int4(p + 1);
+                if(len < 4){
+                    lost_ = true;
+                    return;
+                }
+                if(p[0] != data_row_id || static_cast<size_t>(end - p - 1) < len){
+                    break;
+                }
+                ++rows_;
+                p += 1 + len;
+            }
+            if(p == end){
+                break;
+            }
+        }
+        if(header_len_ < sizeof(header_)){
+            unsigned n = std::min<size_t>(sizeof(header_) - header_len_, end - p);
+            memcpy(header_ + header_len_, p, n);
+            header_len_ += n;
+            p += n;
+            if(header_len_ == sizeof(header_) && !on_header(event_f, stats)){
+                return;
+            }
+            continue;
+        }
+        unsigned n = std::min<size_t>(remaining_, end - p);
+        if(keep_ && body_.size() < max_kept_body){
+            body_.append(reinterpret_cast<const char *>(p), std::min<size_t>(n, max_kept_body - body_.size()));
+        }
+        p += n;
+        remaining_ -= n;
+        if(remaining_ == 0){
+            on_message(event_f, stats);
+        }
+    }
+}
+
+string backend_scanner_t::save() const {
+    saved_state_t st;
+    memcpy(st.header, header_, sizeof(st.header));
+    st.header_len = header_len_;
+    st.remaining = remaining_;
+    st.keep = keep_;
+    st.started = started_;
+    st.lost = lost_;
+    st.rows = rows_;
+    return string(reinterpret_cast<const char *>(&st), sizeof(st)) + body_;
+}
+
+void backend_scanner_t::load(const string &state) {
+    if(state.size() < sizeof(saved_state_t)){
+        throw runtime_error("bad backend logger state");
+    }
+    saved_state_t st;
+    memcpy(&st, state.data(), sizeof(st));
+    memcpy(header_, st.header, sizeof(header_));
+    header_len_ = st.header_len;
+    remaining_ = st.remaining;
+    keep_ = st.keep;
+    started_ = st.started;
+    lost_ = st.lost;
+    rows_ = st.rows;
+    body_.assign(state, sizeof(st), string::npos);
+}
+
+string error_summary(const string &body) {
+    string severity, code, text;
+    for(size_t pos = 0; pos < body.size() && body[pos]; ){
+        const char field = body[pos++];
+        size_t value_end = body.find('\0', pos);
+        if(value_end == string::npos){
+            value_end = body.size();
+        }
+        if(field == 'V' || (field == 'S' && severity.empty())){
+            severity.assign(body, pos, value_end - pos);
+        } else if(field == 'C'){
+            code.assign(body, pos, value_end - pos);
+        } else if(field == 'M'){
+            text.assign(body, pos, value_end - pos);
+        }
+        pos = value_end + 1;
+    }
+    return severity + ' ' + code + ' ' + text;
+}
+
+}
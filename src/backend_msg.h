@@ -0,0 +1,123 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+
+#include "memory/page_index.h"
+
+namespace backend_msg_nms {
+
+using std::string;
+using std::unordered_map;
+using std::mutex;
+using std::lock_guard;
+using std::atomic;
+using std::function;
+
+const unsigned max_kept_body = 1024;    // longer error texts and tags are cut
+
+// what the backend messages of all connections amounted to
+struct backend_stats_t {
+    atomic<uint64_t> rows = { 0 };
+    atomic<uint64_t> commands = { 0 };
+    atomic<uint64_t> errors = { 0 };
+    atomic<uint64_t> notices = { 0 };
+
+    string summary() const;
+
+    void reset() {
+        for(auto counter : { &rows, &commands, &errors, &notices }){
+            counter->store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+// a message worth logging: CommandComplete, EmptyQueryResponse, ErrorResponse,
+// NoticeResponse or ReadyForQuery, with the rows sent since the previous one
+struct backend_event_t {
+    char type;
+    const string &body;
+    uint64_t rows;
+};
+
+// decodes the backend messages of one connection, only the headers are looked at
+// for the rest, so runs of DataRows are skipped by their length
+class backend_scanner_t {
+    uint8_t header_[5];
+    unsigned header_len_ = 0;
+    uint32_t remaining_ = 0;        // body bytes still to come
+    bool keep_ = false;             // the body is collected
+    bool started_ = false;
+    bool lost_ = false;             // encrypted or malformed stream
+    uint64_t rows_ = 0;
+    string body_;
+
+    bool on_header(const function<void (const backend_event_t &)> &event_f, backend_stats_t *stats);
+
+    void on_message(const function<void (const backend_event_t &)> &event_f, backend_stats_t *stats);
+
+public:
+
+    // the index of the page the data is at pos of, if any, lets a lost stream be picked up again
+    void scan(const int8_t *data, unsigned size
+              , const function<void (const backend_event_t &)> &event_f, backend_stats_t *stats
+              , const page_index_t *index = nullptr, unsigned pos = 0);
+
+    string save() const;
+
+    void load(const string &state);
+};
+
+// SQLSTATE and message text of an ErrorResponse or NoticeResponse body
+string error_summary(const string &body);
+
+class backend_msg_t {
+    unordered_map<int, backend_scanner_t> scanners_;
+    mutex mx_;
+
+    backend_scanner_t &scanner(int sock) {
+        lock_guard<mutex> lg(mx_);
+        return scanners_[sock];
+    }
+
+public:
+
+    backend_stats_t stats;
+
+    void reset() {
+        lock_guard<mutex> lg(mx_);
+        scanners_.clear();
+    }
+
+    void clear_from(int sock) {
+        lock_guard<mutex> lg(mx_);
+        scanners_.erase(sock);
+    }
+
+    string save(int sock) {
+        lock_guard<mutex> lg(mx_);
+        auto it = scanners_.find(sock);
+        return it == scanners_.end() ? string() : it->second.save();
+    }
+
+    void load(int sock, const string &state) {
+        if(!state.empty()){
+            scanner(sock).load(state);
+        }
+    }
+
+    void add_data(int sock, const int8_t *data, unsigned size
+                  , const function<void (const backend_event_t &)> &event_f
+                  , const page_index_t *index = nullptr, unsigned pos = 0) {
+        scanner(sock).scan(data, size, event_f, &stats, index, pos);
+    }
+};
+
+}
+
+using backend_msg_nms::backend_msg_t;
+using backend_msg_nms::backend_event_t;
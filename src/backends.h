@@ -0,0 +1,98 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <cstdint>
+
+#include "system/endpoint.h"
+
+namespace backends_nms {
+
+using std::deque;
+using std::vector;
+using std::string;
+using std::atomic_uint;
+using std::atomic;
+
+// the primary server followed by the read-only replicas,
+// each with the number of peers connected to it now and in total
+class backends_t {
+
+    struct backend_t {
+        endpoint_t addr;
+        atomic_uint peers = { 0 };
+        atomic<uint64_t> routed = { 0 };
+
+        explicit backend_t(const endpoint_t &a) : addr(a) {}
+    };
+
+    deque<backend_t> backends_;
+
+public:
+
+    static const unsigned primary = 0;
+
+    backends_t(const endpoint_t &primary_addr, const vector<endpoint_t> &replicas) {
+        backends_.emplace_back(primary_addr);
+        for(const auto &addr : replicas){
+            backends_.emplace_back(addr);
+        }
+    }
+
+    bool has_replicas() const { return 1 < backends_.size(); }
+
+    unsigned count() const { return backends_.size(); }
+
+    const endpoint_t &addr(unsigned idx) const { return backends_[idx].addr; }
+
+    bool any_local() const {
+        for(const auto &b : backends_){
+            if(b.addr.is_local()){
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // takes the least loaded replica for a read-only peer, the primary otherwise;
+    // returns the backend index to be detached once the peer is gone
+    unsigned attach(bool read_only) {
+        unsigned idx = primary;
+        if(read_only && has_replicas()){
+            idx = 1;
+            for(unsigned i = 2; i < backends_.size(); ++i){
+                if(backends_[i].peers.load(std::memory_order_relaxed)
+                        < backends_[idx].peers.load(std::memory_order_relaxed)){
+                    idx = i;
+                }
+            }
+        }
+        backends_[idx].peers.fetch_add(1, std::memory_order_relaxed);
+        backends_[idx].routed.fetch_add(1, std::memory_order_relaxed);
+        return idx;
+    }
+
+    void detach(unsigned idx) { backends_[idx].peers.fetch_sub(1, std::memory_order_relaxed); }
+
+    string routed_summary() const {
+        string res;
+        for(unsigned i = 0; i < backends_.size(); ++i){
+            res += i == primary ? "primary " : ", replica ";
+            res += backends_[i].addr.to_string() + " : "
+                    + std::to_string(backends_[i].routed.load(std::memory_order_relaxed));
+        }
+        return res;
+    }
+
+    void reset() {
+        for(auto &b : backends_){
+            b.routed.store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+}
+
+using backends_nms::backends_t;
@@ -0,0 +1,105 @@
+#include "capture.h"
+
+#include <stdexcept>
+
+namespace capture_nms {
+
+namespace {
+
+const size_t file_buffer_size = 1 << 20;
+
+}
+
+void capture_file_t::write(uint32_t connection, uint8_t direction, const void *data, uint32_t size) {
+    chunk_header_t header;
+    header.ns = std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock_t::now() - start_).count();
+    header.connection = connection;
+    header.direction = direction;
+    header.size = size;
+    FILE *file = file_.load(std::memory_order_relaxed);
+    if(std::fwrite(&header, sizeof(header), 1, file) != 1
+            || (size && std::fwrite(data, size, 1, file) != 1)){
+        file_.store(nullptr, std::memory_order_relaxed);
+        std::fclose(file);
+        throw std::runtime_error("unable to write the capture file, capturing stopped");
+    }
+    ++chunks_;
+    bytes_ += size;
+}
+
+bool capture_file_t::open(const string &path) {
+    close();
+    lock_guard<mutex> lg(mx_);
+    int fd = sys_caller_t::open(message_on_error, path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd == -1){
+        return false;
+    }
+    FILE *file = ::fdopen(fd, "wb");
+    if(!file){
+        sys_caller_t::close(message_on_error, fd);
+        return false;
+    }
+    std::setvbuf(file, nullptr, _IOFBF, file_buffer_size);
+    if(std::fwrite(file_magic, sizeof(file_magic), 1, file) != 1){
+        std::fclose(file);
+        return false;
+    }
+    start_ = steady_clock_t::now();
+    connections_.clear();
+    next_connection_ = 0;
+    chunks_ = 0;
+    bytes_ = 0;
+    file_.store(file, std::memory_order_relaxed);
+    return true;
+}
+
+void capture_file_t::close() {
+    lock_guard<mutex> lg(mx_);
+    if(FILE *file = file_.exchange(nullptr, std::memory_order_relaxed)){
+        std::fclose(file);
+    }
+}
+
+void capture_file_t::add(int client_sock, uint8_t direction, const int8_t *data, unsigned size) {
+    lock_guard<mutex> lg(mx_);
+    if(!file_.load(std::memory_order_relaxed)){
+        return;
+    }
+    auto res = connections_.insert({ client_sock, next_connection_ });
+    if(res.second){
+        ++next_connection_;
+    }
+    write(res.first->second, direction, data, size);
+}
+
+void capture_file_t::clear_from(int client_sock) {
+    lock_guard<mutex> lg(mx_);
+    auto it = connections_.find(client_sock);
+    if(it == connections_.end()){
+        return;
+    }
+    uint32_t connection = it->second;
+    connections_.erase(it);
+    if(file_.load(std::memory_order_relaxed)){
+        // called while the peer is dropped, a failure only stops the capture
+        try{
+            write(connection, connection_end, nullptr, 0);
+        } catch(...){}
+    }
+}
+
+string capture_file_t::summary() {
+    lock_guard<mutex> lg(mx_);
+    return std::to_string(chunks_) + " chunks, " + std::to_string(bytes_) + " bytes in "
+            + std::to_string(next_connection_) + " connections";
+}
+
+bool read_chunk(FILE *file, chunk_header_t *header, string *data) {
+    if(std::fread(header, sizeof(*header), 1, file) != 1){
+        return false;
+    }
+    data->resize(header->size);
+    return !header->size || std::fread(&(*data)[0], header->size, 1, file) == 1;
+}
+
+}
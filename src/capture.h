@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+#include "system/sys_caller.h"
+
+namespace capture_nms {
+
+using std::string;
+using std::unordered_map;
+using std::mutex;
+using std::lock_guard;
+using steady_clock_t = std::chrono::steady_clock;
+
+const char file_magic[8] = "PGCAP01";
+
+// directions of the chunks, the end of a connection has no data
+const uint8_t from_client = 'C';
+const uint8_t from_server = 'S';
+const uint8_t connection_end = 'E';
+
+// precedes the data of a chunk in the file, in the host byte order
+struct __attribute__((packed)) chunk_header_t {
+    uint64_t ns;            // since the capture started
+    uint32_t connection;    // numbered in the order of their first chunks
+    uint8_t direction;
+    uint32_t size;
+};
+
+// both directions of every connection as timestamped chunks, in the order the loggers read them
+class capture_file_t : protected sys_caller_t {
+    std::atomic<FILE *> file_ = { nullptr };     // changed under the lock, read without it by active
+    mutex mx_;
+    steady_clock_t::time_point start_;
+    unordered_map<int, uint32_t> connections_;      // by the client socket
+    uint32_t next_connection_ = 0;
+    uint64_t chunks_ = 0;
+    uint64_t bytes_ = 0;
+
+    void write(uint32_t connection, uint8_t direction, const void *data, uint32_t size);
+
+public:
+
+    explicit capture_file_t(const std::function<void (const char *)> &message_f)
+        : sys_caller_t(message_f) {}
+
+    ~capture_file_t() { close(); }
+
+    // a hint for the loggers to skip the lock, add checks again
+    bool active() const { return file_.load(std::memory_order_relaxed); }
+
+    // returns false if the file can't be created; it is readable by the owner only,
+    // as it holds the passwords and the data of the clients
+    bool open(const string &path);
+
+    void close();
+
+    // throws if the file can't be written, the capture is stopped then
+    void add(int client_sock, uint8_t direction, const int8_t *data, unsigned size);
+
+    void clear_from(int client_sock);
+
+    string summary();
+};
+
+// the next chunk of a capture opened for reading past the magic,
+// false at the end of the file or on a truncated chunk
+bool read_chunk(FILE *file, chunk_header_t *header, string *data);
+
+}
+
+using capture_nms::capture_file_t;
@@ -3,12 +3,21 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <climits>
 #include <string>
 #include <iostream>
 #include <memory>
 #include <thread>
 #include <atomic>
 #include <mutex>
+#include <vector>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
 
 #include "proxy.h"
 
@@ -24,10 +33,105 @@ inline void show_message(const char *message) {
     cout << message << std::endl;
 }
 
+const int no_request = 0;
+const int stop_request = 1;
+const int hand_over_request = 2;
+const int stats_request = 3;
+const int trace_request = 4;
+const int trace_dump_request = 5;
+
 class console_t {
     unique_ptr<proxy_t> proxy_;
     signal_t error_signal_;
     bool args_ok_;
+    bool hand_over_from_ = false;
+    bool newline_pending_ = false;      // left in cin after the start command
+    pid_t child_ = -1;                  // the process the connections are being handed over to
+    std::vector<std::string> args_;
+
+    // waits for an error or the user's input, returns what the user asked for
+    int wait_user_request() {
+        std::atomic_int user_request = { no_request };
+        std::thread user_thread;
+        try{
+            user_thread = std::thread([&user_request, e_signal = &error_signal_
+                                       , skip_newline = newline_pending_](){
+                try{
+                    if(skip_newline){
+                        cin.ignore();
+                    }
+                    std::string line;
+                    std::getline(cin, line);
+                    user_request.store(line == "u" ? hand_over_request
+                                       : line == "i" ? stats_request
+                                       : line == "t" ? trace_request
+                                       : line == "d" ? trace_dump_request : stop_request
+                                       , std::memory_order_release);
+                    e_signal->notify_all();
+                } catch(const std::exception &e){
+                    show_message("exception in the console input thread: ");
+                    show_message(e.what());
+                } catch(...){
+                    show_message("unknown exception in the console input thread");
+                }
+            });
+            error_signal_.wait();
+        } catch(const std::exception &e){
+            cout << "exception: " << e.what() << std::endl;
+        }
+        int request = user_request.load(std::memory_order_acquire);
+        if(request == no_request){
+            cin.putback('\n');
+        }
+        if(user_thread.joinable()){
+            user_thread.join();
+        }
+        newline_pending_ = false;
+        error_signal_.reset();
+        return request;
+    }
+
+    std::string hand_over_path() const { return "proxy_hand_over." + std::to_string(::getpid()); }
+
+    // starts this binary again with the same options, taking the connections over from path
+    bool spawn(const std::string &path) {
+        std::vector<std::string> args = args_;
+        args.push_back("-ho");
+        args.push_back(path);
+        std::vector<char *> argv;
+        for(auto &a : args){
+            argv.push_back(&a[0]);
+        }
+        argv.push_back(nullptr);
+        cout.flush();
+        pid_t pid = ::fork();
+        if(pid == 0){
+#ifdef SYS_close_range
+            if(::syscall(SYS_close_range, 3u, ~0u, 0) == -1)
+#endif
+            {
+                for(long fd = 3, max = ::sysconf(_SC_OPEN_MAX); fd < max; ++fd){
+                    ::close(fd);
+                }
+            }
+            ::execv("/proc/self/exe", argv.data());
+            ::_exit(127);
+        }
+        if(pid == -1){
+            show_message("can't start a new process");
+        }
+        child_ = pid;
+        return pid != -1;
+    }
+
+    // the new process of a failed hand over may still wait for the go record, it is never let run
+    void reap_child() {
+        if(child_ != -1){
+            ::kill(child_, SIGKILL);
+            while(::waitpid(child_, nullptr, 0) == -1 && errno == EINTR){}
+            child_ = -1;
+        }
+    }
 
 public:
 
@@ -36,7 +140,21 @@ public:
         uint16_t srv_port = 5432;
         in_addr srv_host;
         inet_aton("127.0.0.1", &srv_host);
+        std::string proxy_path;     // unix sockets instead of TCP
+        std::string srv_path;
+        std::vector<std::string> replicas;   // host[:port] or unix socket paths
+        std::string mirror;                  // the same for the shadow server
+        proxy_settings_t settings;
+        const char *socket_profile = "none";
+        unsigned socket_buffers = UINT_MAX;     // overrides the profile
         bool no_opts = argc < 2;
+        for(int i = 0; i < argc; ++i){
+            if(std::strcmp(argv[i], "-ho") == 0 && i + 1 < argc){
+                ++i;
+            } else{
+                args_.push_back(argv[i]);
+            }
+        }
         args_ok_ = argc % 2 && !no_opts;
         const auto get_port = [](uint16_t *dest, const char *src){
             int port = std::atoi(src);
@@ -46,22 +164,160 @@ public:
             }
             return ok;
         };
+        const auto get_number = [](unsigned *dest, const char *src){
+            char *end;
+            auto val = std::strtoul(src, &end, 10);
+            bool ok = *src && !*end && val <= UINT32_MAX;
+            if(ok){
+                *dest = static_cast<unsigned>(val);
+            }
+            return ok;
+        };
         const char *arg = nullptr;
         for(int i = 1; i < argc && args_ok_; ++i){
             arg = argv[i++];
             if(std::strcmp(arg, "-p") == 0){
-                args_ok_ = get_port(&proxy_port, argv[i]);
+                if(std::strchr(argv[i], '/')){
+                    proxy_path = argv[i];
+                } else{
+                    args_ok_ = get_port(&proxy_port, argv[i]);
+                }
+            } else if(std::strcmp(arg, "-sh") == 0 && std::strchr(argv[i], '/')){
+                srv_path = argv[i];
             } else if(std::strcmp(arg, "-sh") == 0){
                 auto host = gethostbyname(argv[i]);
                 if((args_ok_ = host)){
                     srv_host.s_addr = *reinterpret_cast<uint32_t *>(host->h_addr);
                 }
+            } else if(std::strcmp(arg, "-rh") == 0){
+                if((args_ok_ = argv[i])){
+                    replicas.push_back(argv[i]);
+                }
+            } else if(std::strcmp(arg, "-mh") == 0){
+                if((args_ok_ = argv[i])){
+                    mirror = argv[i];
+                }
+            } else if(std::strcmp(arg, "-mb") == 0){
+                args_ok_ = get_number(&settings.mirror_backlog, argv[i]) && settings.mirror_backlog;
             } else if(std::strcmp(arg, "-sp") == 0){
                 args_ok_ = get_port(&srv_port, argv[i]);
+            } else if(std::strcmp(arg, "-mq") == 0){
+                args_ok_ = get_number(&settings.connection_quota, argv[i]);
+            } else if(std::strcmp(arg, "-st") == 0){
+                args_ok_ = get_number(&settings.spill_threshold, argv[i]);
+            } else if(std::strcmp(arg, "-lm") == 0){
+                if((args_ok_ = argv[i]
+                        && std::strspn(argv[i], postgre_msg_nms::all_message_types) == std::strlen(argv[i]))){
+                    settings.logged_messages = argv[i];
+                }
+            } else if(std::strcmp(arg, "-pc") == 0){
+                unsigned populate = 0;
+                if((args_ok_ = get_number(&populate, argv[i]) && populate <= 1)){
+                    settings.populate_cache = populate;
+                }
+            } else if(std::strcmp(arg, "-ho") == 0){
+                if((args_ok_ = argv[i])){
+                    settings.hand_over_from = argv[i];
+                    hand_over_from_ = true;
+                }
+            } else if(std::strcmp(arg, "-lb") == 0){
+                args_ok_ = get_number(&settings.listen_backlog, argv[i]) && settings.listen_backlog;
+            } else if(std::strcmp(arg, "-ab") == 0){
+                args_ok_ = get_number(&settings.accept_budget, argv[i]) && settings.accept_budget;
+            } else if(std::strcmp(arg, "-da") == 0){
+                args_ok_ = get_number(&settings.defer_accept, argv[i]);
+            } else if(std::strcmp(arg, "-fo") == 0){
+                args_ok_ = get_number(&settings.fast_open, argv[i]);
+            } else if(std::strcmp(arg, "-sk") == 0){
+                if((args_ok_ = argv[i] && named_profile(argv[i], &settings.socket_profile))){
+                    socket_profile = argv[i];
+                }
+            } else if(std::strcmp(arg, "-sb") == 0){
+                args_ok_ = get_number(&socket_buffers, argv[i]);
+            } else if(std::strcmp(arg, "-rc") == 0){
+                args_ok_ = get_number(&settings.result_cache_ttl, argv[i]);
+            } else if(std::strcmp(arg, "-rp") == 0){
+                // the rest of the memory cache is left for the transfers
+                args_ok_ = get_number(&settings.result_cache_pages, argv[i])
+                        && settings.result_cache_pages <= proxy_nms::cache_size / 4;
+            } else if(std::strcmp(arg, "-bc") == 0){
+                args_ok_ = get_number(&settings.max_backends, argv[i]);
+            } else if(std::strcmp(arg, "-bw") == 0){
+                args_ok_ = get_number(&settings.backend_wait, argv[i]);
+            } else if(std::strcmp(arg, "-cr") == 0){
+                args_ok_ = get_number(&settings.client_rate, argv[i]);
+            } else if(std::strcmp(arg, "-cb") == 0){
+                args_ok_ = get_number(&settings.client_burst, argv[i]);
+            } else if(std::strcmp(arg, "-cp") == 0){
+                if((args_ok_ = argv[i] && cpu_placement_nms::known_policy(argv[i]))){
+                    settings.cpu_policy = argv[i];
+                }
+            } else if(std::strcmp(arg, "-ca") == 0){
+                if((args_ok_ = argv[i] && cpu_placement_nms::valid_override(argv[i]))){
+                    settings.cpu_roles.push_back(argv[i]);
+                }
+            } else if(std::strcmp(arg, "-cf") == 0){
+                if((args_ok_ = argv[i])){
+                    settings.capture_path = argv[i];
+                }
+            } else if(std::strcmp(arg, "-sf") == 0){
+                if((args_ok_ = argv[i])){
+                    settings.spill_path = argv[i];
+                }
             } else{
                 args_ok_ = false;
             }
         }
+        // a directory holds the PostgreSQL socket named after the port
+        const auto socket_path = [srv_port](std::string path){
+            struct stat st;
+            if(::stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)){
+                path += "/.s.PGSQL." + std::to_string(srv_port);
+            }
+            return path;
+        };
+        if(!srv_path.empty()){
+            srv_path = socket_path(srv_path);
+        }
+        endpoint_t proxy_addr = endpoint_t::inet(htonl(INADDR_ANY), htons(proxy_port));
+        endpoint_t srv_addr = endpoint_t::inet(srv_host.s_addr, htons(srv_port));
+        if(args_ok_ && !proxy_path.empty() && !endpoint_t::local(proxy_path, &proxy_addr)){
+            args_ok_ = false;
+            arg = "-p";
+        }
+        if(args_ok_ && !srv_path.empty() && !endpoint_t::local(srv_path, &srv_addr)){
+            args_ok_ = false;
+            arg = "-sh";
+        }
+        const auto server_addr = [&](const std::string &server, endpoint_t *addr){
+            if(server.find('/') != std::string::npos){
+                return endpoint_t::local(socket_path(server), addr);
+            }
+            auto colon = server.rfind(':');
+            uint16_t port = srv_port;
+            auto host = gethostbyname(server.substr(0, colon).c_str());
+            bool ok = host && (colon == std::string::npos || get_port(&port, server.c_str() + colon + 1));
+            if(ok){
+                *addr = endpoint_t::inet(*reinterpret_cast<uint32_t *>(host->h_addr), htons(port));
+            }
+            return ok;
+        };
+        for(const auto &replica : replicas){
+            endpoint_t addr;
+            args_ok_ = args_ok_ && server_addr(replica, &addr);
+            if(!args_ok_){
+                arg = "-rh";
+                break;
+            }
+            settings.replicas.push_back(addr);
+        }
+        if(args_ok_ && !mirror.empty() && !server_addr(mirror, &settings.mirror)){
+            args_ok_ = false;
+            arg = "-mh";
+        }
+        if(socket_buffers != UINT_MAX){
+            settings.socket_profile.buffer_size = socket_buffers;
+        }
         if(!args_ok_){
             if(no_opts){
                 //cout << "no command line options supplied\n";
@@ -73,18 +329,64 @@ public:
                 msg += "\"\n";
                 cout << msg;
             }
-            cout << "usage: proxy -p <listening_port> "
-                         "-sh <server_host> -sp <server_port>\n";
+            cout << "usage: proxy -p <listening_port | unix_socket_path> "
+                         "-sh <server_host | unix_socket_path> -sp <server_port> "
+                         "[-rh <replica_host[:port] | unix_socket_path> ...] "
+                         "[-mq <connection_quota_pages>] "
+                         "[-st <logging_spill_threshold_pages>] [-sf <spill_file>] "
+                         "[-pc <populate_memory_cache 0|1>] "
+                         "[-lb <listen_backlog>] [-ab <accept_budget>] "
+                         "[-da <defer_accept_seconds>] [-fo <fast_open_queue>] "
+                         "[-sk <socket_profile, one of "
+                      << socket_profile_nms::profile_names << ">] [-sb <socket_buffer_bytes>] "
+                         "[-rc <result_cache_ttl_ms>] [-rp <result_cache_pages>] "
+                         "[-mh <shadow_host[:port] | unix_socket_path>] [-mb <mirror_backlog_bytes>] "
+                         "[-bc <max_server_connections>] [-bw <server_connection_wait_ms>] "
+                         "[-cr <client_address_connections_per_s>] [-cb <client_address_burst>] "
+                         "[-cp <cpu_placement, one of "
+                      << cpu_placement_nms::policy_names << ">] [-ca <role>=<cpu_list>, a role is one of "
+                      << cpu_placement_nms::role_help << "] "
+                         "[-cf <capture_file>] "
+                         "[-lm <logged_message_types, any of "
+                      << postgre_msg_nms::all_message_types << ">]\n";
         }
         cout << "current parameters:"
-                  << "\nproxy listening port: " << proxy_port
-                  << "\npostgres server host: " << inet_ntoa(srv_host)
-                  << "\npostgres server port: " << srv_port << std::endl;
-        proxy_port = htons(proxy_port);
-        srv_port = htons(srv_port);
-        proxy_ = std::make_unique<proxy_t>(&error_signal_, show_message
-                                           , htonl(INADDR_ANY), proxy_port
-                                           , srv_host.s_addr, srv_port);
+                  << "\nproxy listening on: " << proxy_addr.to_string()
+                  << "\npostgres server: " << srv_addr.to_string();
+        for(const auto &addr : settings.replicas){
+            cout << "\nread-only replica: " << addr.to_string();
+        }
+        if(!settings.capture_path.empty()){
+            cout << "\ncapture file: " << settings.capture_path;
+        }
+        cout << "\ncpu placement: " << settings.cpu_policy;
+        for(const auto &r : settings.cpu_roles){
+            cout << "\ncpus of " << r;
+        }
+        if(settings.mirror.size()){
+            cout << "\nshadow server: " << settings.mirror.to_string()
+                 << "\nmirror backlog: " << settings.mirror_backlog << " bytes";
+        }
+        cout
+                  << "\nconnection quota: " << settings.connection_quota << " pages"
+                  << "\nlogging spill threshold: " << settings.spill_threshold << " pages"
+                  << "\nspill file: " << settings.spill_path
+                  << "\nlogged messages: " << settings.logged_messages
+                  << "\npopulate memory cache: " << settings.populate_cache
+                  << "\nlisten backlog: " << settings.listen_backlog
+                  << "\naccept budget: " << settings.accept_budget
+                  << "\ndefer accept: " << settings.defer_accept << " s"
+                  << "\nfast open queue: " << settings.fast_open
+                  << "\nsocket profile: " << socket_profile
+                  << "\nsocket buffers: " << settings.socket_profile.buffer_size << " bytes"
+                  << "\nresult cache ttl: " << settings.result_cache_ttl << " ms"
+                  << "\nresult cache: " << settings.result_cache_pages << " pages"
+                  << "\nmax server connections: " << settings.max_backends
+                  << "\nserver connection wait: " << settings.backend_wait << " ms"
+                  << "\nclient address rate: " << settings.client_rate << " per s, burst "
+                  << (settings.client_burst ? settings.client_burst : settings.client_rate) << std::endl;
+        proxy_ = std::make_unique<proxy_t>(&error_signal_, show_message, proxy_addr, srv_addr
+                                           , settings);
     }
 
     int exec() {
@@ -97,37 +399,52 @@ public:
             } else{
                 cout << "enter \"q\" to quit\n"
                         "enter \"s\" to start proxy "
-                        "(press \"Return\" to stop it)\n";
+                        "(press \"Return\" to stop it, "
+                        "enter \"i\" to show its statistics, "
+                        "\"t\" to switch tracing on or off, \"d\" to dump the trace, "
+                        "enter \"u\" to hand the connections over to a new process)\n";
                 cin >> input;
+                newline_pending_ = true;
             }
             if(input == "q"){
                 return 0;
             } else if(input == "s"){
-                std::atomic_int user_interrupt = { 0 };
-                std::thread user_thread;
+                bool started = false;
                 try{
-                    user_thread = std::thread([&user_interrupt, e_signal = &error_signal_](){
-                        try{
-                            cin.ignore();
-                            cin.get();
-                            user_interrupt.store(1, std::memory_order_release);
-                            e_signal->notify_all();
-                        } catch(const std::exception &e){
-                            show_message("exception in the console input thread: ");
-                            show_message(e.what());
-                        } catch(...){
-                            show_message("unknown exception in the console input thread");
-                        }
-                    });
                     proxy_->start();
-                    error_signal_.wait();
+                    started = true;
                 } catch(const std::exception &e){
                     cout << "exception: " << e.what() << std::endl;
                 }
-                if(!user_interrupt.load(std::memory_order_acquire)){
-                    cin.putback('\n');
+                if(!started && hand_over_from_){
+                    return 2;
+                }
+                hand_over_from_ = false;
+                while(started){
+                    int request = wait_user_request();
+                    if(request == hand_over_request){
+                        if(proxy_->hand_over(hand_over_path(), [this](const std::string &path){
+                                             return spawn(path); })){
+                            proxy_->stop();
+                            return 0;
+                        }
+                        reap_child();
+                        continue;
+                    }
+                    if(request == stats_request){
+                        proxy_->show_stats();
+                        continue;
+                    }
+                    if(request == trace_request){
+                        proxy_->switch_tracing();
+                        continue;
+                    }
+                    if(request == trace_dump_request){
+                        proxy_->dump_trace();
+                        continue;
+                    }
+                    break;
                 }
-                user_thread.join();
                 proxy_->stop();
                 error_signal_.reset();
                 continue;
@@ -35,6 +35,8 @@ public:
 
     void swap(destructoid_t &other) { action_.swap(other.action_); }
 
+    void dismiss() { action_ = action_t(); }
+
     template <class O> void append(const O &op) {
         action_t a([prev = get(), o = op](){ prev(); o(); });
         action_.swap(a);
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <algorithm>
+
+namespace latency_nms {
+
+using std::string;
+using std::vector;
+using std::unique_ptr;
+using std::atomic;
+
+// log-linear buckets: the values under 32 are exact, each power of two above is split in 16,
+// so a value is off by 1/16 at most; written by one thread, read by any
+class latency_histogram_t {
+    static const unsigned sub_bits = 4;
+    static const unsigned sub_cnt = 1 << sub_bits;
+
+public:
+
+    static const unsigned bucket_cnt = (64 - sub_bits + 1) * sub_cnt;
+
+private:
+
+    atomic<uint64_t> counts_[bucket_cnt];
+    atomic<uint64_t> max_ = { 0 };
+
+public:
+
+    latency_histogram_t() { reset(); }
+
+    static unsigned index(uint64_t val) {
+        if(val < 2 * sub_cnt){
+            return val;
+        }
+        const unsigned shift = 63 - __builtin_clzll(val) - sub_bits;
+        return (shift + 1) * sub_cnt + ((val >> shift) & (sub_cnt - 1));
+    }
+
+    // the highest value counted in the bucket
+    static uint64_t highest(unsigned idx) {
+        if(idx < 2 * sub_cnt){
+            return idx;
+        }
+        const unsigned shift = idx / sub_cnt - 1;
+        return ((uint64_t(sub_cnt + idx % sub_cnt) + 1) << shift) - 1;
+    }
+
+    // the only writer needs no read-modify-write
+    void record(uint64_t val) {
+        auto &count = counts_[index(val)];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if(max_.load(std::memory_order_relaxed) < val){
+            max_.store(val, std::memory_order_relaxed);
+        }
+    }
+
+    void add_to(vector<uint64_t> *counts, uint64_t *max) const {
+        for(unsigned idx = 0; idx < bucket_cnt; ++idx){
+            (*counts)[idx] += counts_[idx].load(std::memory_order_relaxed);
+        }
+        *max = std::max(*max, max_.load(std::memory_order_relaxed));
+    }
+
+    void reset() {
+        for(auto &count : counts_){
+            count.store(0, std::memory_order_relaxed);
+        }
+        max_.store(0, std::memory_order_relaxed);
+    }
+};
+
+// time the data spends in the proxy, from being written to a page by a receiver
+// to being sent on, a histogram per direction and thread sending it: the senders
+// and the receivers cutting through
+class latency_stats_t {
+    vector<unique_ptr<latency_histogram_t>> to_server_;
+    vector<unique_ptr<latency_histogram_t>> to_client_;
+
+    static string summary(const vector<unique_ptr<latency_histogram_t>> &histograms) {
+        vector<uint64_t> counts(latency_histogram_t::bucket_cnt, 0);
+        uint64_t max = 0;
+        for(const auto &h : histograms){
+            h->add_to(&counts, &max);
+        }
+        uint64_t total = 0;
+        for(auto count : counts){
+            total += count;
+        }
+        string res = std::to_string(total) + " sends";
+        if(!total){
+            return res;
+        }
+        const auto us = [](uint64_t ns){ return std::to_string(ns / 1000) + '.'
+                    + std::to_string(ns / 100 % 10) + " us"; };
+        unsigned idx = 0;
+        uint64_t seen = 0;
+        for(auto pct : { 50.0, 90.0, 99.0, 99.9 }){
+            const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(total * pct / 100 + 0.5));
+            while(seen + counts[idx] < rank){
+                seen += counts[idx++];
+            }
+            res += ", p" + (pct == 99.9 ? string("99.9") : std::to_string(static_cast<unsigned>(pct)))
+                    + ' ' + us(std::min(latency_histogram_t::highest(idx), max));
+        }
+        return res + ", max " + us(max);
+    }
+
+public:
+
+    explicit latency_stats_t(unsigned threads) {
+        for(auto h : { &to_server_, &to_client_ }){
+            for(unsigned i = 0; i < threads; ++i){
+                h->push_back(std::make_unique<latency_histogram_t>());
+            }
+        }
+    }
+
+    latency_histogram_t *histogram(bool to_server, unsigned thread_num) {
+        auto &h = to_server ? to_server_ : to_client_;
+        return h.at(thread_num).get();
+    }
+
+    string summary() const {
+        return "to the server: " + summary(to_server_) + "; to the clients: " + summary(to_client_);
+    }
+
+    void reset() {
+        for(auto h : { &to_server_, &to_client_ }){
+            for(auto &uptr : *h){
+                uptr->reset();
+            }
+        }
+    }
+};
+
+}
+
+using latency_nms::latency_histogram_t;
+using latency_nms::latency_stats_t;
@@ -3,18 +3,21 @@
 #include <memory>
 #include <utility>
 #include <mutex>
-#include <queue>
+#include <deque>
 #include <vector>
+#include <chrono>
+#include <cstdint>
 #include <cassert>
 
 #include "memory_pager.h"
+#include "spill_file.h"
 
 namespace buffer_nms {
 
 using std::shared_ptr;
 using std::mutex;
 using std::lock_guard;
-using std::queue;
+using std::deque;
 using std::vector;
 
 class buffer_t {
@@ -25,9 +28,11 @@ class buffer_t {
             shared_ptr<page_t> page;
             unsigned pos;
             unsigned data_size;
+            uint64_t ingress;   // when the oldest data not read yet was written, ns
         };
 
-        queue<node_t> queue_;
+        deque<node_t> queue_;
+        unsigned spilled_end_ = 0;
         mutex mx_;
         shared_ptr<page_t> last_page_{ nullptr };
         unsigned last_pos_;
@@ -36,9 +41,12 @@ class buffer_t {
 
         lane_t() {}
 
-        shared_ptr<page_t> page() {
+        shared_ptr<page_t> page(uint64_t *ingress) {
             assert(!queue_.empty());
             lock_guard<mutex> lg(mx_);
+            if(ingress){
+                *ingress = queue_.front().ingress;
+            }
             return queue_.front().page;
         }
 
@@ -53,29 +61,66 @@ class buffer_t {
                 }
                 last_page_ = queue_.front().page;
                 last_pos_ = queue_.front().pos;
-                queue_.pop();
+                last_page_->drop();
+                queue_.pop_front();
+                if(spilled_end_){
+                    --spilled_end_;
+                }
                 bytes_read = 0;
             }
             return 0;
         }
 
-        void put(shared_ptr<page_t> writer_page, unsigned data_size) {
+        // returns the number of pages queued in the lane
+        unsigned put(shared_ptr<page_t> writer_page, unsigned data_size, uint64_t ingress) {
             lock_guard<mutex> lg(mx_);
             if(!queue_.empty()){
                 auto &back = queue_.back();
                 if(back.page->data() == writer_page->data()){
+                    if(back.pos == back.data_size){
+                        back.ingress = ingress;
+                    }
                     back.data_size = data_size;
-                    return;
+                    return queue_.size();
                 }
             }
+            writer_page->hold();
             if(last_page_){
                 if(last_page_->data() == writer_page->data()){
-                    queue_.push({writer_page, last_pos_, data_size});
+                    queue_.push_back({writer_page, last_pos_, data_size, ingress});
                     last_page_ = nullptr;
-                    return;
+                    return queue_.size();
                 }
             }
-            queue_.push({writer_page, 0, data_size});
+            queue_.push_back({writer_page, 0, data_size, ingress});
+            return queue_.size();
+        }
+
+        // moves queued pages to the spill file, the front page may be in use
+        // by the reader and the back one by the writer, so both stay in memory
+        void spill(spill_file_t *spill) {
+            lock_guard<mutex> lg(mx_);
+            unsigned idx = spilled_end_ ? spilled_end_ : 1;
+            try{
+                for(; idx + 1 < queue_.size(); ++idx){
+                    auto &node = queue_[idx];
+                    auto page = spill->store(node.page->data(), node.data_size);
+                    if(!page){
+                        break;
+                    }
+                    // the marks go along; one of a header split over the next page comes
+                    // too late and is missed, the loggers pick the stream up at the next mark
+                    page->index().assign(node.page->index());
+                    node.page->drop();
+                    node.page = std::move(page);
+                }
+            } catch(...){}
+            spilled_end_ = idx;
+        }
+
+        unsigned size() {
+            lock_guard<mutex> lg(mx_);
+            return queue_.size();
         }
 
         unsigned pos() const {
@@ -89,35 +134,55 @@ class buffer_t {
 
     vector<lane_t> readers_lanes_;
     memory_pager_t *pager_;
+    shared_ptr<page_quota_t> quota_;
+    spill_file_t *spill_;
     unsigned writer_pos_;
     shared_ptr<page_t> writer_page_;
 
 public:
 
-    buffer_t(unsigned lane_cnt, memory_pager_t *pager)
-        : readers_lanes_(lane_cnt), pager_(pager), writer_pos_(pager->page_size()) {}
+    buffer_t(unsigned lane_cnt, memory_pager_t *pager, shared_ptr<page_quota_t> quota = nullptr
+             , spill_file_t *spill = nullptr)
+        : readers_lanes_(lane_cnt), pager_(pager), quota_(std::move(quota))
+        , spill_(spill && spill->threshold() && spill->lane() < lane_cnt ? spill : nullptr)
+        , writer_pos_(pager->page_size()) {}
+
+    page_quota_t *quota() const { return quota_.get(); }
+
+    // the clock the pages are stamped with when written
+    static uint64_t ingress_time() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
 
     unsigned advance_writer(unsigned bytes_written) {
         unsigned pos = writer_pos_ + bytes_written;
         unsigned page_size = pager_->page_size();
         assert(pos <= page_size);
         if(bytes_written){
-            for(auto &lane : readers_lanes_){
-                lane.put(writer_page_, pos);
+            const uint64_t now = ingress_time();
+            for(unsigned idx = 0; idx < readers_lanes_.size(); ++idx){
+                unsigned queued = readers_lanes_[idx].put(writer_page_, pos, now);
+                if(spill_ && idx == spill_->lane() && spill_->threshold() < queued){
+                    readers_lanes_[idx].spill(spill_);
+                }
             }
         }
         writer_pos_ = pos;
         if(writer_pos_ < page_size){
             return page_size - writer_pos_;
         }
-        writer_page_ = nullptr;
+        if(writer_page_){
+            writer_page_->drop();
+            writer_page_ = nullptr;
+        }
         writer_pos_ = 0;
         return page_size;
     }
 
     shared_ptr<page_t> writer_page() {
         if(!writer_page_){
-            writer_page_ = pager_->get_page();
+            writer_page_ = pager_->get_page(quota_);
         }
         return writer_page_;
     }
@@ -129,9 +194,14 @@ public:
         return readers_lanes_[lane_num].advance(bytes_read);
     }
 
-    shared_ptr<page_t> reader_page(unsigned lane_num) {
+    shared_ptr<page_t> reader_page(unsigned lane_num, uint64_t *ingress = nullptr) {
+        assert(lane_num < readers_lanes_.size());
+        return readers_lanes_[lane_num].page(ingress);
+    }
+
+    unsigned queued_pages(unsigned lane_num) {
         assert(lane_num < readers_lanes_.size());
-        return readers_lanes_[lane_num].page();
+        return readers_lanes_[lane_num].size();
     }
 
     unsigned reader_pos(unsigned lane_num) const {
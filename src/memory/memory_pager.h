@@ -5,60 +5,116 @@
 #include <memory>
 #include <utility>
 #include <atomic>
+#include <functional>
 
 #include "../synchronization/resource_waiter.h"
-#include "cache.h"
+#include "page_arena.h"
+#include "page_quota.h"
+#include "page_index.h"
 
 namespace pager_nms {
 
 using std::shared_ptr;
-using std::unique_ptr;
 using std::atomic_uint;
+using std::atomic_int;
+using std::function;
 
 class memory_pager_t {
-    const bool prefill_cache_;
-    cache_t<int8_t[]> memory_cache_;
+    page_arena_t memory_cache_;
     resource_waiter_t *memory_waiter_;
     const unsigned page_size_;
     atomic_uint release_counter_ = { 0 };
 
 public:
 
+    // a page counts against its quota while it is held by a buffer writer
+    // or queued in a buffer lane, see hold() and drop();
+    // pages with external memory (spilled to disk) are not cached and have no quota
     class page_t {
         memory_pager_t *parent_;
-        unique_ptr<int8_t[]> memory_;
+        int8_t *data_;
+        const bool external_;
+        function<void ()> on_free_;
+        shared_ptr<page_quota_t> quota_;
+        atomic_int buffer_refs_;
+        const unsigned generation_ = 0;     // of the arena when taken
+        page_index_t index_;
 
         page_t(const page_t &) = delete;
         page_t operator=(const page_t &) = delete;
 
     public:
 
-        page_t(memory_pager_t *parent, unique_ptr<int8_t[]> &&memory)
-            : parent_(parent), memory_(std::move(memory)) {}
+        page_t(memory_pager_t *parent, int8_t *data, const shared_ptr<page_quota_t> &quota
+               , unsigned generation)
+            : parent_(parent), data_(data), external_(false), quota_(quota), buffer_refs_(1)
+            , generation_(generation) {
+            if(quota_){
+                quota_->acquire();
+            }
+        }
+
+        page_t(memory_pager_t *parent, int8_t *data, function<void ()> &&on_free)
+            : parent_(parent), data_(data), external_(true), on_free_(std::move(on_free))
+            , buffer_refs_(1) {}
+
+        ~page_t() {
+            if(!external_){
+                try { parent_->free(data_, generation_); }catch(...) {}
+            } else if(on_free_){
+                on_free_();
+            }
+            if(quota_ && 0 < buffer_refs_.exchange(0)){
+                quota_->release();
+            }
+        }
+
+        void hold() { buffer_refs_.fetch_add(1, std::memory_order_relaxed); }
+
+        void drop() {
+            if(buffer_refs_.fetch_sub(1, std::memory_order_acq_rel) == 1 && quota_){
+                quota_->release();
+            }
+        }
+
+        int8_t *data() const { return data_; }
 
-        ~page_t() { try { parent_->free(memory_); }catch(...) {} }
+        unsigned size() const { return parent_->page_size(); }
 
-        int8_t *data() const { return memory_.get(); }
+        bool external() const { return external_; }
 
-        unsigned size() const { return parent_->page_size(); }
+        page_index_t &index() { return index_; }
+
+        const page_index_t &index() const { return index_; }
     };
 
     memory_pager_t(resource_waiter_t *memory_waiter, unsigned page_size
-            , unsigned cache_size, bool prefill_cache = true)
-        : prefill_cache_(prefill_cache)
-        , memory_cache_([page_size](){ return std::make_unique<int8_t[]>(page_size); }
-                        , cache_size, prefill_cache_)
+            , unsigned cache_size, bool populate_cache = false)
+        : memory_cache_(page_size, cache_size, populate_cache)
         , memory_waiter_(memory_waiter), page_size_(page_size) {}
 
-    shared_ptr<page_t> get_page() {
-        auto p = std::make_shared<page_t>(this, memory_cache_.take());
+    shared_ptr<page_t> get_page(const shared_ptr<page_quota_t> &quota = nullptr) {
+        unsigned generation = 0;
+        int8_t *data = memory_cache_.take(&generation);
+        shared_ptr<page_t> p;
+        try{
+            p = std::make_shared<page_t>(this, data, quota, generation);
+        } catch(...){
+            memory_cache_.store(data, generation);
+            throw;
+        }
         memory_waiter_->adjust_resource(-1);
         return p;
     }
 
-    void reset() {
+    shared_ptr<page_t> wrap_page(int8_t *data, function<void ()> on_free) {
+        return std::make_shared<page_t>(this, data, std::move(on_free));
+    }
+
+    // returns the number of cached pages still held, lost to the cache
+    unsigned reset() {
         release_counter_.store(0, std::memory_order_release);
-        memory_cache_.reset(prefill_cache_);
+        return memory_cache_.reset();
     }
 
     unsigned page_size() const { return page_size_; }
@@ -73,8 +129,8 @@ public:
 
 private:
 
-    void free(unique_ptr<int8_t[]> &memory) {
-        memory_cache_.store(memory);
+    void free(int8_t *data, unsigned generation) {
+        memory_cache_.store(data, generation);
         memory_waiter_->adjust_resource(1);
         release_counter_.fetch_add(1, std::memory_order_release);
     }
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <cstdint>
+#include <new>
+#include <mutex>
+#include <atomic>
+#include <memory>
+
+namespace arena_nms {
+
+using std::mutex;
+using std::lock_guard;
+using std::atomic_uint;
+using std::unique_ptr;
+
+// pages of one reserved mapping, faulted in on first use (or at once with populate);
+// pages returned are reused first, reset rewinds the indices once every page is back;
+// the pages still held at a reset are stamped with an older generation and not taken
+// back, they are lost to the arena; when the arena is exhausted pages come from the heap
+class page_arena_t {
+    const unsigned page_size_;
+    const unsigned size_;
+    int8_t *arena_;
+    unique_ptr<int8_t *[]> free_;
+    unsigned free_cnt_ = 0;
+    unsigned fresh_ = 0;            // pages from here on have never been taken
+    unsigned generation_ = 0;       // bumped by reset
+    atomic_uint available_;
+    mutex mx_;
+
+    bool owns(const int8_t *page) const {
+        return arena_ <= page && page < arena_ + size_t(size_) * page_size_;
+    }
+
+public:
+
+    page_arena_t(unsigned page_size, unsigned size, bool populate)
+        : page_size_(page_size), size_(size), free_(std::make_unique<int8_t *[]>(size))
+        , available_(size) {
+        void *map = ::mmap(nullptr, size_t(size_) * page_size_, PROT_READ | PROT_WRITE
+                           , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | (populate ? MAP_POPULATE : 0)
+                           , -1, 0);
+        if(map == MAP_FAILED){
+            throw std::bad_alloc();
+        }
+        arena_ = static_cast<int8_t *>(map);
+    }
+
+    ~page_arena_t() { ::munmap(arena_, size_t(size_) * page_size_); }
+
+    page_arena_t(const page_arena_t &) = delete;
+    page_arena_t &operator=(const page_arena_t &) = delete;
+
+    int8_t *take(unsigned *generation) {
+        if(available_.load(std::memory_order_acquire)){
+            lock_guard<mutex> lg(mx_);
+            *generation = generation_;
+            if(free_cnt_){
+                available_.fetch_sub(1, std::memory_order_relaxed);
+                return free_[--free_cnt_];
+            }
+            if(fresh_ < size_){
+                available_.fetch_sub(1, std::memory_order_relaxed);
+                return arena_ + size_t(fresh_++) * page_size_;
+            }
+        }
+        return new int8_t[page_size_];
+    }
+
+    void store(int8_t *page, unsigned generation) {
+        if(!owns(page)){
+            delete[] page;
+            return;
+        }
+        lock_guard<mutex> lg(mx_);
+        // a page held over a reset is free already and may have been given out again
+        if(generation != generation_ || size_ <= free_cnt_){
+            return;
+        }
+        free_[free_cnt_++] = page;
+        available_.fetch_add(1, std::memory_order_release);
+    }
+
+    // returns the number of pages still held, they are let go of and not stored back
+    unsigned reset() {
+        lock_guard<mutex> lg(mx_);
+        ++generation_;
+        const unsigned held = fresh_ - free_cnt_;
+        if(!held){
+            free_cnt_ = 0;
+            fresh_ = 0;
+            available_.store(size_, std::memory_order_release);
+        }
+        return held;
+    }
+
+    unsigned elements_available() const { return available_.load(std::memory_order_acquire); }
+
+    unsigned size() const { return size_; }
+};
+
+}
+
+using arena_nms::page_arena_t;
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <cstdint>
+
+namespace page_index_nms {
+
+using std::atomic_uint;
+using std::atomic_bool;
+using std::shared_ptr;
+using std::weak_ptr;
+
+// a message starting in a page, type 0 for the typeless startup packets
+struct message_mark_t {
+    uint16_t offset;
+    char type;
+    uint32_t length;    // as in the header, without the type byte
+};
+
+// message boundaries of a page, filled in by the buffer writer as data is copied in
+// and read by the lanes at the same time; the marks are hints for the readers,
+// a page with more messages than there is room for has only the first ones marked
+class page_index_t {
+    static const unsigned capacity = 16;
+
+    message_mark_t marks_[capacity];
+    atomic_uint count_ = { 0 };
+    atomic_uint end_ = { 0 };       // (offset past the last whole message << 8) | its type
+    atomic_bool broken_ = { false };
+
+public:
+
+    // false if the messages couldn't be followed, the page has no usable marks then
+    bool valid() const { return !broken_.load(std::memory_order_acquire); }
+
+    unsigned count() const { return count_.load(std::memory_order_acquire); }
+
+    const message_mark_t &mark(unsigned idx) const { return marks_[idx]; }
+
+    // the first message starting in [from, to) of a typed stream
+    const message_mark_t *first_from(unsigned from, unsigned to) const {
+        if(!valid()){
+            return nullptr;
+        }
+        for(unsigned i = 0, cnt = count(); i < cnt; ++i){
+            if(from <= marks_[i].offset && marks_[i].offset < to && marks_[i].type){
+                return &marks_[i];
+            }
+        }
+        return nullptr;
+    }
+
+    // true if the last message completed in the page ends at the offset and is of the type
+    bool ends_with(unsigned offset, char type) const {
+        unsigned end = end_.load(std::memory_order_acquire);
+        return end == (offset << 8 | static_cast<uint8_t>(type));
+    }
+
+    void add_mark(unsigned offset, char type, uint32_t length) {
+        unsigned cnt = count_.load(std::memory_order_relaxed);
+        if(cnt < capacity){
+            marks_[cnt] = { static_cast<uint16_t>(offset), type, length };
+            count_.store(cnt + 1, std::memory_order_release);
+        }
+    }
+
+    void set_end(unsigned offset, char type) {
+        end_.store(offset << 8 | static_cast<uint8_t>(type), std::memory_order_release);
+    }
+
+    void invalidate() { broken_.store(true, std::memory_order_release); }
+
+    // takes the marks of a page the indexer is done with, for a copy of its data
+    void assign(const page_index_t &other) {
+        const unsigned cnt = other.count();
+        std::copy(other.marks_, other.marks_ + cnt, marks_);
+        end_.store(other.end_.load(std::memory_order_acquire), std::memory_order_relaxed);
+        broken_.store(!other.valid(), std::memory_order_relaxed);
+        count_.store(cnt, std::memory_order_release);
+    }
+};
+
+// frames the stream written to a buffer and marks the pages; client streams start
+// with typeless packets, the server one may start with the answer to an encryption request
+template <class Page> class message_indexer_t {
+    static const uint32_t max_typeless_size = 10000;
+    static const uint32_t ssl_code = 80877103;
+    static const uint32_t gss_code = 80877104;
+
+    uint8_t header_[5];
+    unsigned header_len_ = 0;
+    uint32_t remaining_ = 0;
+    bool typeless_;
+    bool started_ = false;
+    bool lost_ = false;
+    weak_ptr<Page> start_page_;     // where the message being framed started
+    unsigned start_offset_ = 0;
+    uint8_t code_[4];               // of a typeless packet, tells an encryption request
+    unsigned code_len_ = 0;
+
+    unsigned header_size() const { return typeless_ ? 4 : 5; }
+
+    static uint32_t int4(const uint8_t *p) {
+        return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+    }
+
+    // the page is where the header started, null if it started in an earlier write
+    bool on_header(Page *page) {
+        uint32_t len = int4(header_ + (typeless_ ? 0 : 1));
+        if(len < 4 || (typeless_ && max_typeless_size < len)){
+            return false;
+        }
+        remaining_ = len - 4;
+        code_len_ = 0;
+        shared_ptr<Page> start_page;
+        if(!page && (start_page = start_page_.lock())){
+            page = start_page.get();
+        }
+        if(page){
+            page->index().add_mark(start_offset_, typeless_ ? 0 : header_[0], len);
+        }
+        start_page_.reset();
+        return true;
+    }
+
+    void on_message(Page *page, unsigned offset) {
+        page->index().set_end(offset, typeless_ ? 0 : header_[0]);
+        header_len_ = 0;
+        if(typeless_ && code_len_ == sizeof(code_)){
+            // the startup packet ends the typeless ones, encryption requests don't
+            uint32_t code = int4(code_);
+            typeless_ = code == ssl_code || code == gss_code;
+        }
+    }
+
+public:
+
+    explicit message_indexer_t(bool typeless_start) : typeless_(typeless_start) {}
+
+    // for a stream taken over in the middle
+    void lose() { lost_ = true; }
+
+    void feed(const shared_ptr<Page> &page, unsigned pos, const int8_t *data, unsigned size) {
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(data);
+        const uint8_t *end = p + size;
+        if(!started_ && p < end){
+            started_ = true;
+            // the server's answer to an encryption request, typed streams never start with these
+            if(!typeless_ && (*p == 'S' || *p == 'G')){
+                lost_ = true;
+            } else if(!typeless_ && *p == 'N'){
+                ++p;
+            }
+        }
+        bool header_here = false;
+        while(p < end && !lost_){
+            const unsigned offset = pos + (p - reinterpret_cast<const uint8_t *>(data));
+            if(header_len_ < header_size()){
+                if(header_len_ == 0){
+                    start_offset_ = offset;
+                    header_here = true;
+                    if(static_cast<unsigned>(end - p) < header_size()){
+                        start_page_ = page;
+                    }
+                }
+                header_[header_len_++] = *p++;
+                if(header_len_ == header_size()){
+                    if(!on_header(header_here ? page.get() : nullptr)){
+                        lost_ = true;
+                        break;
+                    }
+                    if(remaining_ == 0){
+                        on_message(page.get(), offset + 1);
+                    }
+                }
+                continue;
+            }
+            unsigned n = remaining_ < static_cast<unsigned>(end - p) ? remaining_ : end - p;
+            if(typeless_){
+                for(unsigned i = 0; i < n && code_len_ < sizeof(code_); ++i){
+                    code_[code_len_++] = p[i];
+                }
+            }
+            p += n;
+            remaining_ -= n;
+            if(remaining_ == 0){
+                on_message(page.get(), offset + n);
+            }
+        }
+        if(lost_){
+            page->index().invalidate();
+        }
+    }
+};
+
+}
+
+using page_index_nms::page_index_t;
+using page_index_nms::message_mark_t;
+using page_index_nms::message_indexer_t;
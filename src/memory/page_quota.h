@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <utility>
+
+namespace quota_nms {
+
+using std::atomic_int;
+using std::atomic_uint;
+using std::mutex;
+using std::lock_guard;
+using std::function;
+
+// pages held by one connection; a connection over its limit gets throttled
+// and on_release is called once it has drained to 3/4 of the limit
+class page_quota_t {
+    const int limit_;
+    atomic_int cap_;
+    atomic_int pages_ = { 0 };
+    atomic_uint throttled_ = { 0 };
+    function<void ()> on_release_;
+    mutex mx_;
+
+    int resume_level() const {
+        int cap = cap_.load(std::memory_order_relaxed);
+        return cap - cap / 4;
+    }
+
+    void check_release() {
+        if(pages_.load() < resume_level() && throttled_.exchange(0)){
+            cap_.store(limit_, std::memory_order_relaxed);
+            lock_guard<mutex> lg(mx_);
+            if(on_release_){
+                on_release_();
+            }
+        }
+    }
+
+public:
+
+    page_quota_t(unsigned limit, function<void ()> on_release)
+        : limit_(limit), cap_(limit), on_release_(std::move(on_release)) {}
+
+    void acquire() { pages_.fetch_add(1); }
+
+    void release() {
+        pages_.fetch_sub(1);
+        if(throttled_.load()){
+            check_release();
+        }
+    }
+
+    bool exceeded() const {
+        return limit_
+                && cap_.load(std::memory_order_relaxed) <= pages_.load(std::memory_order_relaxed);
+    }
+
+    void throttle() {
+        throttled_.store(1);
+        check_release();
+    }
+
+    // temporarily lowers the limit to half of what is held now,
+    // returns false if the limit has been lowered already
+    bool squeeze() {
+        if(cap_.load(std::memory_order_relaxed) != limit_){
+            return false;
+        }
+        int half = pages_.load(std::memory_order_relaxed) / 2;
+        cap_.store(half ? half : 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void detach() {
+        lock_guard<mutex> lg(mx_);
+        on_release_ = nullptr;
+    }
+
+    unsigned pages() const { return pages_.load(std::memory_order_relaxed); }
+
+    unsigned limit() const { return limit_; }
+};
+
+}
+
+using quota_nms::page_quota_t;
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <vector>
+
+#include "memory_pager.h"
+#include "../system/sys_caller.h"
+
+namespace spill_nms {
+
+using std::shared_ptr;
+using std::mutex;
+using std::lock_guard;
+using std::atomic_uint;
+
+const size_t spill_grow_step = 64 * 1024 * 1024;   // bytes
+
+// unlinked file mapped into memory, pages of a lagging lane are copied here
+// so that their pager memory can be reused; the pages read are reused first,
+// the file is rewound once every spilled page has been read
+class spill_file_t : protected sys_caller_t {
+    memory_pager_t *pager_;
+    const unsigned lane_num_;
+    const unsigned threshold_;
+    const size_t max_size_;
+    int fd_ = -1;
+    int8_t *map_ = nullptr;
+    size_t file_size_ = 0;
+    size_t offset_ = 0;
+    std::vector<size_t> free_;      // offsets of the pages read, below offset_
+    bool full_ = false;             // reported once until a page is read
+    atomic_uint live_ = { 0 };
+    atomic_uint spilled_ = { 0 };
+    mutex mx_;
+
+    void release(size_t offset) {
+        lock_guard<mutex> lg(mx_);
+        full_ = false;
+        if(live_.fetch_sub(1) == 1){
+            offset_ = 0;
+            free_.clear();
+        } else{
+            free_.push_back(offset);
+        }
+    }
+
+public:
+
+    spill_file_t(const std::function<void (const char *)> &message_f, memory_pager_t *pager
+                 , unsigned lane_num, unsigned threshold, size_t max_size)
+        : sys_caller_t(message_f), pager_(pager), lane_num_(lane_num), threshold_(threshold)
+        , max_size_(max_size - max_size % pager->page_size()) {}
+
+    ~spill_file_t() { close(); }
+
+    unsigned lane() const { return lane_num_; }
+
+    unsigned threshold() const { return threshold_; }
+
+    unsigned pages_spilled() const { return spilled_.load(std::memory_order_relaxed); }
+
+    void open(const char *path) {
+        if(!threshold_ || map_){
+            return;
+        }
+        fd_ = sys_caller_t::open(throw_on_error, path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        unlink(message_on_error, path);
+        void *map = ::mmap(nullptr, max_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if(map == MAP_FAILED){
+            int error = errno;
+            sys_caller_t::close(message_on_error, fd_);
+            fd_ = -1;
+            throw_error("map spill file", error);
+        }
+        map_ = static_cast<int8_t *>(map);
+        file_size_ = offset_ = 0;
+        free_.clear();
+        free_.reserve(max_size_ / pager_->page_size());
+        full_ = false;
+        spilled_.store(0, std::memory_order_relaxed);
+    }
+
+    void close() {
+        if(!map_){
+            return;
+        }
+        if(live_.load()){
+            show_message("spill file is still in use, leaving it mapped");
+            return;
+        }
+        ::munmap(map_, max_size_);
+        sys_caller_t::close(message_on_error, fd_);
+        map_ = nullptr;
+        fd_ = -1;
+    }
+
+    shared_ptr<page_t> store(const int8_t *data, unsigned size) {
+        const unsigned page_size = pager_->page_size();
+        size_t offset;
+        {
+            lock_guard<mutex> lg(mx_);
+            if(!map_){
+                return nullptr;
+            }
+            if(!free_.empty()){
+                offset = free_.back();
+                free_.pop_back();
+            } else{
+                if(max_size_ < offset_ + page_size){
+                    if(!full_){
+                        full_ = true;
+                        show_message("spill file is full, the lagging lanes keep their memory");
+                    }
+                    return nullptr;
+                }
+                if(file_size_ < offset_ + page_size){
+                    size_t new_size = file_size_ + spill_grow_step;
+                    if(max_size_ < new_size){
+                        new_size = max_size_;
+                    }
+                    if(ftruncate(message_on_error, fd_, new_size) == -1){
+                        return nullptr;
+                    }
+                    file_size_ = new_size;
+                }
+                offset = offset_;
+                offset_ += page_size;
+            }
+            live_.fetch_add(1);
+        }
+        int8_t *dest = map_ + offset;
+        memcpy(dest, data, size);
+        spilled_.fetch_add(1, std::memory_order_relaxed);
+        return pager_->wrap_page(dest, [this, offset](){ release(offset); });
+    }
+};
+
+}
+
+using spill_nms::spill_file_t;
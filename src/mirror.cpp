@@ -0,0 +1,277 @@
+#include "mirror.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <cerrno>
+#include <algorithm>
+
+namespace mirror_nms {
+
+namespace {
+
+const uint32_t protocol_major = 3;
+const unsigned max_events = 64;
+const unsigned drain_size = 65536;
+
+inline uint32_t int4(const void *data) {
+    auto p = static_cast<const uint8_t *>(data);
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+}
+
+inline bool would_block() { return errno == EAGAIN || errno == EWOULDBLOCK; }
+
+}
+
+string mirror_stats_t::summary() const {
+    return std::to_string(mirrored.load(std::memory_order_relaxed)) + " bytes in "
+            + std::to_string(sessions.load(std::memory_order_relaxed)) + " sessions, dropped "
+            + std::to_string(dropped.load(std::memory_order_relaxed)) + " bytes, failed sessions "
+            + std::to_string(failed.load(std::memory_order_relaxed)) + ", responses discarded "
+            + std::to_string(discarded.load(std::memory_order_relaxed)) + " bytes";
+}
+
+void mirror_link_t::close_sock() {
+    if(sock_ != -1){
+        close(message_on_error, sock_);
+        sock_ = -1;
+    }
+}
+
+bool mirror_link_t::connect(const endpoint_t &shadow, int epoll_fd, int key, mirror_stats_t *stats) {
+    close_sock();
+    connected_at_ = steady_clock_t::now();
+    sock_ = socket(message_on_error, shadow.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    // a refused connect shows on the next send or read
+    bool ok = sock_ != -1
+            && (sys_caller_t::connect(message_on_error, sock_, shadow.addr(), shadow.size()) == 0
+                || errno == EINPROGRESS);
+    if(ok && !shadow.is_local()){
+        int opt = 1;
+        setsockopt(message_on_error, sock_, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    }
+    if(ok){
+        epoll_event ee;
+        ee.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ee.data.fd = key;
+        ok = epoll_ctl(message_on_error, epoll_fd, EPOLL_CTL_ADD, sock_, &ee) == 0;
+    }
+    if(!ok){
+        close_sock();
+        stats->failed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    stats->sessions.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void mirror_link_t::lose(mirror_stats_t *stats) {
+    close_sock();
+    stats->dropped.fetch_add(backlog_.size(), std::memory_order_relaxed);
+    backlog_.clear();
+    if(state_ == live){
+        state_ = lost;
+    }
+}
+
+void mirror_link_t::emit(const int8_t *data, unsigned size, unsigned backlog_max
+                         , mirror_stats_t *stats) {
+    if(state_ != live){
+        stats->dropped.fetch_add(size, std::memory_order_relaxed);
+        return;
+    }
+    if(backlog_.empty()){
+        ssize_t res = send(message_on_error, sock_, data, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(0 < res){
+            stats->mirrored.fetch_add(res, std::memory_order_relaxed);
+            data += res;
+            size -= res;
+        } else if(res == -1 && !would_block()){
+            stats->failed.fetch_add(1, std::memory_order_relaxed);
+            lose(stats);
+            stats->dropped.fetch_add(size, std::memory_order_relaxed);
+            return;
+        }
+    }
+    if(size){
+        if(backlog_.size() + size <= backlog_max){
+            backlog_.append(reinterpret_cast<const char *>(data), size);
+        } else{
+            // the shadow lags, the rest of its session can't be kept in step
+            lose(stats);
+            stats->dropped.fetch_add(size, std::memory_order_relaxed);
+        }
+    }
+}
+
+void mirror_link_t::flush(mirror_stats_t *stats) {
+    size_t sent = 0;
+    while(sent < backlog_.size() && state_ == live){
+        ssize_t res = send(message_on_error, sock_, backlog_.data() + sent, backlog_.size() - sent
+                           , MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(0 < res){
+            stats->mirrored.fetch_add(res, std::memory_order_relaxed);
+            sent += res;
+        } else if(res == -1 && would_block()){
+            break;
+        } else{
+            stats->failed.fetch_add(1, std::memory_order_relaxed);
+            lose(stats);
+            return;
+        }
+    }
+    backlog_.erase(0, sent);
+}
+
+void mirror_link_t::on_startup(const endpoint_t &shadow, int epoll_fd, int key
+                               , mirror_stats_t *stats) {
+    // encryption and cancel requests aren't replayed, the primary's answers aren't seen here
+    if(startup_.size() < 8 || int4(startup_.data() + 4) >> 16 != protocol_major){
+        stats->dropped.fetch_add(startup_.size(), std::memory_order_relaxed);
+        startup_.clear();
+        state_ = off;
+        return;
+    }
+    framer_.typeless = false;
+    state_ = lost;
+    if(connect(shadow, epoll_fd, key, stats)){
+        state_ = live;
+        backlog_ = startup_;
+        flush(stats);
+    }
+}
+
+void mirror_link_t::on_header(const endpoint_t &shadow, int epoll_fd, int key, unsigned backlog_max
+                              , mirror_stats_t *stats) {
+    const unsigned header_size = framer_.header_size();
+    if(state_ == starting){
+        if(max_startup_size < framer_.remaining){
+            state_ = off;
+        } else{
+            startup_.assign(reinterpret_cast<const char *>(framer_.header), header_size);
+        }
+        return;
+    }
+    const char type = framer_.type();
+    // the shadow authenticates the session on its own
+    forward_ = type != 'p';
+    if(forward_ && state_ == lost && sock_ == -1
+            && std::chrono::milliseconds(reconnect_interval_ms) <= steady_clock_t::now() - connected_at_
+            && connect(shadow, epoll_fd, key, stats)){
+        state_ = live;
+        backlog_ = startup_;
+        flush(stats);
+    }
+    if(forward_){
+        emit(framer_.header, header_size, backlog_max, stats);
+    } else{
+        stats->dropped.fetch_add(header_size, std::memory_order_relaxed);
+    }
+}
+
+void mirror_link_t::feed(const int8_t *data, unsigned size, bool from_start, const endpoint_t &shadow
+                         , int epoll_fd, int key, unsigned backlog_max, mirror_stats_t *stats) {
+    lock_guard<mutex> lg(mx_);
+    if(state_ == starting && !from_start && !framer_.header_len && startup_.empty()){
+        state_ = off;
+    }
+    const int8_t *p = data;
+    const int8_t *end = data + size;
+    while(p < end && state_ != off){
+        if(framer_.in_header()){
+            framer_.header[framer_.header_len++] = *p++;
+            if(framer_.in_header()){
+                continue;
+            }
+            if(int4(framer_.header + (framer_.typeless ? 0 : 1)) < 4){
+                lose(stats);
+                state_ = off;
+                break;
+            }
+            framer_.remaining = framer_.length();
+            on_header(shadow, epoll_fd, key, backlog_max, stats);
+        } else{
+            unsigned n = std::min<size_t>(end - p, framer_.remaining);
+            if(state_ == starting){
+                startup_.append(reinterpret_cast<const char *>(p), n);
+            } else if(forward_){
+                emit(p, n, backlog_max, stats);
+            } else{
+                stats->dropped.fetch_add(n, std::memory_order_relaxed);
+            }
+            p += n;
+            framer_.remaining -= n;
+        }
+        if(framer_.remaining == 0 && state_ != off){
+            const bool terminate = !framer_.typeless && framer_.type() == 'X';
+            framer_.header_len = 0;
+            if(state_ == starting){
+                on_startup(shadow, epoll_fd, key, stats);
+            } else if(terminate){
+                // the shadow ends the session itself
+                state_ = off;
+            }
+        }
+    }
+    if(p < end){
+        stats->dropped.fetch_add(end - p, std::memory_order_relaxed);
+    }
+}
+
+void mirror_link_t::drain(mirror_stats_t *stats) {
+    lock_guard<mutex> lg(mx_);
+    if(sock_ == -1){
+        return;
+    }
+    int8_t buf[drain_size];
+    for(;;){
+        ssize_t res = recv(message_on_error, sock_, buf, sizeof(buf), MSG_DONTWAIT);
+        if(0 < res){
+            stats->discarded.fetch_add(res, std::memory_order_relaxed);
+            continue;
+        }
+        if(res == -1 && would_block()){
+            break;
+        }
+        if(state_ == live){
+            stats->failed.fetch_add(1, std::memory_order_relaxed);
+        }
+        lose(stats);
+        return;
+    }
+    flush(stats);
+}
+
+bool mirror_links_t::start(const endpoint_t &shadow, unsigned backlog_max
+                           , const std::function<void (const char *)> &message_f) {
+    reset();
+    shadow_ = shadow;
+    backlog_max_ = backlog_max;
+    // the failures are told from the ones of the peers
+    message_ = [message_f](const char *m){ message_f((string("shadow ") + m).c_str()); };
+    epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    return epoll_fd_ != -1;
+}
+
+void mirror_links_t::reset() {
+    lock_guard<mutex> lg(mx_);
+    links_.clear();
+    if(epoll_fd_ != -1){
+        ::close(epoll_fd_);
+        epoll_fd_ = -1;
+    }
+}
+
+unsigned mirror_links_t::drain() {
+    epoll_event events[max_events];
+    int cnt = ::epoll_wait(epoll_fd_, events, max_events, 0);
+    lock_guard<mutex> lg(mx_);
+    for(int i = 0; i < cnt; ++i){
+        auto it = links_.find(events[i].data.fd);
+        if(it != links_.end()){
+            it->second->drain(&stats);
+        }
+    }
+    return 0 < cnt ? cnt : 0;
+}
+
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+#include "query_tracker.h"
+#include "system/endpoint.h"
+#include "system/sys_caller.h"
+
+namespace mirror_nms {
+
+using std::string;
+using std::unique_ptr;
+using std::unordered_map;
+using std::mutex;
+using std::lock_guard;
+using std::atomic;
+using steady_clock_t = std::chrono::steady_clock;
+
+const unsigned reconnect_interval_ms = 1000;   // between the shadow sessions of a peer
+const unsigned max_startup_size = 10000;
+
+struct mirror_stats_t {
+    atomic<uint64_t> sessions = { 0 };      // shadow connections opened
+    atomic<uint64_t> failed = { 0 };        // connects failed or sessions cut by the shadow
+    atomic<uint64_t> mirrored = { 0 };      // bytes sent to the shadow
+    atomic<uint64_t> dropped = { 0 };       // bytes of the client streams not mirrored
+    atomic<uint64_t> discarded = { 0 };     // bytes of the shadow responses thrown away
+
+    string summary() const;
+
+    void reset() {
+        for(auto counter : { &sessions, &failed, &mirrored, &dropped, &discarded }){
+            counter->store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+// replays the messages of one client stream to its own shadow connection, the password
+// messages left out, so the shadow must trust the proxy; what doesn't go out at once is kept
+// up to the backlog size, past it the shadow session is closed and a new one started with
+// the saved startup packet at a later message boundary
+class mirror_link_t : protected sys_caller_t {
+    enum state_t { starting, live, lost, off };
+
+    mutex mx_;
+    int sock_ = -1;
+    state_t state_ = starting;
+    message_framer_t framer_ = { {}, 0, 0, true };
+    bool forward_ = false;          // the body of the current message goes to the shadow
+    string startup_;
+    string backlog_;
+    steady_clock_t::time_point connected_at_;
+
+    void close_sock();
+
+    bool connect(const endpoint_t &shadow, int epoll_fd, int key, mirror_stats_t *stats);
+
+    void lose(mirror_stats_t *stats);
+
+    void emit(const int8_t *data, unsigned size, unsigned backlog_max, mirror_stats_t *stats);
+
+    void flush(mirror_stats_t *stats);
+
+    void on_header(const endpoint_t &shadow, int epoll_fd, int key, unsigned backlog_max
+                   , mirror_stats_t *stats);
+
+    void on_startup(const endpoint_t &shadow, int epoll_fd, int key, mirror_stats_t *stats);
+
+public:
+
+    explicit mirror_link_t(const std::function<void (const char *)> &message_f) : sys_caller_t(message_f) {}
+
+    ~mirror_link_t() { close_sock(); }
+
+    // the key is the client socket, it tags the shadow socket's epoll events;
+    // a stream not fed from its start, as one taken over, has no startup packet to replay
+    void feed(const int8_t *data, unsigned size, bool from_start, const endpoint_t &shadow
+              , int epoll_fd, int key, unsigned backlog_max, mirror_stats_t *stats);
+
+    // reads the responses away and sends what has been kept back
+    void drain(mirror_stats_t *stats);
+};
+
+// the shadow sessions of all peers, their sockets in a shared epoll instance
+class mirror_links_t {
+    unordered_map<int, unique_ptr<mirror_link_t>> links_;
+    mutex mx_;
+    std::function<void (const char *)> message_;    // the failures of the shadow sessions go to it
+    endpoint_t shadow_;
+    unsigned backlog_max_ = 0;
+    int epoll_fd_ = -1;
+
+public:
+
+    mirror_stats_t stats;
+
+    ~mirror_links_t() { reset(); }
+
+    // returns false if the epoll instance can't be created
+    bool start(const endpoint_t &shadow, unsigned backlog_max
+               , const std::function<void (const char *)> &message_f);
+
+    void reset();
+
+    void clear_from(int sock) {
+        lock_guard<mutex> lg(mx_);
+        links_.erase(sock);
+    }
+
+    // the link of a client socket, only its lane reader uses it until the peer is dropped
+    mirror_link_t &link(int sock) {
+        lock_guard<mutex> lg(mx_);
+        auto &uptr = links_[sock];
+        if(!uptr){
+            uptr = std::make_unique<mirror_link_t>(message_);
+        }
+        return *uptr;
+    }
+
+    void add_data(int sock, const int8_t *data, unsigned size, bool from_start) {
+        link(sock).feed(data, size, from_start, shadow_, epoll_fd_, sock, backlog_max_, &stats);
+    }
+
+    // services the shadow sockets with pending events, returns the number of them
+    unsigned drain();
+};
+
+}
+
+using mirror_nms::mirror_links_t;
@@ -1,6 +1,9 @@
 #include "postgre_msg.h"
 
 #include <sstream>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
 #include <stdexcept>
 #include <vector>
 
@@ -42,6 +45,7 @@ namespace message_id {
     const int gss_enc_request = PG_PROTOCOL(1234,5680);
     const int cancel_request = PG_PROTOCOL(1234,5678);
 
+    const char typeless_id = 0;
     const char bind_id = 'B';
     const char close_id = 'C';
     const char copy_data_id = 'd';
@@ -73,70 +77,86 @@ void protocol_message_t::throw_error(ofstream &log, const ExceptF &except_f) {
     throw runtime_error("error while processing SQL query");
 }
 
-void protocol_message_t::process(page_wrapper_t &&wpage, const string &preamble
-                                 , ofstream &log, const ExceptF &except_f) {
-    const auto skip_data = [&](){
-        wpage.adjust_pos(size_ - cur_size_);
-        data_ = queue<page_wrapper_t>();
-        size_ = 0;
-    };
-    const auto too_big = [&](){
-        if(max_data_size < cur_size_){
-            except_f([&](){
+struct protocol_message_t::reader_t {
+    protocol_message_t &msg;
+    page_wrapper_t &wpage;
+    ofstream &log;
+    const ExceptF &except_f;
+
+    template <class F> void out(const F &f) { except_f(f); }
+
+    void throw_error() { msg.throw_error(log, except_f); }
+
+    void skip_data() {
+        wpage.adjust_pos(msg.size_ - msg.cur_size_);
+        msg.data_ = queue<page_wrapper_t>();
+        msg.size_ = 0;
+    }
+
+    bool too_big() {
+        if(max_data_size < msg.cur_size_){
+            out([&](){
                 log << " ! Query was too big: ";
-                log << std::to_string(size_);
+                log << std::to_string(msg.size_);
                 log << " bytes !";
             });
             skip_data();
             return true;
         }
         return false;
-    };
-    const auto get_byte = [&](){
-        page_wrapper_t *pwp = data_.size() ? &data_.front() : &wpage;
-        if(pwp->size() == 0){ throw_error(log, except_f); }
+    }
+
+    int size() const { return msg.size_; }
+
+    int8_t get_byte() {
+        page_wrapper_t *pwp = msg.data_.size() ? &msg.data_.front() : &wpage;
+        if(pwp->size() == 0){ throw_error(); }
         int8_t val = *(pwp->data());
         pwp->adjust_pos(1);
-        size_ -= 1;
-        if(size_ < 0){ throw_error(log, except_f); }
-        if(pwp->size() == 0 && data_.size()){
-            data_.pop();
+        msg.size_ -= 1;
+        if(msg.size_ < 0){ throw_error(); }
+        if(pwp->size() == 0 && msg.data_.size()){
+            msg.data_.pop();
         }
         return val;
-    };
-    const auto get_int2 = [&](){
+    }
+
+    uint16_t get_int2() {
         int8_t b[2];
         b[1] = get_byte();
         b[0] = get_byte();
         return *reinterpret_cast<uint16_t*>(&b[0]);
-    };
-    const auto get_int4 = [&](){
+    }
+
+    uint32_t get_int4() {
         int8_t b[4];
         b[3] = get_byte();
         b[2] = get_byte();
         b[1] = get_byte();
         b[0] = get_byte();
         return *reinterpret_cast<uint32_t*>(&b[0]);
-    };
-    const auto c_str = [&](){
+    }
+
+    void c_str() {
         char c = get_byte();
         while(c){
-            except_f([&](){ log << c; });
+            out([&](){ log << c; });
             c = get_byte();
         }
-    };
-    const auto params_pack = [&](){
+    }
+
+    void params_pack() {
         auto fmt = get_int2();
         vector<bool> formats;
         if(fmt){
-            except_f([&](){
+            out([&](){
                 formats.reserve(fmt);
                 log << " fmt_codes=";
             });
             while(fmt--){
                 auto v = get_int2();
                 formats.push_back(v);
-                except_f([&](){
+                out([&](){
                     log << std::to_string(v);
                     if(fmt){ log << ','; }
                 });
@@ -144,7 +164,7 @@ void protocol_message_t::process(page_wrapper_t &&wpage, const string &preamble
         }
         auto prm = get_int2();
         if(prm){
-            except_f([&](){ log << " params="; });
+            out([&](){ log << " params="; });
             bool default_fmt = false;
             if(formats.size() == 1){
                 default_fmt = formats[0];
@@ -152,9 +172,9 @@ void protocol_message_t::process(page_wrapper_t &&wpage, const string &preamble
             while(prm--){
                 auto v = static_cast<int32_t>(get_int4());
                 if(v == -1){
-                    except_f([&](){ log << "NULL"; });
+                    out([&](){ log << "NULL"; });
                 } else if(v == 0){
-                    except_f([&](){ log << "EMPTY"; });
+                    out([&](){ log << "EMPTY"; });
                 } else{
                     bool binary = default_fmt;
                     if(prm < formats.size()){
@@ -163,234 +183,375 @@ void protocol_message_t::process(page_wrapper_t &&wpage, const string &preamble
                     while(v--){
                         auto b = get_byte();
                         if(binary){
-                            except_f([&](){
+                            out([&](){
                                 ostringstream ss;
                                 ss << std::hex << static_cast<unsigned>(b);
                                 log << ss.str();
                             });
                         } else{
-                            except_f([&](){ log << b; });
+                            out([&](){ log << b; });
                         }
                     }
                 }
-                if(prm){ except_f([&](){ log << ','; }); }
-            }
-        }
-    };
-    except_f([&](){ log << preamble; });
-    if(type_ == typeless_message){
-        auto i = get_int4();
-        switch(i){
-        case startup_message:
-        {
-            except_f([&](){ log << "[Startup Message]"; });
-            if(!too_big()){
-                while(1 < size_){
-                    except_f([&](){ log << ' '; });
-                    c_str();
-                    except_f([&](){ log << '='; });
-                    c_str();
-                }
-                if(get_byte()){
-                    throw_error(log, except_f);
-                }
-            }
-            break;
-        }
-        case ssl_request:
-        {
-            except_f([&](){ log << "[SSL request]"; });
-            break;
-        }
-        case gss_enc_request:
-        {
-            except_f([&](){ log << "[GSS Encryption request]"; });
-            break;
-        }
-        case cancel_request:
-        {
-            except_f([&](){ log << "[Cancel request]"; });
-            auto pid = get_int4();
-            auto key = get_int4();
-            except_f([&](){
-                log << " PID=" << std::to_string(pid);
-                log << " key=" << std::to_string(key);
-            });
-            break;
-        }
-        default:
-            throw_error(log, except_f);
-        }
-    } else{
-        switch(type_byte_){
-        case bind_id:
-        {
-            except_f([&](){ log << "[Bind command]"; });
-            if(!too_big()){
-                except_f([&](){ log << " dest_portal="; });
-                c_str();
-                except_f([&](){ log << " prep_statement="; });
-                c_str();
-                params_pack();
-                auto rsl = get_int2();
-                if(rsl){
-                    except_f([&](){
-                        log << " res_fmt_codes=";
-                    });
-                    while(rsl--){
-                        auto v = get_int2();
-                        except_f([&](){
-                            log << std::to_string(v);
-                            if(rsl){ log << ','; }
-                        });
-                    }
-                }
-            }
-            break;
-        }
-        case close_id:
-        {
-            except_f([&](){ log << "[Close command]"; });
-            if(!too_big()){
-                switch(get_byte()){
-                case 'S':
-                    except_f([&](){ log << " prep_statement="; });
-                    break;
-                case 'P':
-                    except_f([&](){ log << " portal="; });
-                    break;
-                default:
-                    throw_error(log, except_f);
-                }
-                c_str();
+                if(prm){ out([&](){ log << ','; }); }
             }
-            break;
         }
-        case copy_fail_id:
-        {
-            except_f([&](){ log << "[COPY failure]"; });
-            if(!too_big()){
-                except_f([&](){ log << " error_mgs="; });
-                c_str();
+    }
+};
+
+template <> void protocol_message_t::decode<typeless_id>(reader_t &r) {
+    auto i = r.get_int4();
+    switch(i){
+    case startup_message:
+    {
+        r.out([&](){ r.log << "[Startup Message]"; });
+        if(!r.too_big()){
+            while(1 < r.size()){
+                r.out([&](){ r.log << ' '; });
+                r.c_str();
+                r.out([&](){ r.log << '='; });
+                r.c_str();
             }
-            break;
-        }
-        case describe_id:
-        {
-            except_f([&](){ log << "[Describe command]"; });
-            if(!too_big()){
-                switch(get_byte()){
-                case 'S':
-                    except_f([&](){ log << " prep_statement="; });
-                    break;
-                case 'P':
-                    except_f([&](){ log << " portal="; });
-                    break;
-                default:
-                    throw_error(log, except_f);
-                }
-                c_str();
+            if(r.get_byte()){
+                r.throw_error();
             }
-            break;
         }
-        case execute_id:
-        {
-            except_f([&](){ log << "[Execute command]"; });
-            if(!too_big()){
-                except_f([&](){ log << " portal="; });
-                c_str();
-                auto rows = get_int4();
-                except_f([&](){ log << " max_rows=" << std::to_string(rows); });
-            }
-            break;
+        break;
+    }
+    case ssl_request:
+    {
+        r.out([&](){ r.log << "[SSL request]"; });
+        break;
+    }
+    case gss_enc_request:
+    {
+        r.out([&](){ r.log << "[GSS Encryption request]"; });
+        break;
+    }
+    case cancel_request:
+    {
+        r.out([&](){ r.log << "[Cancel request]"; });
+        auto pid = r.get_int4();
+        auto key = r.get_int4();
+        r.out([&](){
+            r.log << " PID=" << std::to_string(pid);
+            r.log << " key=" << std::to_string(key);
+        });
+        break;
+    }
+    default:
+        r.throw_error();
+    }
+}
+
+static bool is_on(const string &val) {
+    string v(val);
+    std::transform(v.begin(), v.end(), v.begin(), [](unsigned char c){ return std::tolower(c); });
+    return v == "on" || v == "true" || v == "yes" || v == "1";
+}
+
+int classify_startup(const int8_t *data, unsigned size) {
+    if(size < 8){
+        return startup_kind::incomplete;
+    }
+    const auto int4 = [data](unsigned pos){
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(data) + pos;
+        return static_cast<int>(uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3]);
+    };
+    const unsigned len = int4(0);
+    const int code = int4(4);
+    if(len == 8 && (code == ssl_request || code == gss_enc_request)){
+        return startup_kind::encryption_request;
+    }
+    if(code != startup_message || len < 9 || max_startup_size < len){
+        return startup_kind::other;
+    }
+    if(size < len){
+        return startup_kind::incomplete;
+    }
+    // name=value pairs of zero terminated strings, the last name is empty
+    const char *p = reinterpret_cast<const char *>(data) + 8;
+    const char *end = reinterpret_cast<const char *>(data) + len;
+    const char *param = "default_transaction_read_only";
+    while(p < end && *p){
+        const char *name = p;
+        const char *value = static_cast<const char *>(memchr(name, 0, end - name));
+        if(!value || ++value == end){
+            return startup_kind::other;
         }
-        case function_call_id:
-        {
-            except_f([&](){ log << "[function call]"; });
-            if(!too_big()){
-                auto fid = get_int4();
-                except_f([&](){ log << " function_id=" << std::to_string(fid); });
-                params_pack();
-                auto r = get_int2();
-                except_f([&](){ log << " result_fmt=" << std::to_string(r); });
-            }
-            break;
+        p = static_cast<const char *>(memchr(value, 0, end - value));
+        if(!p){
+            return startup_kind::other;
         }
-        case copy_data_id:
-        {
-            except_f([&](){
-                log << "[COPY data] " << std::to_string(size_) <<" bytes";
-            });
-            skip_data();
-            break;
+        ++p;
+        if(std::strcmp(name, param) == 0 && is_on(value)){
+            return startup_kind::read_only;
         }
-        case parse_id:
-        {
-            except_f([&](){ log << "[Parse command]"; });
-            if(!too_big()){
-                except_f([&](){ log << " prep_statement="; });
-                c_str();
-                except_f([&](){ log << " query="; });
-                c_str();
-                auto prm = get_int2();
-                if(prm){
-                    except_f([&](){ log << " param_types="; });
-                    while(prm--){
-                        auto id = get_int4();
-                        except_f([&](){
-                            log << std::to_string(id);
-                            if(prm){ log << ','; }
-                        });
+        if(std::strcmp(name, "options") == 0){
+            // -c default_transaction_read_only=on or --default_transaction_read_only=on
+            const char *opt = std::strstr(value, param);
+            if(opt){
+                opt += std::strlen(param);
+                if(*opt == '='){
+                    const char *opt_end = opt + 1 + std::strcspn(opt + 1, " ");
+                    if(is_on(string(opt + 1, opt_end))){
+                        return startup_kind::read_only;
                     }
                 }
             }
-            break;
         }
-        case query_id:
-        {
-            except_f([&](){ log << "[simple query] "; });
-            if(!too_big()){
-                c_str();
+    }
+    return startup_kind::read_write;
+}
+
+template <> void protocol_message_t::decode<bind_id>(reader_t &r) {
+    r.out([&](){ r.log << "[Bind command]"; });
+    if(!r.too_big()){
+        r.out([&](){ r.log << " dest_portal="; });
+        r.c_str();
+        r.out([&](){ r.log << " prep_statement="; });
+        r.c_str();
+        r.params_pack();
+        auto rsl = r.get_int2();
+        if(rsl){
+            r.out([&](){
+                r.log << " res_fmt_codes=";
+            });
+            while(rsl--){
+                auto v = r.get_int2();
+                r.out([&](){
+                    r.log << std::to_string(v);
+                    if(rsl){ r.log << ','; }
+                });
             }
-            break;
         }
-        case passw_id:
-        {
-            except_f([&](){
-                log << "[password message | gss response | sasl response] ";
-                log << std::to_string(size_) <<" bytes";
-            });
-            skip_data();
+    }
+}
+
+template <> void protocol_message_t::decode<close_id>(reader_t &r) {
+    r.out([&](){ r.log << "[Close command]"; });
+    if(!r.too_big()){
+        switch(r.get_byte()){
+        case 'S':
+            r.out([&](){ r.log << " prep_statement="; });
             break;
-        }
-        case copy_done_id:
-        {
-            except_f([&](){ log << "[COPY complete]"; });
+        case 'P':
+            r.out([&](){ r.log << " portal="; });
             break;
+        default:
+            r.throw_error();
         }
-        case flush_id:
-        {
-            except_f([&](){ log << "[Flush command]"; });
+        r.c_str();
+    }
+}
+
+template <> void protocol_message_t::decode<copy_fail_id>(reader_t &r) {
+    r.out([&](){ r.log << "[COPY failure]"; });
+    if(!r.too_big()){
+        r.out([&](){ r.log << " error_mgs="; });
+        r.c_str();
+    }
+}
+
+template <> void protocol_message_t::decode<describe_id>(reader_t &r) {
+    r.out([&](){ r.log << "[Describe command]"; });
+    if(!r.too_big()){
+        switch(r.get_byte()){
+        case 'S':
+            r.out([&](){ r.log << " prep_statement="; });
             break;
-        }
-        case sync_id:
-        {
-            except_f([&](){ log << "[Sync command]"; });
+        case 'P':
+            r.out([&](){ r.log << " portal="; });
             break;
+        default:
+            r.throw_error();
         }
-        case terminate_id:
-        {
-            except_f([&](){ log << "[Termination]"; });
-            break;
+        r.c_str();
+    }
+}
+
+template <> void protocol_message_t::decode<execute_id>(reader_t &r) {
+    r.out([&](){ r.log << "[Execute command]"; });
+    if(!r.too_big()){
+        r.out([&](){ r.log << " portal="; });
+        r.c_str();
+        auto rows = r.get_int4();
+        r.out([&](){ r.log << " max_rows=" << std::to_string(rows); });
+    }
+}
+
+template <> void protocol_message_t::decode<function_call_id>(reader_t &r) {
+    r.out([&](){ r.log << "[function call]"; });
+    if(!r.too_big()){
+        auto fid = r.get_int4();
+        r.out([&](){ r.log << " function_id=" << std::to_string(fid); });
+        r.params_pack();
+        auto res = r.get_int2();
+        r.out([&](){ r.log << " result_fmt=" << std::to_string(res); });
+    }
+}
+
+template <> void protocol_message_t::decode<copy_data_id>(reader_t &r) {
+    r.out([&](){
+        r.log << "[COPY data] " << std::to_string(r.size()) <<" bytes";
+    });
+    r.skip_data();
+}
+
+template <> void protocol_message_t::decode<parse_id>(reader_t &r) {
+    r.out([&](){ r.log << "[Parse command]"; });
+    if(!r.too_big()){
+        r.out([&](){ r.log << " prep_statement="; });
+        r.c_str();
+        r.out([&](){ r.log << " query="; });
+        r.c_str();
+        auto prm = r.get_int2();
+        if(prm){
+            r.out([&](){ r.log << " param_types="; });
+            while(prm--){
+                auto id = r.get_int4();
+                r.out([&](){
+                    r.log << std::to_string(id);
+                    if(prm){ r.log << ','; }
+                });
+            }
         }
+    }
+}
+
+template <> void protocol_message_t::decode<query_id>(reader_t &r) {
+    r.out([&](){ r.log << "[simple query] "; });
+    if(!r.too_big()){
+        r.c_str();
+    }
+}
+
+template <> void protocol_message_t::decode<passw_id>(reader_t &r) {
+    r.out([&](){
+        r.log << "[password message | gss response | sasl response] ";
+        r.log << std::to_string(r.size()) <<" bytes";
+    });
+    r.skip_data();
+}
+
+template <> void protocol_message_t::decode<copy_done_id>(reader_t &r) {
+    r.out([&](){ r.log << "[COPY complete]"; });
+}
+
+template <> void protocol_message_t::decode<flush_id>(reader_t &r) {
+    r.out([&](){ r.log << "[Flush command]"; });
+}
+
+template <> void protocol_message_t::decode<sync_id>(reader_t &r) {
+    r.out([&](){ r.log << "[Sync command]"; });
+}
+
+template <> void protocol_message_t::decode<terminate_id>(reader_t &r) {
+    r.out([&](){ r.log << "[Termination]"; });
+}
+
+protocol_message_t::decoders_t protocol_message_t::make_decoders(const string &types) {
+    decoders_t res;
+    res.fill(nullptr);
+    const auto set = [&](char id, decode_f f){
+        if(types.find(id) != string::npos){
+            res[static_cast<uint8_t>(id)] = f;
         }
+    };
+    set(bind_id, &decode<bind_id>);
+    set(close_id, &decode<close_id>);
+    set(copy_data_id, &decode<copy_data_id>);
+    set(copy_done_id, &decode<copy_done_id>);
+    set(copy_fail_id, &decode<copy_fail_id>);
+    set(describe_id, &decode<describe_id>);
+    set(execute_id, &decode<execute_id>);
+    set(flush_id, &decode<flush_id>);
+    set(function_call_id, &decode<function_call_id>);
+    set(parse_id, &decode<parse_id>);
+    set(query_id, &decode<query_id>);
+    set(sync_id, &decode<sync_id>);
+    set(terminate_id, &decode<terminate_id>);
+    set(passw_id, &decode<passw_id>);
+    return res;
+}
+
+protocol_message_t::decoders_t protocol_message_t::decoders_
+        = protocol_message_t::make_decoders(all_message_types);
+
+void protocol_message_t::process(page_wrapper_t &&wpage, const string &preamble
+                                 , ofstream &log, const ExceptF &except_f, log_filter_t &filter) {
+    reader_t r{ *this, wpage, log, except_f };
+    decode_f decode_message = type_ == typeless_message
+            ? &decode<typeless_id> : decoders_[static_cast<uint8_t>(type_byte_)];
+    // startup packets count as statements
+    bool statement = type_ == typeless_message || type_byte_ == query_id || type_byte_ == parse_id;
+    if(!decode_message || !(statement ? filter.pass_statement() : filter.pass_details())){
+        r.skip_data();
+        finish(std::move(wpage), preamble, log, except_f, filter);
+        return;
     }
+    except_f([&](){ log << preamble; });
+    decode_message(r);
     except_f([&](){ log << std::endl; });
+    finish(std::move(wpage), preamble, log, except_f, filter);
+}
+
+void protocol_message_t::finish(page_wrapper_t &&wpage, const string &preamble
+                                , ofstream &log, const ExceptF &except_f, log_filter_t &filter) {
     if(size_ || data_.size()){ throw_error(log, except_f); }
     state_ = waiting_for_type;
     cur_size_ = 0;
     if(wpage.size()){
-        add_data(std::move(wpage), preamble, log, except_f);
+        add_data(std::move(wpage), preamble, log, except_f, filter);
+    }
+}
+
+namespace {
+
+struct saved_state_t {
+    int cur_size;
+    int state;
+    int type;
+    int size;
+    int8_t size_bytes[4];
+    char type_byte;
+};
+
+}
+
+string protocol_message_t::save() const {
+    saved_state_t st = { cur_size_, state_, type_, size_
+                         , { size_bytes_[0], size_bytes_[1], size_bytes_[2], size_bytes_[3] }
+                         , type_byte_ };
+    string res(reinterpret_cast<const char *>(&st), sizeof(st));
+    auto data = data_;
+    while(data.size()){
+        auto &wpage = data.front();
+        res.append(reinterpret_cast<const char *>(wpage.data()), wpage.size());
+        data.pop();
+    }
+    return res;
+}
+
+void protocol_message_t::load(const string &state, memory_pager_t *pager) {
+    if(state.size() < sizeof(saved_state_t)){
+        throw runtime_error("bad SQL logger state");
+    }
+    saved_state_t st;
+    memcpy(&st, state.data(), sizeof(st));
+    cur_size_ = st.cur_size;
+    state_ = st.state;
+    type_ = st.type;
+    size_ = st.size;
+    memcpy(size_bytes_, st.size_bytes, sizeof(size_bytes_));
+    type_byte_ = st.type_byte;
+    data_ = queue<page_wrapper_t>();
+    for(size_t pos = sizeof(st); pos < state.size(); ){
+        auto page = pager->get_page();
+        unsigned sz = std::min<size_t>(page->size(), state.size() - pos);
+        memcpy(page->data(), state.data() + pos, sz);
+        data_.emplace(std::move(page), 0, sz);
+        pos += sz;
     }
 }
 
@@ -420,11 +581,20 @@ bool protocol_message_t::check_type() {
 }
 
 void protocol_message_t::add_data(page_wrapper_t &&wpage, const string &preamble
-                                  , ofstream &log, const ExceptF &except_f) {
+                                  , ofstream &log, const ExceptF &except_f, log_filter_t &filter) {
     if(state_ == out_of_sync){
-        log << preamble << "logger is out of sync. "
-            << wpage.size() <<" bytes transferred\n";
-        return;
+        // picks the stream up again at the next message the receiver has marked
+        auto mark = wpage.index().first_from(wpage.pos(), wpage.pos() + wpage.size());
+        unsigned skipped = mark ? mark->offset - wpage.pos() : wpage.size();
+        if(skipped){
+            log << preamble << "logger is out of sync. " << skipped <<" bytes transferred\n";
+        }
+        if(!mark){
+            return;
+        }
+        log << preamble << "logger is back in sync\n";
+        wpage.adjust_pos(skipped);
+        state_ = waiting_for_type;
     }
     if(state_ == waiting_for_type){
         type_byte_ = *reinterpret_cast<char *>(wpage.data());
@@ -462,11 +632,12 @@ void protocol_message_t::add_data(page_wrapper_t &&wpage, const string &preamble
     if(state_ == waiting_for_data){
         int sz = wpage.size();
         if(size_ <= cur_size_ + sz){
-            process(std::move(wpage), preamble, log, except_f);
+            process(std::move(wpage), preamble, log, except_f, filter);
         } else if(wpage.size()){
             cur_size_ += sz;
-            bool collect_data = !(type_ == typed_message && (
-                                    type_byte_ == copy_data_id || type_byte_ == passw_id));
+            bool collect_data = type_ == typeless_message
+                    || (type_byte_ != copy_data_id && type_byte_ != passw_id
+                        && decoders_[static_cast<uint8_t>(type_byte_)]);
             if(collect_data && cur_size_ <= max_data_size){
                 data_.emplace(std::move(wpage));
             }
@@ -1,8 +1,10 @@
 #pragma once
 
 #include "transfer_conveyer.h"
+#include "tasks/log_detail.h"
 
 #include <string>
+#include <array>
 #include <fstream>
 #include <queue>
 #include <unordered_map>
@@ -18,10 +20,47 @@ using std::unordered_map;
 using std::mutex;
 using std::lock_guard;
 using std::function;
+using std::array;
 
 typedef function<void (const function<void ()> &)> ExceptF;
 
+// type bytes of the frontend messages the logger can decode
+inline const char *all_message_types = "BCDEFHPQSXcdfp";
+
+// what the first packet of a connection asks for
+namespace startup_kind {
+
+    const int incomplete = 0;
+    const int encryption_request = 1;   // SSL or GSSAPI, to be answered before the startup message
+    const int read_write = 2;
+    const int read_only = 3;            // default_transaction_read_only is set on
+    const int other = 4;                // cancel request or a malformed packet
+
+}
+
+const unsigned max_startup_size = 10000;
+
+int classify_startup(const int8_t *data, unsigned size);
+
+// true if the data ends with a whole message of the type with a body of body_size bytes,
+// such as ReadyForQuery ('Z', 1) from the server or Sync ('S', 0) from a client
+inline bool ends_with_message(const int8_t *data, unsigned size, char type, unsigned body_size) {
+    const unsigned len = body_size + 4;
+    if(size < len + 1){
+        return false;
+    }
+    const uint8_t *msg = reinterpret_cast<const uint8_t *>(data) + size - len - 1;
+    return msg[0] == static_cast<uint8_t>(type) && !msg[1] && !msg[2] && !msg[3] && msg[4] == len;
+}
+
 class protocol_message_t {
+    struct reader_t;
+    typedef void (*decode_f)(reader_t &);
+    typedef array<decode_f, 256> decoders_t;
+
+    // null for the types filtered out
+    static decoders_t decoders_;
+
     queue<page_wrapper_t> data_;
     int cur_size_;
     int state_;
@@ -33,16 +72,31 @@ class protocol_message_t {
     void throw_error(ofstream &log, const ExceptF &except_f);
 
     void process(page_wrapper_t &&wpage, const string &preamble, ofstream &log
-                 , const ExceptF &except_f);
+                 , const ExceptF &except_f, log_filter_t &filter);
+
+    void finish(page_wrapper_t &&wpage, const string &preamble, ofstream &log
+                , const ExceptF &except_f, log_filter_t &filter);
 
     bool check_type();
 
+    template <char Id> static void decode(reader_t &r);
+
+    static decoders_t make_decoders(const string &types);
+
 public:
 
     protocol_message_t();
 
+    // messages of the types not listed are skipped by their length without being decoded
+    static void set_filter(const string &types) { decoders_ = make_decoders(types); }
+
     void add_data(page_wrapper_t &&wpage, const string &preamble, ofstream &log
-                  , const ExceptF &except_f);
+                  , const ExceptF &except_f, log_filter_t &filter);
+
+    // parser state with the part of the message collected so far
+    string save() const;
+
+    void load(const string &state, memory_pager_t *pager);
 };
 
 class postgre_msg_t {
@@ -53,6 +107,8 @@ public:
 
     void reset() { msg_.clear(); }
 
+    static void set_filter(const string &types) { protocol_message_t::set_filter(types); }
+
     void clear_from(int sock) {
         lock_guard<mutex> lg(mx_);
         auto it = msg_.find(sock);
@@ -61,12 +117,28 @@ public:
         }
     }
 
+    string save(int sock) {
+        lock_guard<mutex> lg(mx_);
+        auto it = msg_.find(sock);
+        return it == msg_.end() ? string() : it->second.save();
+    }
+
+    void load(int sock, const string &state, memory_pager_t *pager) {
+        if(state.empty()){
+            return;
+        }
+        mx_.lock();
+        protocol_message_t &m = msg_[sock];
+        mx_.unlock();
+        m.load(state, pager);
+    }
+
     void add_data(int sock, page_wrapper_t &&wpage, const string &preamble, ofstream &log
-                  , const ExceptF &except_f) {
+                  , const ExceptF &except_f, log_filter_t &filter) {
         mx_.lock();
         protocol_message_t &m = msg_[sock];
         mx_.unlock();
-        m.add_data(std::move(wpage), preamble, log, except_f);
+        m.add_data(std::move(wpage), preamble, log, except_f, filter);
     }
 };
 
@@ -1,12 +1,16 @@
 #pragma once
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
 #include <cstdint>
 #include <cstring>
 #include <string>
 #include <thread>
 #include <memory>
 #include <algorithm>
+#include <functional>
+#include <stdexcept>
 
 #include "transfer_conveyer.h"
 #include "tasks/task.h"
@@ -15,12 +19,21 @@
 #include "tasks/sender.h"
 #include "tasks/logger.h"
 #include "tasks/psql_logger.h"
+#include "tasks/backend_logger.h"
+#include "tasks/mirror.h"
 #include "tasks/superviser.h"
 #include "memory/memory_pager.h"
+#include "memory/spill_file.h"
 #include "synchronization/resource_waiter.h"
 #include "synchronization/signal.h"
 #include "synchronization/signal_pack.h"
 #include "system/sys_caller.h"
+#include "system/unix_channel.h"
+#include "system/endpoint.h"
+#include "system/cpu_placement.h"
+#include "result_cache.h"
+#include "latency_stats.h"
+#include "trace.h"
 
 namespace proxy_nms {
 
@@ -31,12 +44,60 @@ using std::unique_ptr;
 const unsigned page_size = 4096;    // bytes
 const unsigned cache_size = 8192;   // pages (32 MB)
 
-const unsigned lanes_cnt = 2;       // 1 for sending + 1 for logging
+const unsigned lanes_cnt = 2;       // 1 for sending + 1 for logging, the client lines
+                                    // have 1 more for mirroring if a shadow server is set
+
+const size_t spill_size = size_t(1) << 32;      // bytes (4 GB)
+
+constexpr auto hand_over_timeout = std::chrono::seconds(10);
+
+// records sent from the old process to the new one during a hand over
+namespace hand_over_records {
+
+    const char listening_record = 'L';      // the listening socket
+    const char peer_record = 'P';           // client and server sockets, the peer name
+    const char sql_state_record = 'S';      // SQL logger state of the last peer
+    const char backend_state_record = 'B';  // server side logger state of the last peer
+    const char end_record = 'E';
+    const char ack_record = 'A';            // sent back once the new process has taken the connections
+    const char go_record = 'G';             // the old process lets go of them, the new one may run
+
+}
+
+using namespace hand_over_records;
+
+struct proxy_settings_t {
+    unsigned connection_quota = cache_size / 8;     // pages per connection, 0 - no quota
+    unsigned spill_threshold = cache_size / 16;     // logging backlog in pages, 0 - no spilling
+    std::string spill_path = "proxy.spill";
+    std::string logged_messages = postgre_msg_nms::all_message_types;   // type bytes
+    bool populate_cache = false;    // fault the memory cache in at startup
+    std::string hand_over_from;     // unix socket of the process handing its connections over
+    unsigned listen_backlog = SOMAXCONN;
+    unsigned accept_budget = connect_options_t().accept_budget;     // connections per wakeup
+    unsigned defer_accept = 0;      // seconds to wait for the first client data, 0 - off
+    unsigned fast_open = 0;         // TCP Fast Open queue length, 0 - off
+    socket_profile_t socket_profile;
+    vector<endpoint_t> replicas;    // servers for the read-only connections
+    unsigned result_cache_ttl = 0;  // ms a cached query result lives, 0 - no caching
+    unsigned result_cache_pages = cache_size / 32;  // taken from the memory cache
+    unsigned max_backends = 0;      // concurrent server connections, 0 - no cap
+    unsigned backend_wait = 5000;   // ms a client over the cap waits for a connection
+    unsigned client_rate = 0;       // connections per second of a client address, 0 - no limit
+    unsigned client_burst = 0;      // of a client address, 0 - as many as the rate
+    std::string cpu_policy = "none";    // thread placement, one of cpu_placement_nms::policy_names
+    vector<std::string> cpu_roles;      // "<role>=<cpu_list>", over the policy
+    std::string capture_path;       // both directions of the connections are captured to, if set
+    endpoint_t mirror;              // shadow server the client traffic is replayed to, if set
+    unsigned mirror_backlog = 65536;    // bytes per connection the shadow may lag behind
+};
 
 class proxy_t : protected sys_caller_t {
-    sockaddr_in proxy_addr_;
+    std::function<void (const char *)> message_f_;
+    endpoint_t proxy_addr_;
     signal_t *error_signal_;
     vector<thread> threads_;
+    const unsigned threading_level_;
 
     task_control_t superviser_ctrl_;
     task_control_t connectors_ctrl_;
@@ -46,14 +107,18 @@ class proxy_t : protected sys_caller_t {
     task_control_t server_senders_ctrl_;
     task_control_t clients_loggers_ctrl_;
     task_control_t server_loggers_ctrl_;
+    task_control_t mirrors_ctrl_;
 
     resource_waiter_t memory_waiter_;
     memory_pager_t pager_;
+    spill_file_t spill_file_;
+    const std::string spill_path_;
+    const std::string logged_messages_;
     transfer_conveyer_t conveyer_;
+    log_detail_t log_detail_;
     signal_pack_t clients_data_signal_;
     signal_pack_t server_data_signal_;
 
-    const unsigned threading_level_;
     vector<unique_ptr<task_t>> connectors_;
     vector<unique_ptr<task_t>> clients_receivers_;
     vector<unique_ptr<task_t>> server_receivers_;
@@ -61,112 +126,362 @@ class proxy_t : protected sys_caller_t {
     vector<unique_ptr<task_t>> server_senders_;
     vector<unique_ptr<task_t>> clients_loggers_;
     vector<unique_ptr<task_t>> server_loggers_;
-    unique_ptr<task_t> clients_senders_hlp_;
-    unique_ptr<task_t> server_senders_hlp_;
+    vector<unique_ptr<task_t>> mirrors_;
     unique_ptr<superviser_t> superviser_;
 
     int connectors_epoll_;
     int clients_receivers_epoll_;
     int server_receivers_epoll_;
-    int clients_senders_epoll_;
-    int server_senders_epoll_;
+    int startup_epoll_;             // the clients to route to the backends by their startup packets
+    int connect_epoll_;             // the server connects in progress
     int listening_socket_;
+    bool listening_ = false;
+    bool unlink_listening_ = false;     // the listening unix socket file was created here
+    std::string hand_over_from_;
+    const unsigned listen_backlog_;
+    const unsigned defer_accept_;
+    const unsigned fast_open_;
+    setup_stats_t setup_stats_;
+    backends_t backends_;
+    result_cache_t result_cache_;
+    admission_t admission_;
+    latency_stats_t latency_;
+    capture_file_t capture_;
+    const std::string capture_path_;
+    const std::string cpu_policy_;
+    const vector<std::string> cpu_roles_;
+    const endpoint_t mirror_addr_;
+    const unsigned mirror_backlog_;
 
     template<class O> void for_all_controls(O operation) {
         for(auto ctrl : { &superviser_ctrl_, &connectors_ctrl_
             , &clients_receivers_ctrl_, &server_receivers_ctrl_
             , &clients_senders_ctrl_, &server_senders_ctrl_
-            , &clients_loggers_ctrl_, &server_loggers_ctrl_ }){
+            , &clients_loggers_ctrl_, &server_loggers_ctrl_, &mirrors_ctrl_ }){
             operation(*ctrl);
         }
     }
 
     template<class O> void for_all_epolls(O operation) {
         for(auto fd : { &connectors_epoll_, &clients_receivers_epoll_, &server_receivers_epoll_
-            , &clients_senders_epoll_, &server_senders_epoll_ }){
+                        , &startup_epoll_, &connect_epoll_ }){
             operation(*fd);
         }
     }
 
     void task_blocked(task_t *t) { superviser_->on_task_blocked(t); }
 
+    bool mirroring() const { return mirror_addr_.size() != 0; }
+
+    void listen_for_clients() {
+        epoll_event ee;
+        ee.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ee.data.fd = listening_socket_;
+        epoll_ctl(throw_on_error, connectors_epoll_, EPOLL_CTL_ADD, listening_socket_, &ee);
+        listening_ = true;
+    }
+
+    // the connectors are woken when a client may take a freed backend slot
+    void watch_admission() {
+        if(admission_.max_backends()){
+            epoll_event ee;
+            ee.events = EPOLLIN | EPOLLEXCLUSIVE;
+            ee.data.fd = admission_.wakeup_fd();
+            epoll_ctl(throw_on_error, connectors_epoll_, EPOLL_CTL_ADD, ee.data.fd, &ee);
+        }
+    }
+
+    // the connectors route the clients to the replicas once their startup packets are in
+    void watch_startups() {
+        if(backends_.has_replicas()){
+            epoll_event ee;
+            // an epoll descriptor can't be watched exclusively
+            ee.events = EPOLLIN;
+            ee.data.fd = startup_epoll_;
+            epoll_ctl(throw_on_error, connectors_epoll_, EPOLL_CTL_ADD, startup_epoll_, &ee);
+        }
+    }
+
+    // the connectors complete the peers whose servers have accepted
+    void watch_connects() {
+        epoll_event ee;
+        ee.events = EPOLLIN;
+        ee.data.fd = connect_epoll_;
+        epoll_ctl(throw_on_error, connectors_epoll_, EPOLL_CTL_ADD, connect_epoll_, &ee);
+    }
+
+    template<class O> void for_all_roles(O operation) {
+        const std::pair<const char *, vector<unique_ptr<task_t>> *> roles[] = {
+            { "connectors", &connectors_ }
+            , { "client receivers", &clients_receivers_ }, { "server receivers", &server_receivers_ }
+            , { "client senders", &clients_senders_ }, { "server senders", &server_senders_ }
+            , { "client loggers", &clients_loggers_ }, { "server loggers", &server_loggers_ }
+            , { "mirrors", &mirrors_ } };
+        for(const auto &role : roles){
+            operation(role.first, *role.second);
+        }
+    }
+
+    // busy and idle time, steps and wakeups summed up per role
+    void show_task_stats() {
+        for_all_roles([this](const char *role, const vector<unique_ptr<task_t>> &tasks){
+            if(tasks.empty()){
+                return;
+            }
+            task_stats_t total;
+            for(const auto &uptr : tasks){
+                uptr->stats().add_to(&total);
+            }
+            std::string msg = std::string(role) + ": " + total.summary();
+            show_message(msg.c_str());
+        });
+        std::string msg = "superviser: " + superviser_->stats().summary();
+        show_message(msg.c_str());
+    }
+
+    void reset_task_stats() {
+        for_all_roles([](const char *, const vector<unique_ptr<task_t>> &tasks){
+            for(const auto &uptr : tasks){
+                uptr->reset_stats();
+            }
+        });
+        superviser_->reset_stats();
+    }
+
+    void show_latency() {
+        std::string msg = "proxy latency " + latency_.summary();
+        show_message(msg.c_str());
+    }
+
+    void stop_listening() {
+        if(listening_){
+            epoll_ctl(message_on_error, connectors_epoll_, EPOLL_CTL_DEL, listening_socket_, nullptr);
+            listening_ = false;
+        }
+    }
+
+    template <class Condition> static bool wait_until(Condition condition) {
+        const auto deadline = std::chrono::steady_clock::now() + hand_over_timeout;
+        while(!condition()){
+            if(deadline < std::chrono::steady_clock::now()){
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return true;
+    }
+
+    // stops taking new data from the peers and waits until everything taken is sent and logged
+    bool quiesce() {
+        stop_listening();
+        bool ok = wait_until([this](){
+            for(auto &uptr : connectors_){
+                if(static_cast<connector_t *>(uptr.get())->connecting()){
+                    return false;
+                }
+            }
+            return !connector_t::connects_pending();
+        });
+        // no receiver re-arms a socket once the writers have been idle with input held
+        conveyer_.hold_input(true);
+        ok = ok && wait_until([this](){ return conveyer_.writers_idle(); });
+        conveyer_.for_each_live_peer([this](const std::string &, int client_sock, int server_sock){
+            epoll_ctl(message_on_error, clients_receivers_epoll_, EPOLL_CTL_DEL, client_sock, nullptr);
+            epoll_ctl(message_on_error, server_receivers_epoll_, EPOLL_CTL_DEL, server_sock, nullptr);
+        });
+        // let receivers that have already got an event take the line
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        return ok && wait_until([this](){
+            return conveyer_.writers_idle() && !conveyer_.lane_backlog(sender_nms::lane_num)
+                    && !conveyer_.lane_backlog(logger_nms::lane_num);
+        });
+    }
+
+    void resume_io() {
+        conveyer_.hold_input(false);
+        conveyer_.for_each_live_peer([this](const std::string &, int client_sock, int server_sock){
+            epoll_event ee;
+            ee.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+            ee.data.fd = client_sock;
+            epoll_ctl(message_on_error, clients_receivers_epoll_, EPOLL_CTL_ADD, client_sock, &ee);
+            ee.data.fd = server_sock;
+            epoll_ctl(message_on_error, server_receivers_epoll_, EPOLL_CTL_ADD, server_sock, &ee);
+        });
+        listen_for_clients();
+    }
+
+    bool send_connections(unix_channel_t &channel) {
+        bool ok = channel.send(listening_record, "", { listening_socket_ });
+        unsigned cnt = 0;
+        conveyer_.for_each_live_peer([&](const std::string &name, int client_sock, int server_sock){
+            ok = ok && channel.send(peer_record, name, { client_sock, server_sock });
+            std::string state = psql_logger_t<clients_side>::save_state(client_sock);
+            if(!state.empty()){
+                ok = ok && channel.send(sql_state_record, state);
+            }
+            state = backend_logger_t<server_side>::save_state(server_sock);
+            if(!state.empty()){
+                ok = ok && channel.send(backend_state_record, state);
+            }
+            ++cnt;
+        });
+        std::string msg = "connections handed over: " + std::to_string(cnt);
+        show_message(msg.c_str());
+        return ok && channel.send(end_record, "");
+    }
+
+    // takes the listening socket and the peers from the process handing them over
+    void take_over(unix_channel_t &channel) {
+        std::string payload;
+        vector<int> fds;
+        int client_sock = -1;
+        int server_sock = -1;
+        unsigned cnt = 0;
+        auto connector = static_cast<connector_t *>(connectors_.front().get());
+        for(;;){
+            char kind = channel.receive(&payload, &fds, hand_over_timeout);
+            if(kind == end_record){
+                break;
+            } else if(kind == listening_record && fds.size() == 1){
+                listening_socket_ = fds[0];
+            } else if(kind == peer_record && fds.size() == 2){
+                bool adopted = connector->adopt_peer(fds[0], fds[1], payload);
+                client_sock = adopted ? fds[0] : -1;
+                server_sock = adopted ? fds[1] : -1;
+                cnt += adopted;
+            } else if(kind == sql_state_record && fds.empty()){
+                if(client_sock != -1){
+                    psql_logger_t<clients_side>::load_state(client_sock, payload, &pager_);
+                }
+            } else if(kind == backend_state_record && fds.empty()){
+                if(server_sock != -1){
+                    backend_logger_t<server_side>::load_state(server_sock, payload);
+                }
+            } else{
+                for(int fd : fds){
+                    close(message_on_error, fd);
+                }
+                throw std::runtime_error("connections hand over interrupted");
+            }
+        }
+        std::string msg = "connections taken over: " + std::to_string(cnt);
+        show_message(msg.c_str());
+    }
+
 public:
 
     proxy_t(signal_t *error_signal, const std::function<void (const char *)> &message_f
-            , uint32_t proxy_address, uint16_t proxy_port, uint32_t srv_address, uint16_t srv_port)
-        : sys_caller_t(message_f), error_signal_(error_signal)
+            , const endpoint_t &proxy_addr, const endpoint_t &server_addr
+            , const proxy_settings_t &settings)
+        : sys_caller_t(message_f), message_f_(message_f), proxy_addr_(proxy_addr)
+        , error_signal_(error_signal)
+        , threading_level_(thread::hardware_concurrency())
         , memory_waiter_(cache_size / 5, [this](task_t *t){ task_blocked(t); }, [](){})
-        , pager_(&memory_waiter_, page_size, cache_size), conveyer_(lanes_cnt, &pager_)
-        , clients_data_signal_(lanes_cnt), server_data_signal_(lanes_cnt)
-        , threading_level_(thread::hardware_concurrency()), connectors_(threading_level_)
+        , pager_(&memory_waiter_, page_size, cache_size, settings.populate_cache)
+        , spill_file_(message_f, &pager_, logger_nms::lane_num, settings.spill_threshold, spill_size)
+        , spill_path_(settings.spill_path)
+        , logged_messages_(settings.logged_messages)
+        , conveyer_(lanes_cnt, &pager_, settings.connection_quota, &spill_file_
+                    , settings.mirror.size() ? 1 : 0)
+        , clients_data_signal_(conveyer_.client_lane_count(), threading_level_, sender_nms::lane_num)
+        , server_data_signal_(lanes_cnt, threading_level_, sender_nms::lane_num)
+        , connectors_(threading_level_)
         , clients_receivers_(threading_level_), server_receivers_(threading_level_)
         , clients_senders_(threading_level_), server_senders_(threading_level_)
-        , clients_loggers_(threading_level_), server_loggers_(threading_level_) {
-        clients_data_signal_.set_threading_level(threading_level_);
-        server_data_signal_.set_threading_level(threading_level_);
-        sockaddr_in server_addr;
-        memset(&proxy_addr_, 0, sizeof (proxy_addr_));
-        memset(&server_addr, 0, sizeof (proxy_addr_));
-        proxy_addr_.sin_family = AF_INET;
-        server_addr.sin_family = AF_INET;
-        proxy_addr_.sin_addr.s_addr = proxy_address;
-        server_addr.sin_addr.s_addr = srv_address;
-        proxy_addr_.sin_port = proxy_port;
-        server_addr.sin_port = srv_port;
+        , clients_loggers_(threading_level_), server_loggers_(threading_level_)
+        , mirrors_(settings.mirror.size() ? threading_level_ : 0)
+        , hand_over_from_(settings.hand_over_from)
+        , listen_backlog_(settings.listen_backlog)
+        , defer_accept_(settings.defer_accept), fast_open_(settings.fast_open)
+        , backends_(server_addr, settings.replicas)
+        , result_cache_(&pager_, settings.result_cache_ttl, settings.result_cache_pages)
+        , admission_(settings.max_backends, settings.backend_wait, settings.client_rate
+                     , settings.client_burst ? settings.client_burst : settings.client_rate)
+        , latency_(threading_level_ * 2)
+        , capture_(message_f)
+        , capture_path_(settings.capture_path)
+        , cpu_policy_(settings.cpu_policy), cpu_roles_(settings.cpu_roles)
+        , mirror_addr_(settings.mirror), mirror_backlog_(settings.mirror_backlog) {
         for_all_epolls([this](int &fd){
             fd = epoll_create(throw_on_error);
         });
+        connect_options_t connect_options;
+        connect_options.accept_budget = settings.accept_budget;
+        connect_options.fast_open = settings.fast_open;
+        // TCP options are left out on the unix socket side
+        connect_options.client_profile = settings.socket_profile.for_family(proxy_addr_.family());
+        connect_options.server_profile = settings.socket_profile.for_family(
+                    backends_.any_local() ? AF_UNIX : AF_INET);
+        connect_options.cache = &result_cache_;
+        connect_options.connect_epoll = connect_epoll_;
+        if(backends_.has_replicas()){
+            connect_options.startup_epoll = startup_epoll_;
+        }
+        if(admission_.enabled()){
+            connect_options.admission = &admission_;
+        }
         for(auto &uptr : connectors_){
-            uptr = std::make_unique<connector_t>(server_addr, connectors_epoll_
-                        , clients_receivers_epoll_, server_receivers_epoll_
-                        , clients_senders_epoll_, server_senders_epoll_
-                        , &connectors_ctrl_, &memory_waiter_, &conveyer_, message_f);
+            uptr = std::make_unique<connector_t>(&backends_, connectors_epoll_
+                        , clients_receivers_epoll_, server_receivers_epoll_, &connectors_ctrl_, &memory_waiter_, &conveyer_
+                        , connect_options, &setup_stats_, message_f);
         }
+        // the receivers take the latency histograms past the senders' ones
+        unsigned reader_number = threading_level_;
         for(auto &uptr : clients_receivers_){
             uptr = std::make_unique<receiver_t<clients_side>>(&clients_data_signal_
-                        , clients_receivers_epoll_, &clients_receivers_ctrl_
-                        , &memory_waiter_, &conveyer_, message_f);
+                        , &server_data_signal_, clients_receivers_epoll_, &clients_receivers_ctrl_
+                        , &memory_waiter_, &conveyer_, connect_options.client_profile
+                        , connect_options.server_profile, &result_cache_
+                        , latency_.histogram(true, reader_number), message_f);
+            ++reader_number;
         }
+        reader_number = threading_level_;
         for(auto &uptr : server_receivers_){
             uptr = std::make_unique<receiver_t<server_side>>(&server_data_signal_
-                        , server_receivers_epoll_, &server_receivers_ctrl_
-                        , &memory_waiter_, &conveyer_, message_f);
+                        , &clients_data_signal_, server_receivers_epoll_, &server_receivers_ctrl_
+                        , &memory_waiter_, &conveyer_, connect_options.server_profile
+                        , connect_options.client_profile, &result_cache_
+                        , latency_.histogram(false, reader_number), message_f);
+            ++reader_number;
         }
-        unsigned reader_number = 0;
+        reader_number = 0;
         for(auto &uptr : clients_senders_){
-            uptr = std::make_unique<sender_t<clients_side>>(reader_number++
+            uptr = std::make_unique<sender_t<clients_side>>(reader_number
                         , &clients_data_signal_, &clients_senders_ctrl_
-                        , &memory_waiter_, &conveyer_, message_f);
+                        , &memory_waiter_, &conveyer_, connect_options.server_profile
+                        , latency_.histogram(true, reader_number), message_f);
+            ++reader_number;
         }
         reader_number = 0;
         for(auto &uptr : server_senders_){
-            uptr = std::make_unique<sender_t<server_side>>(reader_number++
+            uptr = std::make_unique<sender_t<server_side>>(reader_number
                         , &server_data_signal_, &server_senders_ctrl_
-                        , &memory_waiter_, &conveyer_, message_f);
+                        , &memory_waiter_, &conveyer_, connect_options.client_profile
+                        , latency_.histogram(false, reader_number), message_f);
+            ++reader_number;
         }
-        clients_senders_hlp_ = std::make_unique<senders_helper_t<clients_side>>(&clients_data_signal_
-                        , clients_senders_epoll_, &clients_senders_ctrl_
-                        , &memory_waiter_, &conveyer_, message_f);
-        server_senders_hlp_ = std::make_unique<senders_helper_t<server_side>>(&server_data_signal_
-                        , server_senders_epoll_, &server_senders_ctrl_
-                        , &memory_waiter_, &conveyer_, message_f);
         reader_number = 0;
         for(auto &uptr : clients_loggers_){
             uptr = std::make_unique<psql_logger_t<clients_side>>(reader_number++
                         , &clients_data_signal_, &clients_loggers_ctrl_
-                        , &memory_waiter_, &conveyer_, message_f);
+                        , &memory_waiter_, &conveyer_, &log_detail_, &capture_, message_f);
         }
         reader_number = 0;
         for(auto &uptr : server_loggers_){
-            uptr = std::make_unique<logger_t<server_side>>(reader_number++
+            uptr = std::make_unique<backend_logger_t<server_side>>(reader_number++
                         , &server_data_signal_, &server_loggers_ctrl_
+                        , &memory_waiter_, &conveyer_, &log_detail_, &capture_, message_f);
+        }
+        reader_number = 0;
+        for(auto &uptr : mirrors_){
+            uptr = std::make_unique<mirror_t>(reader_number++, &clients_data_signal_, &mirrors_ctrl_
                         , &memory_waiter_, &conveyer_, message_f);
         }
         vector<task_control_t *> memory_consumers_ctrls
                 = { &connectors_ctrl_, &clients_receivers_ctrl_ , &server_receivers_ctrl_};
         vector<task_control_t *> memory_producers_ctrls
                 = { &clients_senders_ctrl_, &server_senders_ctrl_
-                    , &clients_loggers_ctrl_, &server_loggers_ctrl_ };
+                    , &clients_loggers_ctrl_, &server_loggers_ctrl_, &mirrors_ctrl_ };
         vector<task_t *> memory_consumers(connectors_.size() + clients_receivers_.size()
                                    + server_receivers_.size());
         const auto uptr_to_ptr = [](const unique_ptr<task_t> &uptr){ return uptr.get(); };
@@ -175,16 +490,17 @@ public:
         std::transform(clients_receivers_.begin(), clients_receivers_.end(), p, uptr_to_ptr);
         std::transform(server_receivers_.begin(), server_receivers_.end(), p, uptr_to_ptr);
         vector<task_t *> memory_producers(clients_senders_.size() + server_senders_.size()
-                                   + clients_loggers_.size() + server_loggers_.size());
+                                   + clients_loggers_.size() + server_loggers_.size() + mirrors_.size());
         p = std::transform(clients_senders_.begin(), clients_senders_.end()
                            , memory_producers.begin(), uptr_to_ptr);
         p = std::transform(server_senders_.begin(), server_senders_.end(), p, uptr_to_ptr);
         p = std::transform(clients_loggers_.begin(), clients_loggers_.end(), p, uptr_to_ptr);
-        std::transform(server_loggers_.begin(), server_loggers_.end(), p, uptr_to_ptr);
+        p = std::transform(server_loggers_.begin(), server_loggers_.end(), p, uptr_to_ptr);
+        std::transform(mirrors_.begin(), mirrors_.end(), p, uptr_to_ptr);
         superviser_ = std::make_unique<superviser_t>(std::move(memory_consumers_ctrls)
                     , std::move(memory_producers_ctrls), std::move(memory_consumers)
                     , std::move(memory_producers), &superviser_ctrl_, &memory_waiter_
-                    , &conveyer_, &pager_, message_f);
+                    , &conveyer_, &pager_, &log_detail_, &capture_, message_f);
     }
 
     ~proxy_t() {
@@ -201,23 +517,130 @@ public:
         msg += std::to_string(pager_.page_size() * pager_.cache_size());
         msg += " bytes";
         show_message(msg.c_str());
+        msg = "connection quota: ";
+        msg += conveyer_.page_quota() ? std::to_string(conveyer_.page_quota()) + " pages" : "none";
+        show_message(msg.c_str());
+        msg = "logging spill threshold: ";
+        msg += spill_file_.threshold() ? std::to_string(spill_file_.threshold()) + " pages" : "none";
+        show_message(msg.c_str());
+        spill_file_.open(spill_path_.c_str());
+        psql_logger_t<clients_side>::set_filter(logged_messages_);
+        msg = "logged messages: " + logged_messages_;
+        show_message(msg.c_str());
+        if(backends_.has_replicas()){
+            msg = "read-only connections routed to " + std::to_string(backends_.count() - 1) + " replicas";
+            show_message(msg.c_str());
+        }
+        if(result_cache_.enabled()){
+            msg = "result cache: " + std::to_string(result_cache_.max_pages()) + " pages, ttl "
+                    + std::to_string(result_cache_.ttl_ms()) + " ms";
+            show_message(msg.c_str());
+        }
+        if(admission_.max_backends()){
+            msg = "server connections limited to " + std::to_string(admission_.max_backends())
+                    + ", clients wait up to " + std::to_string(admission_.wait_ms()) + " ms";
+            show_message(msg.c_str());
+        }
+        if(admission_.rate()){
+            msg = "connections of a client address limited to " + std::to_string(admission_.rate())
+                    + " per s, burst " + std::to_string(admission_.burst());
+            show_message(msg.c_str());
+        }
+        if(!capture_path_.empty()){
+            // the process handing over still writes the file
+            std::string path = capture_path_;
+            if(!hand_over_from_.empty()){
+                path += "." + std::to_string(::getpid());
+            }
+            if(!capture_.open(path)){
+                throw std::runtime_error("can't create the capture file " + path);
+            }
+            msg = "capturing traffic to " + path;
+            show_message(msg.c_str());
+        }
+        if(mirroring()){
+            if(!mirror_t::start(mirror_addr_, mirror_backlog_, message_f_)){
+                throw std::runtime_error("can't start mirroring");
+            }
+            msg = "client traffic mirrored to " + mirror_addr_.to_string() + ", backlog "
+                    + std::to_string(mirror_backlog_) + " bytes";
+            show_message(msg.c_str());
+        }
         auto tl = std::to_string(threading_level_);
         msg = "threading level: " + tl + " connectors + "
                 + tl + " client receivers + " + tl + " server receivers + "
                 + tl + " client senders + " + tl + " server senders + "
                 + tl + " client loggers + " + tl + " server loggers";
+        if(mirroring()){
+            msg += " + " + tl + " mirrors";
+        }
         show_message(msg.c_str());
-        listening_socket_ = socket(throw_on_error, PF_INET
-                                   , SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
-        int opt = 1;
-        setsockopt(listening_socket_, SOL_SOCKET, SO_REUSEPORT, (const char*)&opt, sizeof(opt));
-        bind(throw_on_error, listening_socket_, (sockaddr *)&proxy_addr_, sizeof(sockaddr_in));
-        listen(throw_on_error, listening_socket_, 128);
-        epoll_event ee;
-        ee.events = EPOLLIN | EPOLLEXCLUSIVE;
-        ee.data.fd = listening_socket_;
-        epoll_ctl(throw_on_error, connectors_epoll_, EPOLL_CTL_ADD, listening_socket_, &ee);
-        threads_.reserve(threading_level_ * 7 + 3);
+        cpu_placement_t placement(cpu_policy_, cpu_roles_, message_f_);
+        if(placement.placed()){
+            for(unsigned r = 0; r < cpu_placement_nms::role_cnt; ++r){
+                msg = placement.description(static_cast<cpu_placement_nms::role_t>(r));
+                show_message(msg.c_str());
+            }
+        }
+        unique_ptr<unix_channel_t> channel;
+        if(hand_over_from_.empty()){
+            const bool local = proxy_addr_.is_local();
+            listening_socket_ = socket(throw_on_error, proxy_addr_.family()
+                                       , SOCK_STREAM | SOCK_NONBLOCK, local ? 0 : IPPROTO_TCP);
+            int opt = 1;
+            if(local){
+                // a socket file left by a process that didn't stop cleanly
+                ::unlink(proxy_addr_.path());
+                unlink_listening_ = true;
+            } else{
+                setsockopt(message_on_error, listening_socket_, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+            }
+            if(defer_accept_ && !local){
+                opt = defer_accept_;
+                setsockopt(message_on_error, listening_socket_, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opt, sizeof(opt));
+            }
+            if(fast_open_ && !local){
+                opt = fast_open_;
+                setsockopt(message_on_error, listening_socket_, IPPROTO_TCP, TCP_FASTOPEN, &opt, sizeof(opt));
+            }
+            bind(throw_on_error, listening_socket_, proxy_addr_.addr(), proxy_addr_.size());
+            listen(throw_on_error, listening_socket_, listen_backlog_);
+        } else{
+            channel = std::make_unique<unix_channel_t>(message_f_);
+            listening_socket_ = -1;
+            try{
+                channel->connect(hand_over_from_);
+                hand_over_from_.clear();
+                take_over(*channel);
+                if(listening_socket_ == -1){
+                    throw std::runtime_error("no listening socket handed over");
+                }
+                // nothing is read from the connections until the old process has stopped doing so
+                std::string payload;
+                vector<int> fds;
+                if(!channel->send(ack_record, "")
+                        || channel->receive(&payload, &fds, hand_over_timeout) != go_record){
+                    for(int fd : fds){
+                        close(message_on_error, fd);
+                    }
+                    throw std::runtime_error("connections hand over not confirmed");
+                }
+                unlink_listening_ = proxy_addr_.is_local();
+            } catch(...){
+                // the connections still belong to the old process
+                conveyer_.hand_over();
+                conveyer_.clear();
+                if(listening_socket_ != -1){
+                    close(message_on_error, listening_socket_);
+                }
+                throw;
+            }
+        }
+        listen_for_clients();
+        watch_admission();
+        watch_startups();
+        watch_connects();
+        threads_.reserve(threading_level_ * 7 + mirrors_.size() + 1);
         const auto run_task = [this](task_t *ptask){
             try{
                 ptask->run();
@@ -230,18 +653,80 @@ public:
                 error_signal_->notify_all();
             }
         };
+        // in the order of the roles
+        unsigned role = 0;
         for(auto ptasks : { &connectors_, &clients_receivers_, &server_receivers_
-            , &clients_senders_, &server_senders_ , &clients_loggers_, &server_loggers_ }){
+            , &clients_senders_, &server_senders_ , &clients_loggers_, &server_loggers_, &mirrors_ }){
+            unsigned thread_num = 0;
             for(auto &uptr : *ptasks){
                 threads_.emplace_back([ptask = uptr.get(), run_task](){ run_task(ptask); });
+                placement.apply(static_cast<cpu_placement_nms::role_t>(role), thread_num++
+                                , threads_.back().native_handle());
             }
+            ++role;
         }
-        threads_.emplace_back([ptask = server_senders_hlp_.get(), run_task](){ run_task(ptask); });
-        threads_.emplace_back([ptask = clients_senders_hlp_.get(), run_task](){ run_task(ptask); });
         threads_.emplace_back([ptask = superviser_.get(), run_task](){ run_task(ptask); });
+        placement.apply(cpu_placement_nms::superviser, 0, threads_.back().native_handle());
         show_message("proxy started");
     }
 
+    // passes the listening socket and the connections with the SQL logger state
+    // to a new process started by spawn_f(path) and connecting to the unix socket at path;
+    // on success the proxy is left to be stopped, otherwise it keeps running
+    bool hand_over(const std::string &path, const std::function<bool (const std::string &)> &spawn_f) {
+        assert(!threads_.empty());
+        show_message("handing connections over...");
+        bool done = false;
+        try{
+            unix_channel_t channel(message_f_);
+            channel.listen(path);
+            std::string payload;
+            vector<int> fds;
+            done = quiesce() && spawn_f(path) && channel.accept(hand_over_timeout);
+            if(done){
+                // from here on the peers dropped by this process are only closed
+                conveyer_.hand_over();
+            }
+            // once the go record is out the new process serves the connections, this one mustn't resume
+            done = done && send_connections(channel)
+                    && channel.receive(&payload, &fds, hand_over_timeout) == ack_record
+                    && channel.send(go_record, "");
+        } catch(std::exception &e){
+            show_message(e.what());
+        }
+        if(!done){
+            show_message("connections hand over failed");
+            resume_io();
+            return false;
+        }
+        // the socket file now belongs to the new process
+        unlink_listening_ = false;
+        show_message("connections handed over");
+        return true;
+    }
+
+    // the statistics gathered so far, the proxy keeps running
+    void show_stats() {
+        show_task_stats();
+        show_latency();
+    }
+
+    // the task steps, waits, epoll calls and lock spins of every thread are recorded
+    void switch_tracing() {
+        const bool on = !tracer_t::enabled();
+        tracer_t::enable(on);
+        show_message(on ? "tracing on" : "tracing off");
+    }
+
+    // the events recorded since tracing was switched on, as Chrome trace JSON
+    void dump_trace() {
+        const std::string path = "proxy_trace." + std::to_string(::getpid()) + ".json";
+        long cnt = tracer_t::dump(path);
+        std::string msg = cnt == -1 ? "unable to write the trace to " + path
+                                    : std::to_string(cnt) + " trace events written to " + path;
+        show_message(msg.c_str());
+    }
+
     void stop() {
         if(threads_.empty()){
             return;
@@ -257,14 +742,82 @@ public:
         }
         threads_.clear();
         conveyer_.clear();
+        if(admission_.max_backends()){
+            epoll_ctl(message_on_error, connectors_epoll_, EPOLL_CTL_DEL, admission_.wakeup_fd(), nullptr);
+        }
+        if(backends_.has_replicas()){
+            epoll_ctl(message_on_error, connectors_epoll_, EPOLL_CTL_DEL, startup_epoll_, nullptr);
+            connector_t::clear_startups();
+        }
+        epoll_ctl(message_on_error, connectors_epoll_, EPOLL_CTL_DEL, connect_epoll_, nullptr);
+        connector_t::clear_connects();
+        for(int sock : admission_.reset()){
+            admission_nms::refuse(sock, "the proxy is stopping");
+            close(message_on_error, sock);
+        }
+        if(admission_.enabled()){
+            std::string msg = "admission: " + admission_.stats.summary();
+            show_message(msg.c_str());
+            admission_.stats.reset();
+        }
+        if(result_cache_.enabled()){
+            show_message(result_cache_.stats().c_str());
+            result_cache_.reset_stats();
+        }
+        result_cache_.clear();
+        // the loggers hold the pages of the messages they haven't seen the end of
+        psql_logger_t<clients_side>::reset();
+        backend_logger_t<server_side>::reset();
         memory_waiter_.reset();
-        pager_.reset();
+        if(unsigned held = pager_.reset()){
+            std::string msg = "memory cache pages leaked: " + std::to_string(held);
+            show_message(msg.c_str());
+        }
         clients_data_signal_.reset();
         server_data_signal_.reset();
-        psql_logger_t<clients_side>::reset();
+        if(spill_file_.pages_spilled()){
+            std::string msg = "pages spilled: " + std::to_string(spill_file_.pages_spilled());
+            show_message(msg.c_str());
+        }
+        spill_file_.close();
+        if(auto accepted = setup_stats_.accepted.load()){
+            std::string msg = "connections accepted: " + std::to_string(accepted)
+                    + " in " + std::to_string(setup_stats_.batches.load()) + " batches, setup time avg "
+                    + std::to_string(setup_stats_.total_ns.load() / accepted / 1000) + " us, max "
+                    + std::to_string(setup_stats_.max_ns.load() / 1000) + " us";
+            show_message(msg.c_str());
+        }
+        setup_stats_.reset();
+        show_task_stats();
+        reset_task_stats();
+        show_latency();
+        latency_.reset();
+        std::string responses = "server responses: " + backend_logger_t<server_side>::summary();
+        show_message(responses.c_str());
+        backend_logger_t<server_side>::reset_stats();
+        if(!capture_path_.empty()){
+            std::string msg = "captured: " + capture_.summary();
+            show_message(msg.c_str());
+            capture_.close();
+        }
+        if(mirroring()){
+            std::string msg = "mirrored: " + mirror_t::summary();
+            show_message(msg.c_str());
+            mirror_t::reset_stats();
+            mirror_t::reset();
+        }
+        if(backends_.has_replicas()){
+            std::string msg = "peers routed: " + backends_.routed_summary();
+            show_message(msg.c_str());
+            backends_.reset();
+        }
         for_all_controls([](task_control_t &ctrl){ ctrl.reset(); });
-        epoll_ctl(message_on_error, connectors_epoll_, EPOLL_CTL_DEL, listening_socket_, nullptr);
+        stop_listening();
         close(message_on_error, listening_socket_);
+        if(unlink_listening_){
+            unlink(message_on_error, proxy_addr_.path());
+            unlink_listening_ = false;
+        }
         show_message("proxy stoped");
     }
 };
@@ -272,3 +825,4 @@ public:
 }
 
 using proxy_nms::proxy_t;
+using proxy_nms::proxy_settings_t;
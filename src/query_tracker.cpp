@@ -0,0 +1,499 @@
+#include "query_tracker.h"
+
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+
+namespace query_tracker_nms {
+
+namespace {
+
+const unsigned max_held_size = 8192;    // longer queries are never cached
+const unsigned max_text_size = 65536;   // longer statements invalidate everything
+
+const uint32_t startup_code = 196608;
+const uint32_t ssl_code = 80877103;
+const uint32_t gss_code = 80877104;
+
+uint32_t int4(const void *data) {
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+}
+
+// words in lower case and punctuation, literals and comments skipped,
+// quoted identifiers kept as they are
+vector<string> tokens(const string &query) {
+    vector<string> res;
+    const char *p = query.c_str();
+    const char *end = p + query.size();
+    while(p < end){
+        unsigned char c = *p;
+        if(std::isspace(c)){
+            ++p;
+        } else if(c == '-' && p + 1 < end && p[1] == '-'){
+            while(p < end && *p != '\n'){ ++p; }
+        } else if(c == '/' && p + 1 < end && p[1] == '*'){
+            const char *close = std::strstr(p + 2, "*/");
+            p = close ? close + 2 : end;
+        } else if(c == '\''){
+            for(++p; p < end; ++p){
+                if(*p == '\''){
+                    if(p + 1 < end && p[1] == '\''){ ++p; continue; }
+                    break;
+                }
+            }
+            ++p;
+            res.emplace_back("'");
+        } else if(c == '"' || std::isalnum(c) || c == '_'){
+            string word;
+            while(p < end){
+                c = *p;
+                if(c == '"'){
+                    const char *close = static_cast<const char *>(memchr(p + 1, '"', end - p - 1));
+                    word.append(p + 1, close ? close : end);
+                    p = close ? close + 1 : end;
+                } else if(std::isalnum(c) || c == '_' || c == '$' || c == '.'){
+                    word += static_cast<char>(std::tolower(c));
+                    ++p;
+                } else{
+                    break;
+                }
+            }
+            res.push_back(std::move(word));
+        } else{
+            res.emplace_back(1, static_cast<char>(c));
+            ++p;
+        }
+    }
+    return res;
+}
+
+string table_name(const string &word) {
+    auto dot = word.rfind('.');
+    return dot == string::npos ? word : word.substr(dot + 1);
+}
+
+bool is_word(const string &token) {
+    unsigned char c = token.empty() ? 0 : token[0];
+    return std::isalnum(c) || c == '_';
+}
+
+bool one_of(const string &token, std::initializer_list<const char *> words) {
+    for(auto w : words){
+        if(token == w){
+            return true;
+        }
+    }
+    return false;
+}
+
+// names in the FROM lists and after JOIN
+void read_tables(const vector<string> &tok, vector<string> *tables) {
+    bool in_from = false;
+    bool expect_name = false;
+    for(unsigned i = 0; i < tok.size(); ++i){
+        const string &t = tok[i];
+        if(t == "from" || t == "join"){
+            in_from = true;
+            expect_name = true;
+        } else if(expect_name){
+            if(is_word(t) && !one_of(t, { "lateral", "only" })){
+                tables->push_back(table_name(t));
+            }
+            expect_name = one_of(t, { "lateral", "only" });
+        } else if(in_from && t == ","){
+            expect_name = true;
+        } else if(one_of(t, { "where", "group", "order", "limit", "offset", "having", "union"
+                              , "except", "intersect", "window", "on", "using", ")", ";" })){
+            in_from = false;
+        }
+    }
+}
+
+}
+
+unsigned message_framer_t::length() const {
+    uint32_t len = int4(header + (typeless ? 0 : 1));
+    return len < 4 ? 0 : len - 4;
+}
+
+bool cacheable_select(const string &query, vector<string> *tables) {
+    auto tok = tokens(query);
+    if(tok.empty() || tok[0] != "select"){
+        return false;
+    }
+    for(unsigned i = 0; i < tok.size(); ++i){
+        const string &t = tok[i];
+        if(one_of(t, { "into", "nextval", "setval", "currval", "random", "now", "clock_timestamp"
+                       , "timeofday", "statement_timestamp", "txid_current", "pg_sleep", "set_config" })){
+            return false;
+        }
+        if(t == "for" && i + 1 < tok.size()
+                && one_of(tok[i + 1], { "update", "share", "no", "key" })){
+            return false;
+        }
+        if(t.compare(0, 12, "pg_advisory_") == 0){
+            return false;
+        }
+    }
+    read_tables(tok, tables);
+    return true;
+}
+
+bool changes_session(const string &query) {
+    auto tok = tokens(query);
+    for(unsigned i = 0; i < tok.size(); ++i){
+        if(tok[i] == "set_config"
+                || ((i == 0 || tok[i - 1] == ";") && one_of(tok[i], { "set", "reset", "discard" }))){
+            return true;
+        }
+    }
+    return false;
+}
+
+bool written_tables(const string &query, vector<string> *tables) {
+    auto tok = tokens(query);
+    if(tok.empty() || one_of(tok[0], { "begin", "start", "commit", "end", "rollback", "abort"
+                                       , "set", "show", "savepoint", "release", "deallocate"
+                                       , "discard", "listen", "unlisten", "notify", "explain"
+                                       , "fetch", "move", "close", "declare", "reset", "values"
+                                       , "table", "vacuum", "analyze", "checkpoint", "prepare"
+                                       , "execute", ";" })){
+        return false;
+    }
+    if(tok[0] == "select"){
+        return false;
+    }
+    const auto name_after = [&tok, tables](const char *word){
+        for(unsigned i = 0; i + 1 < tok.size(); ++i){
+            if(tok[i] == word){
+                unsigned j = i + 1;
+                while(j < tok.size() && one_of(tok[j], { "table", "only", "materialized", "view"
+                                                         , "if", "exists" })){
+                    ++j;
+                }
+                if(j < tok.size() && is_word(tok[j])){
+                    tables->push_back(table_name(tok[j]));
+                    return true;
+                }
+            }
+        }
+        return false;
+    };
+    const string &verb = tok[0];
+    if(verb == "insert" || verb == "merge"){
+        name_after("into");
+    } else if(verb == "update" || verb == "truncate" || verb == "refresh"){
+        name_after(verb.c_str());
+        if(verb == "truncate"){
+            for(unsigned i = 2; i + 1 < tok.size() && tok[i] == ","; i += 2){
+                tables->push_back(table_name(tok[i + 1]));
+            }
+        }
+    } else if(verb == "delete"){
+        name_after("from");
+    } else if(verb == "copy" && 2 < tok.size() && tok[2] == "from"){
+        tables->push_back(table_name(tok[1]));
+    } else if(verb == "alter" || verb == "drop"){
+        name_after(verb.c_str());
+    }
+    return true;
+}
+
+bool query_tracker_t::idle() const {
+    return !disabled() && !client_.typeless && !extended_
+            && outstanding_.load(std::memory_order_acquire) == 0
+            && txn_status_.load(std::memory_order_acquire) == 'I';
+}
+
+void query_tracker_t::on_write(const vector<string> &tables) {
+    cache_->invalidate(tables);
+    lock_guard<mutex> lg(mx_);
+    written_.push_back(tables.empty() ? string() : tables.front());
+    for(unsigned i = 1; i < tables.size(); ++i){
+        written_.push_back(tables[i]);
+    }
+}
+
+void query_tracker_t::on_client_message() {
+    if(client_.typeless){
+        uint32_t code = 4 <= body_.size() ? int4(body_.data()) : 0;
+        if(code == ssl_code || code == gss_code){
+            ssl_answer_.store(1, std::memory_order_release);
+            return;
+        }
+        if(code != startup_code){
+            disabled_.store(1, std::memory_order_release);
+            return;
+        }
+        // name=value pairs of zero terminated strings
+        const char *p = body_.c_str() + 4;
+        const char *end = body_.c_str() + body_.size();
+        while(p < end && *p){
+            const char *value = p + std::strlen(p) + 1;
+            if(end <= value){
+                break;
+            }
+            if(std::strcmp(p, "user") == 0){
+                user_ = value;
+            } else if(std::strcmp(p, "database") == 0){
+                database_ = value;
+            } else{
+                settings_.append(p, value + std::strlen(value) + 1);
+            }
+            p = value + std::strlen(value) + 1;
+        }
+        if(database_.empty()){
+            database_ = user_;
+        }
+        client_.typeless = false;
+        outstanding_.fetch_add(1, std::memory_order_acq_rel);
+        return;
+    }
+    switch(client_.type()){
+    case 'Q':
+    {
+        bool served = false;
+        vector<string> tables;
+        if(!keep_body_){
+            on_write(tables);
+            session_changed_ = true;
+        } else{
+            string text(body_.c_str());
+            const bool changes = changes_session(text);
+            if(holding_ && !changes && cacheable_select(text, &tables)){
+                string key = database_ + '\0' + user_ + '\0' + settings_ + '\0' + text;
+                auto hit = cache_->find(key);
+                served = static_cast<bool>(hit);
+                if(served){
+                    lock_guard<mutex> lg(mx_);
+                    hit_ = std::move(hit);
+                    hit_pending_.store(1, std::memory_order_release);
+                } else{
+                    lock_guard<mutex> lg(mx_);
+                    request_.reset(new request_t{ std::move(key), std::move(tables), cache_->generation() });
+                }
+            } else if(written_tables(text, &tables)){
+                on_write(tables);
+            }
+            session_changed_ = session_changed_ || changes;
+        }
+        if(holding_ && !served){
+            out_ += held_;
+        }
+        held_.clear();
+        if(!served){
+            outstanding_.fetch_add(1, std::memory_order_acq_rel);
+        }
+        break;
+    }
+    case 'P':
+    {
+        extended_ = true;
+        vector<string> tables;
+        if(!keep_body_){
+            on_write(tables);
+            session_changed_ = true;
+            break;
+        }
+        auto name_end = body_.find('\0');
+        session_changed_ = session_changed_ || name_end != 0
+                || changes_session(string(body_.c_str() + name_end + 1));
+        if(name_end != string::npos && written_tables(string(body_.c_str() + name_end + 1), &tables)){
+            on_write(tables);
+        }
+        break;
+    }
+    case 'S':
+        extended_ = false;
+        outstanding_.fetch_add(1, std::memory_order_acq_rel);
+        break;
+    case 'F':
+        outstanding_.fetch_add(1, std::memory_order_acq_rel);
+        break;
+    case 'B': case 'E': case 'D': case 'C': case 'H':
+        extended_ = true;
+        break;
+    }
+}
+
+unsigned query_tracker_t::client_data(const int8_t *data, unsigned size, const int8_t **out) {
+    if(disabled()){
+        *out = data;
+        return size;
+    }
+    out_.clear();
+    const char *p = reinterpret_cast<const char *>(data);
+    const char *end = p + size;
+    while(p < end){
+        if(hit_pending()){
+            rest_.append(p, end);
+            break;
+        }
+        if(client_.in_header()){
+            client_.header[client_.header_len++] = *p++;
+            if(client_.in_header()){
+                continue;
+            }
+            if(int4(client_.header + (client_.typeless ? 0 : 1)) < 4){
+                disabled_.store(1, std::memory_order_release);
+                out_.append(reinterpret_cast<const char *>(client_.header), client_.header_len);
+                out_.append(p, end);
+                break;
+            }
+            client_.remaining = client_.length();
+            const char type = client_.type();
+            holding_ = type == 'Q' && client_.remaining <= max_held_size && idle() && !session_changed_;
+            keep_body_ = client_.typeless
+                    || ((type == 'Q' || type == 'P') && client_.remaining <= max_text_size);
+            body_.clear();
+            (holding_ ? held_ : out_).append(reinterpret_cast<const char *>(client_.header)
+                                             , client_.header_len);
+        } else{
+            unsigned n = std::min<unsigned>(end - p, client_.remaining);
+            (holding_ ? held_ : out_).append(p, n);
+            if(keep_body_){
+                body_.append(p, n);
+            }
+            p += n;
+            client_.remaining -= n;
+        }
+        if(client_.remaining == 0){
+            on_client_message();
+            client_.header_len = 0;
+            holding_ = false;
+        }
+    }
+    *out = reinterpret_cast<const int8_t *>(out_.data());
+    return out_.size();
+}
+
+unsigned query_tracker_t::from_rest(const int8_t **out) {
+    string rest;
+    rest.swap(rest_);
+    unsigned res = client_data(reinterpret_cast<const int8_t *>(rest.data()), rest.size(), out);
+    // the data is referenced by *out only if nothing was copied
+    if(disabled()){
+        out_ = std::move(rest);
+        *out = reinterpret_cast<const int8_t *>(out_.data());
+    }
+    return res;
+}
+
+void query_tracker_t::record(const int8_t *data, unsigned size) {
+    if(cache_->max_entry_size() < entry_->size + size){
+        record_failed_ = true;
+        return;
+    }
+    const unsigned page_size = cache_->pager()->page_size();
+    try{
+        while(size){
+            unsigned offset = entry_->size % page_size;
+            if(offset == 0){
+                entry_->pages.push_back(cache_->pager()->get_page());
+            }
+            unsigned n = std::min(size, page_size - offset);
+            memcpy(entry_->pages.back()->data() + offset, data, n);
+            entry_->size += n;
+            data += n;
+            size -= n;
+        }
+    } catch(...){
+        record_failed_ = true;
+    }
+}
+
+void query_tracker_t::on_server_header() {
+    if(!recording_){
+        lock_guard<mutex> lg(mx_);
+        if(request_){
+            recording_ = std::move(request_);
+            entry_ = std::make_shared<result_cache_t::entry_t>();
+            entry_->key = recording_->key;
+            entry_->tables = recording_->tables;
+            record_failed_ = false;
+        }
+    }
+    if(recording_ && !record_failed_){
+        // row descriptions, rows, completions and the final ReadyForQuery only
+        if(std::strchr("TDCIZ", server_.type())){
+            record(server_.header, server_.header_len);
+        } else{
+            record_failed_ = true;
+        }
+    }
+}
+
+void query_tracker_t::on_server_message() {
+    if(server_.type() != 'Z'){
+        return;
+    }
+    const int status = last_byte_;
+    txn_status_.store(status, std::memory_order_release);
+    int cur = outstanding_.load(std::memory_order_acquire);
+    while(0 < cur && !outstanding_.compare_exchange_weak(cur, cur - 1)){}
+    if(recording_){
+        if(!record_failed_ && status == 'I'){
+            cache_->store(std::move(entry_), recording_->generation);
+        }
+        recording_.reset();
+        entry_.reset();
+    }
+    if(status != 'I'){
+        return;
+    }
+    // the writes are committed now, anything cached in the meantime goes too
+    vector<string> written;
+    {
+        lock_guard<mutex> lg(mx_);
+        written.swap(written_);
+    }
+    if(!written.empty()){
+        if(std::find(written.begin(), written.end(), string()) != written.end()){
+            written.clear();
+        }
+        cache_->invalidate(written);
+    }
+}
+
+void query_tracker_t::from_server(const int8_t *data, unsigned size) {
+    const int8_t *end = data + size;
+    while(data < end && !disabled()){
+        if(server_.header_len == 0 && ssl_answer_.load(std::memory_order_acquire)){
+            if(*data != 'N'){
+                disabled_.store(1, std::memory_order_release);
+                return;
+            }
+            ssl_answer_.store(0, std::memory_order_release);
+            ++data;
+            continue;
+        }
+        if(server_.in_header()){
+            server_.header[server_.header_len++] = *data++;
+            if(server_.in_header()){
+                continue;
+            }
+            if(int4(server_.header + 1) < 4){
+                disabled_.store(1, std::memory_order_release);
+                return;
+            }
+            server_.remaining = server_.length();
+            on_server_header();
+        } else{
+            unsigned n = std::min<unsigned>(end - data, server_.remaining);
+            if(recording_ && !record_failed_){
+                record(data, n);
+            }
+            last_byte_ = data[n - 1];
+            data += n;
+            server_.remaining -= n;
+        }
+        if(server_.remaining == 0){
+            on_server_message();
+            server_.header_len = 0;
+        }
+    }
+    server_between_.store(server_.header_len == 0, std::memory_order_release);
+}
+
+}
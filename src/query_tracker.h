@@ -0,0 +1,154 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+#include "result_cache.h"
+
+namespace query_tracker_nms {
+
+using std::string;
+using std::vector;
+using std::shared_ptr;
+using std::unique_ptr;
+using std::mutex;
+using std::atomic_int;
+using std::lock_guard;
+
+// frames a stream of PostgreSQL messages, the first ones of a client stream have no type byte
+struct message_framer_t {
+    int8_t header[5];
+    unsigned header_len = 0;
+    unsigned remaining = 0;     // body bytes still to come
+    bool typeless = false;
+
+    unsigned header_size() const { return typeless ? 4 : 5; }
+
+    bool in_header() const { return header_len < header_size(); }
+
+    char type() const { return typeless ? 0 : header[0]; }
+
+    unsigned length() const;    // of the body
+};
+
+// follows the queries of one connection for the result cache: the client side holds
+// a cacheable query back until it is complete and drops it on a hit, the server side
+// records the response to a missed one; each side is fed by the receiver owning its line
+class query_tracker_t {
+
+    struct request_t {
+        string key;
+        vector<string> tables;
+        uint64_t generation;
+    };
+
+    result_cache_t *cache_;
+
+    // shared by both sides
+    atomic_int outstanding_ = { 0 };    // requests waiting for ReadyForQuery
+    atomic_int txn_status_ = { 'I' };
+    atomic_int disabled_ = { 0 };       // encrypted or cancel connection
+    atomic_int ssl_answer_ = { 0 };     // the server answers an encryption request with one byte
+    atomic_int server_between_ = { 1 }; // the server data written so far ends with a whole message
+    atomic_int hit_pending_ = { 0 };    // until the cached response has been written
+    mutex mx_;
+    unique_ptr<request_t> request_;     // the query whose response is to be recorded
+    vector<string> written_;            // tables written by the current transaction
+    shared_ptr<const result_cache_t::entry_t> hit_;
+
+    // client side
+    message_framer_t client_ = { {}, 0, 0, true };
+    string user_;
+    string database_;
+    string settings_;                   // the other startup parameters, part of the cache keys
+    bool session_changed_ = false;      // SET, RESET, DISCARD or a named statement, no caching since
+    bool extended_ = false;             // extended query messages sent since the last Sync
+    bool holding_ = false;
+    string held_;
+    string body_;
+    bool keep_body_ = false;
+    string out_;
+    string rest_;                       // client data following a hit
+
+    // server side
+    message_framer_t server_;
+    unique_ptr<request_t> recording_;
+    shared_ptr<result_cache_t::entry_t> entry_;
+    bool record_failed_ = false;
+    int8_t last_byte_ = 0;
+
+    bool idle() const;
+
+    void on_client_message();
+
+    void on_write(const vector<string> &tables);
+
+    void record(const int8_t *data, unsigned size);
+
+    void on_server_header();
+
+    void on_server_message();
+
+    unsigned client_data(const int8_t *data, unsigned size, const int8_t **out);
+
+public:
+
+    explicit query_tracker_t(result_cache_t *cache) : cache_(cache) {}
+
+    bool disabled() const { return disabled_.load(std::memory_order_relaxed); }
+
+    // client data to be forwarded is returned in *out, it stops at a cache hit
+    unsigned from_client(const int8_t *data, unsigned size, const int8_t **out) {
+        return client_data(data, size, out);
+    }
+
+    bool has_rest() const { return !rest_.empty(); }
+
+    // carries on with the client data left after a hit
+    unsigned from_rest(const int8_t **out);
+
+    bool hit_pending() const { return hit_pending_.load(std::memory_order_acquire); }
+
+    // the response to be sent to the client in place of the server's,
+    // null if another receiver has taken it
+    shared_ptr<const result_cache_t::entry_t> take_hit() {
+        lock_guard<mutex> lg(mx_);
+        return std::move(hit_);
+    }
+
+    // the response couldn't be sent yet
+    void put_back(shared_ptr<const result_cache_t::entry_t> &&hit) {
+        lock_guard<mutex> lg(mx_);
+        hit_ = std::move(hit);
+    }
+
+    void hit_sent() { hit_pending_.store(0, std::memory_order_release); }
+
+    // to be asked by the writer of the server line only, a cached response
+    // mustn't be put in the middle of a message
+    bool server_between() const {
+        return server_between_.load(std::memory_order_acquire) || disabled();
+    }
+
+    void from_server(const int8_t *data, unsigned size);
+};
+
+// table names a statement reads or writes, lower case and without the schema;
+// returns false for a statement that can't be served from the cache
+bool cacheable_select(const string &query, vector<string> *tables);
+
+// true if a statement of the query may change what the later ones return, e.g. SET
+bool changes_session(const string &query);
+
+// returns false for statements that write nothing, e.g. BEGIN or SET;
+// no tables with true means that anything may have been written
+bool written_tables(const string &query, vector<string> *tables);
+
+}
+
+using query_tracker_nms::query_tracker_t;
+using query_tracker_nms::message_framer_t;
@@ -0,0 +1,374 @@
+// replays the client side of a traffic capture against the proxy or a server and reports
+// the throughput and the latencies, a request being a client chunk the server answers
+// with ReadyForQuery; the captured password messages are sent as they are,
+// so the target has to trust the replaying host
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+
+#include "capture.h"
+#include "system/endpoint.h"
+
+namespace replay_nms {
+
+using std::string;
+using std::vector;
+using std::map;
+using std::mutex;
+using std::lock_guard;
+using std::atomic;
+using steady_clock_t = std::chrono::steady_clock;
+using std::chrono::nanoseconds;
+
+const uint32_t startup_code = 196608;
+const uint32_t ssl_code = 80877103;
+const uint32_t gss_code = 80877104;
+const unsigned receive_timeout = 10;    // seconds
+
+inline uint32_t int4(const void *data) {
+    auto p = static_cast<const uint8_t *>(data);
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+}
+
+// counts the ReadyForQuery messages of a server stream
+class ready_counter_t {
+    uint8_t header_[5];
+    unsigned header_len_ = 0;
+    uint32_t remaining_ = 0;
+
+public:
+
+    // returns false if the stream can't be framed
+    bool feed(const char *data, size_t size, unsigned *ready) {
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(data);
+        const uint8_t *end = p + size;
+        while(p < end){
+            if(header_len_ < sizeof(header_)){
+                header_[header_len_++] = *p++;
+                if(header_len_ < sizeof(header_)){
+                    continue;
+                }
+                uint32_t len = int4(header_ + 1);
+                if(len < 4){
+                    return false;
+                }
+                remaining_ = len - 4;
+            } else{
+                size_t n = std::min<size_t>(remaining_, end - p);
+                p += n;
+                remaining_ -= n;
+            }
+            if(remaining_ == 0){
+                *ready += header_[0] == 'Z';
+                header_len_ = 0;
+            }
+        }
+        return true;
+    }
+};
+
+// counts the messages of a client stream the server answers with ReadyForQuery: simple
+// queries, Syncs and function calls; the startup packet and the password messages
+// are answered with one once the authentication is over
+class request_counter_t {
+    uint8_t header_[5];
+    unsigned header_len_ = 0;
+    uint32_t remaining_ = 0;
+    bool typeless_ = true;
+    uint8_t code_[4];
+    unsigned code_len_ = 0;
+
+    unsigned header_size() const { return typeless_ ? 4 : 5; }
+
+public:
+
+    // returns false if the stream can't be framed
+    bool feed(const char *data, size_t size, unsigned *requests, bool *auth) {
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(data);
+        const uint8_t *end = p + size;
+        while(p < end){
+            if(header_len_ < header_size()){
+                header_[header_len_++] = *p++;
+                if(header_len_ < header_size()){
+                    continue;
+                }
+                uint32_t len = int4(header_ + (typeless_ ? 0 : 1));
+                if(len < 4){
+                    return false;
+                }
+                remaining_ = len - 4;
+                code_len_ = 0;
+            } else{
+                size_t n = std::min<size_t>(remaining_, end - p);
+                for(size_t i = 0; typeless_ && i < n && code_len_ < sizeof(code_); ++i){
+                    code_[code_len_++] = p[i];
+                }
+                p += n;
+                remaining_ -= n;
+            }
+            if(remaining_ == 0){
+                if(typeless_){
+                    // the startup packet ends the typeless ones
+                    typeless_ = !(code_len_ == sizeof(code_) && int4(code_) == startup_code);
+                    *auth = *auth || !typeless_;
+                } else{
+                    const char type = header_[0];
+                    *requests += type == 'Q' || type == 'S' || type == 'F';
+                    *auth = *auth || type == 'p';
+                }
+                header_len_ = 0;
+            }
+        }
+        return true;
+    }
+};
+
+struct step_t {
+    uint64_t ns;            // since the capture started
+    string data;
+    unsigned responses;     // ReadyForQuery messages the server answers the step with
+    bool auth;              // holds the startup packet or a password message
+};
+
+// the responses are told by the client chunks, as the loggers of the two directions
+// are not in step and a server chunk may be captured after later client ones;
+// the server side only tells whether the authentication was over
+struct connection_t {
+    vector<step_t> steps;
+    request_counter_t requests;
+    ready_counter_t counter;
+    unsigned ready = 0;     // ReadyForQuery messages of the captured server
+    bool skipped = false;   // encrypted or not framed
+};
+
+struct results_t {
+    mutex mx;
+    vector<uint64_t> latencies;     // ns
+    atomic<uint64_t> sent = { 0 };
+    atomic<uint64_t> received = { 0 };
+    atomic<unsigned> failed = { 0 };
+};
+
+bool load(const char *path, map<uint32_t, connection_t> *connections) {
+    FILE *file = std::fopen(path, "rb");
+    if(!file){
+        return false;
+    }
+    char magic[sizeof(capture_nms::file_magic)];
+    bool ok = std::fread(magic, sizeof(magic), 1, file) == 1
+            && std::memcmp(magic, capture_nms::file_magic, sizeof(magic)) == 0;
+    capture_nms::chunk_header_t header;
+    string data;
+    while(ok && capture_nms::read_chunk(file, &header, &data)){
+        auto &conn = (*connections)[header.connection];
+        if(conn.skipped){
+            continue;
+        }
+        if(header.direction == capture_nms::from_client){
+            if(conn.steps.empty() && 8 <= data.size()
+                    && (int4(data.data() + 4) == ssl_code || int4(data.data() + 4) == gss_code)){
+                conn.skipped = true;
+                continue;
+            }
+            conn.steps.push_back({ header.ns, data, 0, false });
+            auto &step = conn.steps.back();
+            conn.skipped = !conn.requests.feed(data.data(), data.size(), &step.responses, &step.auth);
+        } else if(header.direction == capture_nms::from_server){
+            conn.skipped = !conn.counter.feed(data.data(), data.size(), &conn.ready);
+        }
+    }
+    std::fclose(file);
+    for(auto &c : *connections){
+        auto &steps = c.second.steps;
+        auto last_auth = std::find_if(steps.rbegin(), steps.rend(), [](const step_t &s){ return s.auth; });
+        if(c.second.ready && last_auth != steps.rend()){
+            ++last_auth->responses;
+        }
+    }
+    return ok;
+}
+
+bool receive_responses(int sock, unsigned responses, ready_counter_t *counter, results_t *results) {
+    char buf[65536];
+    unsigned ready = 0;
+    while(ready < responses){
+        ssize_t res = ::recv(sock, buf, sizeof(buf), 0);
+        if(res <= 0){
+            return false;
+        }
+        results->received += res;
+        if(!counter->feed(buf, res, &ready)){
+            return false;
+        }
+    }
+    return true;
+}
+
+// replays one connection, the steps are sent at their captured times scaled by the speed
+// but never before the responses to the previous one have arrived
+void replay(const endpoint_t &target, const connection_t &conn, steady_clock_t::time_point start
+            , uint64_t capture_start, double speed, results_t *results) {
+    int sock = ::socket(target.family(), SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock == -1 || ::connect(sock, target.addr(), target.size()) == -1){
+        ++results->failed;
+        if(sock != -1){
+            ::close(sock);
+        }
+        return;
+    }
+    if(!target.is_local()){
+        int opt = 1;
+        ::setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    }
+    timeval tv = { receive_timeout, 0 };
+    ::setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ready_counter_t counter;
+    vector<uint64_t> latencies;
+    bool ok = true;
+    for(const auto &step : conn.steps){
+        if(speed){
+            std::this_thread::sleep_until(start + nanoseconds(static_cast<uint64_t>((step.ns - capture_start) / speed)));
+        }
+        auto sent_at = steady_clock_t::now();
+        if(::send(sock, step.data.data(), step.data.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(step.data.size())){
+            ok = false;
+            break;
+        }
+        results->sent += step.data.size();
+        if(step.responses){
+            if(!(ok = receive_responses(sock, step.responses, &counter, results))){
+                break;
+            }
+            latencies.push_back(std::chrono::duration_cast<nanoseconds>(steady_clock_t::now() - sent_at).count());
+        }
+    }
+    ::close(sock);
+    if(!ok){
+        ++results->failed;
+    }
+    lock_guard<mutex> lg(results->mx);
+    results->latencies.insert(results->latencies.end(), latencies.begin(), latencies.end());
+}
+
+string percentile(const vector<uint64_t> &sorted, double p) {
+    if(sorted.empty()){
+        return "-";
+    }
+    size_t idx = std::min(sorted.size() - 1, static_cast<size_t>(p / 100 * sorted.size()));
+    return std::to_string(sorted[idx] / 1000) + " us";
+}
+
+int run(int argc, char *argv[]) {
+    const char *path = nullptr;
+    string host = "127.0.0.1";
+    string port = "54321";
+    double speed = 1;
+    unsigned copies = 1;
+    bool args_ok = argc % 2 == 1;
+    for(int i = 1; i + 1 < argc && args_ok; i += 2){
+        if(std::strcmp(argv[i], "-f") == 0){
+            path = argv[i + 1];
+        } else if(std::strcmp(argv[i], "-h") == 0){
+            host = argv[i + 1];
+        } else if(std::strcmp(argv[i], "-p") == 0){
+            port = argv[i + 1];
+        } else if(std::strcmp(argv[i], "-x") == 0){
+            char *end;
+            speed = std::strtod(argv[i + 1], &end);
+            args_ok = !*end && 0 <= speed;
+        } else if(std::strcmp(argv[i], "-c") == 0){
+            char *end;
+            auto val = std::strtoul(argv[i + 1], &end, 10);
+            args_ok = !*end && 0 < val && val <= UINT_MAX;
+            copies = val;
+        } else{
+            args_ok = false;
+        }
+    }
+    endpoint_t target;
+    if(args_ok && port.find('/') != string::npos){
+        args_ok = endpoint_t::local(port, &target);
+    } else if(args_ok){
+        auto h = gethostbyname(host.c_str());
+        int p = std::atoi(port.c_str());
+        args_ok = h && 0 < p && p < 65536;
+        if(args_ok){
+            target = endpoint_t::inet(*reinterpret_cast<uint32_t *>(h->h_addr), htons(p));
+        }
+    }
+    if(!args_ok || !path){
+        std::cout << "usage: proxy-replay -f <capture_file> [-h <host>] [-p <port | unix_socket_path>] "
+                     "[-x <speed_factor, 0 - no delays>] [-c <copies_of_each_connection>]\n";
+        return 1;
+    }
+    map<uint32_t, connection_t> connections;
+    if(!load(path, &connections)){
+        std::cout << "can't read the capture file " << path << std::endl;
+        return 1;
+    }
+    uint64_t capture_start = UINT64_MAX;
+    unsigned skipped = 0;
+    for(const auto &c : connections){
+        if(c.second.skipped || c.second.steps.empty()){
+            ++skipped;
+        } else{
+            capture_start = std::min(capture_start, c.second.steps.front().ns);
+        }
+    }
+    std::cout << "replaying " << connections.size() - skipped << " connections x " << copies
+              << " to " << target.to_string() << ", " << skipped << " skipped" << std::endl;
+    results_t results;
+    vector<std::thread> threads;
+    auto start = steady_clock_t::now();
+    for(unsigned copy = 0; copy < copies; ++copy){
+        for(const auto &c : connections){
+            if(!c.second.skipped && !c.second.steps.empty()){
+                threads.emplace_back(replay, std::cref(target), std::cref(c.second), start, capture_start
+                                     , speed, &results);
+            }
+        }
+    }
+    for(auto &t : threads){
+        t.join();
+    }
+    double secs = std::chrono::duration<double>(steady_clock_t::now() - start).count();
+    auto &lat = results.latencies;
+    std::sort(lat.begin(), lat.end());
+    std::cout << "time: " << secs << " s, failed connections: " << results.failed.load()
+              << "\nrequests: " << lat.size() << ", " << static_cast<uint64_t>(lat.size() / secs) << " per s"
+              << "\nsent: " << results.sent.load() << " bytes, received: " << results.received.load()
+              << " bytes, " << (results.sent.load() + results.received.load()) / secs / 1e6 << " MB/s"
+              << "\nlatency p50: " << percentile(lat, 50) << ", p90: " << percentile(lat, 90)
+              << ", p99: " << percentile(lat, 99) << ", p99.9: " << percentile(lat, 99.9)
+              << ", max: " << (lat.empty() ? string("-") : std::to_string(lat.back() / 1000) + " us")
+              << std::endl;
+    return results.failed ? 2 : 0;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    try{
+        return replay_nms::run(argc, argv);
+    } catch(const std::exception &e){
+        std::cout << "fatal error: " << e.what() << std::endl;
+    }
+    return 2;
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+#include "memory/memory_pager.h"
+
+namespace result_cache_nms {
+
+using std::string;
+using std::vector;
+using std::list;
+using std::unordered_map;
+using std::shared_ptr;
+using std::mutex;
+using std::lock_guard;
+using std::atomic;
+using std::chrono::steady_clock;
+using std::chrono::milliseconds;
+
+// server responses to simple read-only queries, keyed by database, user and query text;
+// an entry lives for ttl unless a statement writing to one of the tables it reads is seen
+class result_cache_t {
+public:
+
+    struct entry_t {
+        string key;
+        vector<string> tables;          // empty if none could be told from the query
+        vector<shared_ptr<page_t>> pages;
+        unsigned size = 0;
+        steady_clock::time_point expires;
+    };
+
+private:
+
+    typedef list<shared_ptr<entry_t>> lru_t;
+
+    memory_pager_t *pager_;
+    const milliseconds ttl_;
+    const unsigned max_pages_;
+    const unsigned max_entry_pages_;
+    mutex mx_;
+    lru_t lru_;                         // the most recently used first
+    unordered_map<string, lru_t::iterator> index_;
+    unsigned pages_ = 0;
+    atomic<uint64_t> generation_ = { 0 };   // bumped by every invalidation
+    atomic<uint64_t> hits_ = { 0 };
+    atomic<uint64_t> misses_ = { 0 };
+    atomic<uint64_t> stored_ = { 0 };
+    atomic<uint64_t> invalidated_ = { 0 };
+
+    void erase(lru_t::iterator it) {
+        pages_ -= (*it)->pages.size();
+        index_.erase((*it)->key);
+        lru_.erase(it);
+    }
+
+public:
+
+    result_cache_t(memory_pager_t *pager, unsigned ttl_ms, unsigned max_pages)
+        : pager_(pager), ttl_(ttl_ms), max_pages_(max_pages)
+        , max_entry_pages_(std::max(1u, max_pages / 8)) {}
+
+    bool enabled() const { return ttl_.count() && max_pages_; }
+
+    memory_pager_t *pager() const { return pager_; }
+
+    unsigned ttl_ms() const { return ttl_.count(); }
+
+    unsigned max_pages() const { return max_pages_; }
+
+    unsigned max_entry_size() const { return max_entry_pages_ * pager_->page_size(); }
+
+    uint64_t generation() const { return generation_.load(std::memory_order_acquire); }
+
+    shared_ptr<const entry_t> find(const string &key) {
+        lock_guard<mutex> lg(mx_);
+        auto it = index_.find(key);
+        if(it == index_.end()){
+            misses_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        if((*it->second)->expires < steady_clock::now()){
+            erase(it->second);
+            misses_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        lru_.splice(lru_.begin(), lru_, it->second);
+        hits_.fetch_add(1, std::memory_order_relaxed);
+        return lru_.front();
+    }
+
+    // the entry is dropped if anything has been invalidated since the query was sent
+    void store(shared_ptr<entry_t> &&entry, uint64_t generation) {
+        lock_guard<mutex> lg(mx_);
+        if(generation != generation_.load(std::memory_order_acquire)){
+            return;
+        }
+        auto it = index_.find(entry->key);
+        if(it != index_.end()){
+            erase(it->second);
+        }
+        entry->expires = steady_clock::now() + ttl_;
+        pages_ += entry->pages.size();
+        lru_.push_front(std::move(entry));
+        index_[lru_.front()->key] = lru_.begin();
+        while(max_pages_ < pages_ && !lru_.empty()){
+            erase(std::prev(lru_.end()));
+        }
+        stored_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // drops the entries reading any of the tables, all of them if no table is given
+    void invalidate(const vector<string> &tables) {
+        lock_guard<mutex> lg(mx_);
+        generation_.fetch_add(1, std::memory_order_acq_rel);
+        for(auto it = lru_.begin(); it != lru_.end();){
+            auto cur = it++;
+            const auto &read = (*cur)->tables;
+            bool hit = tables.empty() || read.empty();
+            for(unsigned i = 0; !hit && i < tables.size(); ++i){
+                hit = std::find(read.begin(), read.end(), tables[i]) != read.end();
+            }
+            if(hit){
+                erase(cur);
+                invalidated_.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void clear() {
+        lock_guard<mutex> lg(mx_);
+        lru_.clear();
+        index_.clear();
+        pages_ = 0;
+    }
+
+    string stats() const {
+        return "result cache hits: " + std::to_string(hits_.load()) + ", misses: "
+                + std::to_string(misses_.load()) + ", stored: " + std::to_string(stored_.load())
+                + ", invalidated: " + std::to_string(invalidated_.load());
+    }
+
+    void reset_stats() {
+        for(auto counter : { &hits_, &misses_, &stored_, &invalidated_ }){
+            counter->store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+}
+
+using result_cache_nms::result_cache_t;
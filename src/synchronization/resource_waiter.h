@@ -29,6 +29,8 @@ public:
 
     bool wait(task_t *current_task) {
         utility_flag_helper<task_blocked, no_utility_flag> ufh(current_task);
+        trace_scope_t ts("memory wait");
+        wait_scope_t ws(true);
         on_block_(current_task);
         return signal_.wait(max_response, [current_task](){
             return current_task->stop_flag() || current_task->is_yielding();
@@ -4,6 +4,8 @@
 #include <condition_variable>
 #include <atomic>
 
+#include "../trace.h"
+
 namespace signal_nms {
 
 using std::mutex;
@@ -46,6 +48,7 @@ class signal_t {
         if(!condition()){
             return true;
         }
+        trace_scope_t ts("wait");
         blocked_cnt_.fetch_add(1, std::memory_order_relaxed);
         notify_cnt_ = blocked_cnt_.load(std::memory_order_relaxed);
         bool ok = true;
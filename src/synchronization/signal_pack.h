@@ -1,73 +1,51 @@
 #pragma once
 
 #include <vector>
+#include <memory>
 #include <cassert>
 
-#include "signal.h"
+#include "work_queue.h"
 
 namespace signal_pack_nms {
 
 using std::vector;
+using std::unique_ptr;
 
 class signal_pack_t {
-    vector<signal_t> signals_;
+    vector<unique_ptr<work_queue_t>> queues_;
 
-public:
-
-    signal_pack_t(unsigned waiters_cnt) : signals_(waiters_cnt) {}
-
-    template <class... T> bool wait(unsigned waiter_idx, T... a) {
-        assert(waiter_idx < signals_.size());
-        return signals_[waiter_idx].wait(a...);
+    work_queue_t &queue(unsigned waiter_idx) const {
+        assert(waiter_idx < queues_.size());
+        return *queues_[waiter_idx];
     }
 
-    template <class... T> void notify_one(T... a) {
-        for(auto &signal : signals_){
-            signal.notify_one(a...);
-        }
-    }
-
-    template <class... T> void notify_all(T... a) {
-        for(auto &signal : signals_){
-            signal.notify_all(a...);
-        }
-    }
+public:
 
-    template <class... T> void notify_n(T... a) {
-        for(auto &signal : signals_){
-            signal.notify_n(a...);
+    signal_pack_t(unsigned waiters_cnt, unsigned workers_cnt, int fd_waiter_idx = -1)
+        : queues_(waiters_cnt) {
+        for(unsigned idx = 0; idx < queues_.size(); ++idx){
+            queues_[idx] = std::make_unique<work_queue_t>(workers_cnt
+                                                          , static_cast<int>(idx) == fd_waiter_idx);
         }
     }
 
-    template <class... T> void notify_one_waiter(unsigned waiter_idx, T... a) {
-        assert(waiter_idx < signals_.size());
-        signals_[waiter_idx].notify_one(a...);
+    void push(unsigned waiter_idx, int item, unsigned worker_hint) {
+        queue(waiter_idx).push(item, worker_hint);
     }
 
-    template <class... T> void notify_all_waiters(unsigned waiter_idx, T... a) {
-        assert(waiter_idx < signals_.size());
-        signals_[waiter_idx].notify_all(a...);
+    bool pop(unsigned waiter_idx, unsigned worker, int *item) {
+        return queue(waiter_idx).pop(worker, item);
     }
 
-    template <class... T> void notify_n_waiters(unsigned waiter_idx, T... a) {
-        assert(waiter_idx < signals_.size());
-        signals_[waiter_idx].notify_n(a...);
-    }
+    work_signal_t *signal(unsigned waiter_idx) const { return queue(waiter_idx).signal(); }
 
-    void set_threading_level(unsigned cnt) {
-        for(auto &signal : signals_){
-            signal.set_threading_level(cnt);
-        }
-    }
-
-    void set_waiters_threading_level(unsigned waiter_idx, unsigned cnt) {
-        assert(waiter_idx < signals_.size());
-        signals_[waiter_idx].set_threading_level(cnt);
+    template <class... T> bool wait(unsigned waiter_idx, T... a) {
+        return queue(waiter_idx).wait(a...);
     }
 
     void reset() {
-        for(auto &signal : signals_){
-            signal.reset();
+        for(auto &uptr : queues_){
+            uptr->reset();
         }
     }
 };
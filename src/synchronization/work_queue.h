@@ -0,0 +1,97 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <cassert>
+
+#include "work_signal.h"
+
+namespace work_queue_nms {
+
+using std::deque;
+using std::vector;
+using std::mutex;
+using std::lock_guard;
+using std::atomic_uint;
+using std::chrono::duration;
+
+// per-worker deques of ready items: the owner takes from the front of its own deque,
+// idle workers steal from the back of the others
+class work_queue_t {
+
+    struct worker_deque_t {
+        mutex mx;
+        deque<int> items;
+        atomic_uint size = { 0 };
+    };
+
+    vector<worker_deque_t> deques_;
+    work_signal_t signal_;
+
+    bool take(worker_deque_t &dq, bool front, int *item) {
+        if(!dq.size.load(std::memory_order_acquire)){
+            return false;
+        }
+        lock_guard<mutex> lg(dq.mx);
+        if(dq.items.empty()){
+            return false;
+        }
+        if(front){
+            *item = dq.items.front();
+            dq.items.pop_front();
+        } else{
+            *item = dq.items.back();
+            dq.items.pop_back();
+        }
+        dq.size.fetch_sub(1, std::memory_order_release);
+        return true;
+    }
+
+public:
+
+    work_queue_t(unsigned workers_cnt, bool fd_wakeups)
+        : deques_(workers_cnt), signal_(fd_wakeups) { assert(workers_cnt); }
+
+    void push(int item, unsigned worker_hint) {
+        auto &dq = deques_[worker_hint % deques_.size()];
+        {
+            lock_guard<mutex> lg(dq.mx);
+            dq.items.push_back(item);
+            dq.size.fetch_add(1, std::memory_order_release);
+        }
+        signal_.post();
+    }
+
+    bool pop(unsigned worker, int *item) {
+        const unsigned cnt = deques_.size();
+        for(unsigned i = 0; i < cnt; ++i){
+            if(take(deques_[(worker + i) % cnt], i == 0, item)){
+                signal_.consume();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    work_signal_t *signal() { return &signal_; }
+
+    template <class R, class P, class StopCondition>
+    bool wait(const duration<R, P> &period, StopCondition stop) {
+        return signal_.wait(period, stop);
+    }
+
+    void reset() {
+        for(auto &dq : deques_){
+            lock_guard<mutex> lg(dq.mx);
+            dq.items.clear();
+            dq.size.store(0, std::memory_order_release);
+        }
+        signal_.reset();
+    }
+};
+
+}
+
+using work_queue_nms::work_queue_t;
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <ctime>
+#include <cerrno>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <climits>
+
+#include "../trace.h"
+#include "../task_stats.h"
+
+namespace work_signal_nms {
+
+using std::atomic_int;
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::seconds;
+using std::chrono::nanoseconds;
+
+// pending-work counter doubling as a futex word: waiters sleep only while
+// the counter is zero and every post wakes no more waiters than work items posted;
+// an item taken before its post is counted takes the counter below zero for a while;
+// waiters that also have sockets to watch may sleep in their own epoll instead,
+// on a shared semaphore eventfd registered there with EPOLLEXCLUSIVE
+class work_signal_t {
+    atomic_int pending_ = { 0 };
+    atomic_int waiters_ = { 0 };
+    const int wakeup_fd_;
+
+    static_assert(sizeof(atomic_int) == sizeof(int), "atomic_int can't be used as a futex word");
+
+    int *word() { return reinterpret_cast<int *>(&pending_); }
+
+    void futex_wait(int val, const timespec *timeout) {
+        syscall(SYS_futex, word(), FUTEX_WAIT_PRIVATE, val, timeout, nullptr, 0);
+    }
+
+    void wake(int cnt) {
+        if(wakeup_fd_ == -1){
+            syscall(SYS_futex, word(), FUTEX_WAKE_PRIVATE, cnt, nullptr, nullptr, 0);
+            return;
+        }
+        const uint64_t one = 1;
+        for(int i = 0; i < cnt; ++i){
+            if(::write(wakeup_fd_, &one, sizeof(one)) == -1){
+                break;
+            }
+        }
+    }
+
+public:
+
+    work_signal_t(bool fd_wakeups = false)
+        : wakeup_fd_(fd_wakeups ? ::eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE | EFD_CLOEXEC) : -1) {}
+
+    ~work_signal_t() {
+        if(wakeup_fd_ == -1){
+            wake(INT_MAX);
+        } else{
+            ::close(wakeup_fd_);
+        }
+    }
+
+    int wakeup_fd() const { return wakeup_fd_; }
+
+    void post(unsigned n = 1) {
+        if(n == 0){
+            return;
+        }
+        pending_.fetch_add(n);
+        int waiters = waiters_.load();
+        if(0 < waiters){
+            wake(n < static_cast<unsigned>(waiters) ? n : waiters);
+        }
+    }
+
+    void consume(unsigned n = 1) { pending_.fetch_sub(n, std::memory_order_acq_rel); }
+
+    // returns false if there is work to do and the caller must not sleep
+    bool enter_wait() {
+        waiters_.fetch_add(1);
+        if(pending_.load() != 0){
+            waiters_.fetch_sub(1);
+            return false;
+        }
+        return true;
+    }
+
+    void leave_wait() { waiters_.fetch_sub(1); }
+
+    void take_wakeup() {
+        uint64_t val;
+        while(::read(wakeup_fd_, &val, sizeof(val)) == -1 && errno == EINTR){}
+    }
+
+    template <class R, class P, class StopCondition>
+    bool wait(const duration<R, P> &period, StopCondition stop) {
+        if(enter_wait()){
+            auto ns = duration_cast<nanoseconds>(period);
+            auto secs = duration_cast<seconds>(ns);
+            timespec timeout;
+            timeout.tv_sec = secs.count();
+            timeout.tv_nsec = (ns - secs).count();
+            trace_scope_t ts("wait");
+            wait_scope_t ws;
+            futex_wait(0, &timeout);
+            ws.woken(0 < pending_.load(std::memory_order_relaxed));
+            leave_wait();
+        }
+        return !stop();
+    }
+
+    void reset() { pending_.store(0, std::memory_order_release); }
+};
+
+}
+
+using work_signal_nms::work_signal_t;
@@ -0,0 +1,77 @@
+// measures what sys_caller_t adds to a system call: a no-op in place of the call,
+// a write to /dev/null and a read ending in EAGAIN, all with message_on_error;
+// the optional argument is the number of rounds
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+
+#include "system/sys_caller.h"
+
+namespace bench_nms {
+
+using steady_clock_t = std::chrono::steady_clock;
+
+const long noop_calls = 100000000;
+const long io_calls = 2000000;
+
+class bench_caller_t : protected sys_caller_t {
+public:
+
+    bench_caller_t() : sys_caller_t([](const char *message){ std::printf("%s\n", message); }) {}
+
+    // the no-op goes through the same path as the wrappers
+    int noop() { return call(message_on_error, "no-op", [](){ return 0; }); }
+
+    int write_byte(int fd, char *byte) { return write(message_on_error, fd, byte, 1); }
+
+    int read_byte(int fd, char *byte) { return read(message_on_error, fd, byte, 1); }
+
+    int open_null() { return open(message_on_error, "/dev/null", O_WRONLY | O_CLOEXEC); }
+
+    void close_fd(int fd) { close(message_on_error, fd); }
+};
+
+template <class F> double ns_per_call(long n, const F &f) {
+    auto start = steady_clock_t::now();
+    for(long i = 0; i < n; ++i){
+        f();
+    }
+    return std::chrono::duration<double, std::nano>(steady_clock_t::now() - start).count() / n;
+}
+
+int run(int argc, char *argv[]) {
+    const int rounds = 1 < argc ? std::atoi(argv[1]) : 3;
+    bench_caller_t caller;
+    int pipe_fds[2];
+    if(::pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1){
+        std::printf("can't create a pipe\n");
+        return 1;
+    }
+    int null_fd = caller.open_null();
+    if(null_fd == -1){
+        return 1;
+    }
+    volatile int sink = 0;
+    char byte = 0;
+    for(int r = 0; r < rounds; ++r){
+        double noop = ns_per_call(noop_calls, [&](){ sink = sink + caller.noop(); });
+        double written = ns_per_call(io_calls, [&](){ sink = sink + caller.write_byte(null_fd, &byte); });
+        double would_block = ns_per_call(io_calls, [&](){
+            sink = sink + caller.read_byte(pipe_fds[0], &byte); });
+        std::printf("no-op %.2f ns, write to /dev/null %.0f ns, read ending in EAGAIN %.0f ns\n"
+                    , noop, written, would_block);
+    }
+    for(int fd : { null_fd, pipe_fds[0], pipe_fds[1] }){
+        caller.close_fd(fd);
+    }
+    return 0;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    return bench_nms::run(argc, argv);
+}
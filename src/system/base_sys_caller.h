@@ -4,38 +4,41 @@
 #include <functional>
 #include <string>
 #include <utility>
-#include <vector>
 
 namespace base_sys_caller_nms {
 
 using std::function;
 using std::string;
 using std::system_error;
-using std::vector;
 
 typedef const function<void ()> &operation_t;
 
 constexpr auto no_catch_f = [](operation_t op){ op(); return true; };
 
-class base_sys_caller_t {
+// compile-time set of error codes
+template <int... Errors> struct errors_t {
+    static constexpr bool contains(int error) { return ((error == Errors) || ...); }
+};
+
+// Policy provides: static int error() - the error of the last failed call,
+// typedefs ignore and retry_on - errors_t of errors to ignore and to retry the call on;
+// only the error path goes through std::function
+template <class Policy> class base_sys_caller_t {
     function<void (const char *)> message_;
-    function<int ()> get_error_;
     function<bool (operation_t)> except_f_;
-    function<bool (int)> ignore_;
-    function<bool (int)> retry_on_;
 
-    template <class A> void act_or_ignore(int error, A action) {
-        if(!ignore_(error)){
+    template <class A> static void act_or_ignore(int error, A action) {
+        if(!Policy::ignore::contains(error)){
             action();
         }
     }
 
-    template <class A, class F> int call_and_act(A action, const F &bound_f) {
+    template <class A, class F> static int call_and_act(A action, const F &bound_f) {
         for(;;){
             int res = bound_f();
-            if(res == -1){
-                auto error = get_error_();
-                if(retry_on_(error)){
+            if(__builtin_expect(res == -1, 0)){
+                auto error = Policy::error();
+                if(Policy::retry_on::contains(error)){
                     continue;
                 }
                 act_or_ignore(error, action);
@@ -44,20 +47,20 @@ class base_sys_caller_t {
         }
     }
 
-    template <class A, class F> int call_and_act_once(A action, const F &bound_f) {
+    template <class A, class F> static int call_and_act_once(A action, const F &bound_f) {
         int res = bound_f();
-        if(res == -1){
-            auto error = get_error_();
-            if(!retry_on_(error)){
+        if(__builtin_expect(res == -1, 0)){
+            auto error = Policy::error();
+            if(!Policy::retry_on::contains(error)){
                 act_or_ignore(error, action);
             }
         }
         return res;
     }
 
-    void message_action(const char *preamble) { message_error(preamble, get_error_()); }
+    void message_action(const char *preamble) { message_error(preamble, Policy::error()); }
 
-    void throw_action(const char *preamble) { throw_error(preamble, get_error_()); }
+    void throw_action(const char *preamble) { throw_error(preamble, Policy::error()); }
 
 public:
 
@@ -67,25 +70,8 @@ public:
     static constexpr struct message_on_error_t {} message_on_error = {};
 
     base_sys_caller_t(const function<void (const char *)> &message_f
-                      , const function<int ()> &get_error_f
-                      , vector<int> errors_to_ignore, vector<int> errors_to_retry_on
                       , const function<bool (operation_t)> &except_f = no_catch_f)
-        : message_(message_f), get_error_(get_error_f), except_f_(except_f) {
-        const auto check_list = [](const vector<int> &errors, int error){
-            for(const auto &e : errors){
-                if(e == error){
-                    return true;
-                }
-            }
-            return false;
-        };
-        ignore_ = [ignore_list = std::move(errors_to_ignore), check_list](int error){
-            return check_list(ignore_list, error);
-        };
-        retry_on_ = [retry_list = std::move(errors_to_retry_on), check_list](int error){
-            return check_list(retry_list, error);
-        };
-    }
+        : message_(message_f), except_f_(except_f) {}
 
     void show_message(const char *message) { message_(message); }
 
@@ -134,3 +120,4 @@ public:
 using base_sys_caller_nms::base_sys_caller_t;
 using base_sys_caller_nms::no_catch_f;
 using base_sys_caller_nms::operation_t;
+using base_sys_caller_nms::errors_t;
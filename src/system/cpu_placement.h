@@ -0,0 +1,267 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "sys_caller.h"
+
+namespace cpu_placement_nms {
+
+using std::string;
+using std::vector;
+
+typedef vector<unsigned> cpu_list_t;
+
+// in the order the proxy starts the threads of the roles
+enum role_t { connectors, client_receivers, server_receivers, client_senders, server_senders
+              , client_loggers, server_loggers, mirrors, superviser, role_cnt };
+
+inline const char *role_names[role_cnt] = { "connectors", "client-receivers", "server-receivers"
+        , "client-senders", "server-senders", "client-loggers", "server-loggers", "mirrors", "superviser" };
+
+// a group is a pair of sided roles: "receivers", "senders" or "loggers"
+inline const char *role_help = "connectors, receivers, senders, loggers, mirrors, superviser"
+                               " or one side of a group: client-senders, server-loggers...";
+
+// none - the threads float; isolated - the receivers and senders go to the isolated cores,
+// the rest to the housekeeping ones; numa - the receivers, senders and loggers of a side
+// share a node, the client side takes the first one
+inline const char *policy_names = "none, isolated, numa";
+
+inline bool known_policy(const char *name) {
+    return !std::strcmp(name, "none") || !std::strcmp(name, "isolated") || !std::strcmp(name, "numa");
+}
+
+// "0-3,8,10-11", false if the list is empty or malformed
+inline bool parse_cpu_list(const char *text, cpu_list_t *cpus) {
+    cpu_list_t res;
+    const char *p = text;
+    while(*p && *p != '\n'){
+        char *end;
+        unsigned long first = std::strtoul(p, &end, 10);
+        unsigned long last = first;
+        if(end == p){
+            return false;
+        }
+        if(*end == '-'){
+            p = end + 1;
+            last = std::strtoul(p, &end, 10);
+            if(end == p || last < first){
+                return false;
+            }
+        }
+        if(CPU_SETSIZE <= last){
+            return false;
+        }
+        for(unsigned long cpu = first; cpu <= last; ++cpu){
+            res.push_back(cpu);
+        }
+        p = end;
+        if(*p == ','){
+            ++p;
+        } else if(*p && *p != '\n'){
+            return false;
+        }
+    }
+    if(res.empty()){
+        return false;
+    }
+    std::sort(res.begin(), res.end());
+    res.erase(std::unique(res.begin(), res.end()), res.end());
+    *cpus = std::move(res);
+    return true;
+}
+
+inline string cpu_list_string(const cpu_list_t &cpus) {
+    string res;
+    for(size_t i = 0; i < cpus.size(); ){
+        size_t j = i;
+        while(j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1){
+            ++j;
+        }
+        if(!res.empty()){
+            res += ',';
+        }
+        res += std::to_string(cpus[i]);
+        if(j != i){
+            res += '-' + std::to_string(cpus[j]);
+        }
+        i = j + 1;
+    }
+    return res;
+}
+
+// the roles a name given to -ca stands for
+inline vector<role_t> roles_named(const string &name) {
+    const std::pair<const char *, vector<role_t>> groups[] = {
+        { "receivers", { client_receivers, server_receivers } }
+        , { "senders", { client_senders, server_senders } }
+        , { "loggers", { client_loggers, server_loggers } } };
+    for(const auto &g : groups){
+        if(name == g.first){
+            return g.second;
+        }
+    }
+    for(unsigned r = 0; r < role_cnt; ++r){
+        if(name == role_names[r]){
+            return { static_cast<role_t>(r) };
+        }
+    }
+    return {};
+}
+
+// "<role>=<cpu_list>"
+inline bool valid_override(const string &text) {
+    auto eq = text.find('=');
+    cpu_list_t cpus;
+    return eq != string::npos && !roles_named(text.substr(0, eq)).empty()
+            && parse_cpu_list(text.c_str() + eq + 1, &cpus);
+}
+
+// the CPUs of every role by the policy and the overrides, limited to the ones
+// the process may run on; the threads of a role on the isolated cores get a core each
+// in turn, as the scheduler doesn't balance the load there, the others share the role's cores
+class cpu_placement_t : protected sys_caller_t {
+
+    struct placement_t {
+        cpu_list_t cpus;        // empty - the threads float
+        bool spread = false;
+    };
+
+    placement_t roles_[role_cnt];
+    cpu_list_t allowed_;
+    cpu_list_t isolated_;
+
+    static bool read_cpu_list(const string &path, cpu_list_t *cpus) {
+        FILE *file = std::fopen(path.c_str(), "r");
+        if(!file){
+            return false;
+        }
+        char buf[4096];
+        bool ok = std::fgets(buf, sizeof(buf), file) && parse_cpu_list(buf, cpus);
+        std::fclose(file);
+        return ok;
+    }
+
+    cpu_list_t usable(const cpu_list_t &cpus) const {
+        cpu_list_t res;
+        std::set_intersection(cpus.begin(), cpus.end(), allowed_.begin(), allowed_.end()
+                              , std::back_inserter(res));
+        return res;
+    }
+
+    void place(role_t role, const cpu_list_t &cpus) {
+        roles_[role].cpus = usable(cpus);
+        cpu_list_t isolated;
+        std::set_intersection(roles_[role].cpus.begin(), roles_[role].cpus.end()
+                              , isolated_.begin(), isolated_.end(), std::back_inserter(isolated));
+        roles_[role].spread = !isolated.empty();
+    }
+
+public:
+
+    cpu_placement_t(const string &policy, const vector<string> &overrides
+                    , const std::function<void (const char *)> &message_f)
+        : sys_caller_t(message_f) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        sched_getaffinity(throw_on_error, 0, sizeof(set), &set);
+        for(unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu){
+            if(CPU_ISSET(cpu, &set)){
+                allowed_.push_back(cpu);
+            }
+        }
+        read_cpu_list("/sys/devices/system/cpu/isolated", &isolated_);
+        if(policy == "isolated"){
+            cpu_list_t housekeeping;
+            std::set_difference(allowed_.begin(), allowed_.end(), isolated_.begin(), isolated_.end()
+                                , std::back_inserter(housekeeping));
+            if(usable(isolated_).empty() || housekeeping.empty()){
+                show_message("no isolated cores to place the receivers and senders on");
+            } else{
+                for(unsigned r = 0; r < role_cnt; ++r){
+                    const bool critical = r == client_receivers || r == server_receivers
+                            || r == client_senders || r == server_senders;
+                    place(static_cast<role_t>(r), critical ? isolated_ : housekeeping);
+                }
+            }
+        } else if(policy == "numa"){
+            vector<cpu_list_t> nodes;
+            cpu_list_t cpus;
+            for(unsigned n = 0; read_cpu_list("/sys/devices/system/node/node" + std::to_string(n)
+                                              + "/cpulist", &cpus); ++n){
+                if(!usable(cpus).empty()){
+                    nodes.push_back(cpus);
+                }
+            }
+            if(nodes.size() < 2){
+                show_message("a single NUMA node, the threads are not placed");
+            } else{
+                for(auto r : { client_receivers, client_senders, client_loggers }){
+                    place(r, nodes[0]);
+                }
+                for(auto r : { server_receivers, server_senders, server_loggers }){
+                    place(r, nodes[1]);
+                }
+            }
+        }
+        for(const auto &o : overrides){
+            auto eq = o.find('=');
+            cpu_list_t cpus;
+            parse_cpu_list(o.c_str() + eq + 1, &cpus);
+            if(usable(cpus).empty()){
+                std::string msg = "none of the cores of " + o + " are available to the process";
+                show_message(msg.c_str());
+                continue;
+            }
+            for(auto r : roles_named(o.substr(0, eq))){
+                place(r, cpus);
+            }
+        }
+    }
+
+    bool placed() const {
+        return std::any_of(std::begin(roles_), std::end(roles_), [](const placement_t &p){
+            return !p.cpus.empty(); });
+    }
+
+    string description(role_t role) const {
+        const auto &p = roles_[role];
+        if(p.cpus.empty()){
+            return string(role_names[role]) + " float";
+        }
+        return string(role_names[role]) + (p.spread ? " spread over cores " : " on cores ")
+                + cpu_list_string(p.cpus);
+    }
+
+    // pins the thread_num-th thread of the role, the failure is only reported
+    void apply(role_t role, unsigned thread_num, pthread_t thread) {
+        const auto &p = roles_[role];
+        if(p.cpus.empty()){
+            return;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if(p.spread){
+            CPU_SET(p.cpus[thread_num % p.cpus.size()], &set);
+        } else{
+            for(unsigned cpu : p.cpus){
+                CPU_SET(cpu, &set);
+            }
+        }
+        int error = pthread_setaffinity_np(thread, sizeof(set), &set);
+        if(error){
+            message_error("pthread_setaffinity_np", error);
+        }
+    }
+};
+
+}
+
+using cpu_placement_nms::cpu_placement_t;
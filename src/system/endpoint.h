@@ -0,0 +1,73 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace endpoint_nms {
+
+using std::string;
+
+// an address to listen on or to connect to: TCP over IPv4 or a unix socket path
+class endpoint_t {
+    sockaddr_storage addr_;
+    socklen_t size_;
+
+public:
+
+    endpoint_t() : size_(0) { memset(&addr_, 0, sizeof(addr_)); }
+
+    // address and port in network byte order
+    static endpoint_t inet(uint32_t address, uint16_t port) {
+        endpoint_t res;
+        auto addr = reinterpret_cast<sockaddr_in *>(&res.addr_);
+        addr->sin_family = AF_INET;
+        addr->sin_addr.s_addr = address;
+        addr->sin_port = port;
+        res.size_ = sizeof(sockaddr_in);
+        return res;
+    }
+
+    // returns false if the path doesn't fit into sockaddr_un
+    static bool local(const string &path, endpoint_t *res) {
+        auto addr = reinterpret_cast<sockaddr_un *>(&res->addr_);
+        if(path.empty() || sizeof(addr->sun_path) <= path.size()){
+            return false;
+        }
+        memset(&res->addr_, 0, sizeof(res->addr_));
+        addr->sun_family = AF_UNIX;
+        memcpy(addr->sun_path, path.c_str(), path.size());
+        res->size_ = sizeof(sockaddr_un);
+        return true;
+    }
+
+    int family() const { return addr_.ss_family; }
+
+    bool is_local() const { return family() == AF_UNIX; }
+
+    const sockaddr *addr() const { return reinterpret_cast<const sockaddr *>(&addr_); }
+
+    socklen_t size() const { return size_; }
+
+    const char *path() const {
+        return is_local() ? reinterpret_cast<const sockaddr_un *>(&addr_)->sun_path : "";
+    }
+
+    string to_string() const {
+        if(is_local()){
+            return path();
+        }
+        auto addr = reinterpret_cast<const sockaddr_in *>(&addr_);
+        char host[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr->sin_addr, host, sizeof(host));
+        return string(host) + ":" + std::to_string(ntohs(addr->sin_port));
+    }
+};
+
+}
+
+using endpoint_nms::endpoint_t;
@@ -5,6 +5,8 @@
 #include <memory>
 
 #include "sys_caller.h"
+#include "../trace.h"
+#include "../task_stats.h"
 
 namespace epoller_nms {
 
@@ -36,7 +38,16 @@ public:
 
     template <class O1, class O2 = decltype(empty_op)>
     int epoll(const O1 &io_operation, const O2 &on_oob = empty_op, bool wait = true) {
-        int cnt = epoll_wait(message_on_error, fd_, events_, MAX_EVENTS, wait ? timeout_ : 0);
+        int cnt;
+        if(wait){
+            trace_scope_t ts("epoll wait");
+            wait_scope_t ws;
+            cnt = epoll_wait(message_on_error, fd_, events_, MAX_EVENTS, timeout_);
+            ws.woken(0 < cnt);
+        } else{
+            trace_scope_t ts("epoll");
+            cnt = epoll_wait(message_on_error, fd_, events_, MAX_EVENTS, 0);
+        }
         for(int i = 0; i < cnt; ++i){
             const unsigned events = events_[i].events;
             const int fd = events_[i].data.fd;
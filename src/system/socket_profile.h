@@ -0,0 +1,88 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <cstring>
+
+#include "sys_caller.h"
+
+namespace socket_profile_nms {
+
+// options set on the forwarded sockets; corking is done by the senders and the receivers
+// cutting through, which hold TCP_CORK while writing a batch of pages and let go of it
+// at the end of a response or once the batch has been written
+struct socket_profile_t {
+    bool nodelay = false;
+    bool quickack = false;      // re-armed after every read, the kernel drops it on its own
+    bool cork = false;
+    unsigned buffer_size = 0;   // SO_SNDBUF and SO_RCVBUF in bytes, 0 - system default
+
+    // unix sockets keep only the buffer sizes
+    socket_profile_t for_family(int family) const {
+        socket_profile_t res = *this;
+        if(family != AF_INET){
+            res.nodelay = res.quickack = res.cork = false;
+        }
+        return res;
+    }
+};
+
+inline const char *profile_names = "none, latency, bulk";
+
+// fills the profile by its name, returns false for an unknown name
+inline bool named_profile(const char *name, socket_profile_t *profile) {
+    socket_profile_t res;
+    if(std::strcmp(name, "latency") == 0){
+        res.nodelay = true;
+        res.quickack = true;
+    } else if(std::strcmp(name, "bulk") == 0){
+        res.nodelay = true;
+        res.cork = true;
+        res.buffer_size = 1 << 20;
+    } else if(std::strcmp(name, "none") != 0){
+        return false;
+    }
+    *profile = res;
+    return true;
+}
+
+class socket_options_t : protected sys_caller_t {
+    const socket_profile_t profile_;
+
+    void set(int sock, int level, int name, int val) {
+        setsockopt(message_on_error, sock, level, name, &val, sizeof(val));
+    }
+
+public:
+
+    socket_options_t(const socket_profile_t &profile
+                     , const std::function<void (const char *)> &message_f
+                     , const std::function<bool (operation_t)> &except_f = no_catch_f)
+        : sys_caller_t(message_f, except_f), profile_(profile) {}
+
+    const socket_profile_t &profile() const { return profile_; }
+
+    void apply(int sock) {
+        if(profile_.nodelay){
+            set(sock, IPPROTO_TCP, TCP_NODELAY, 1);
+        }
+        if(profile_.buffer_size){
+            set(sock, SOL_SOCKET, SO_SNDBUF, profile_.buffer_size);
+            set(sock, SOL_SOCKET, SO_RCVBUF, profile_.buffer_size);
+        }
+        rearm_quickack(sock);
+    }
+
+    void rearm_quickack(int sock) {
+        if(profile_.quickack){
+            set(sock, IPPROTO_TCP, TCP_QUICKACK, 1);
+        }
+    }
+
+    void cork(int sock, bool on) { set(sock, IPPROTO_TCP, TCP_CORK, on); }
+};
+
+}
+
+using socket_profile_nms::socket_profile_t;
+using socket_profile_nms::socket_options_t;
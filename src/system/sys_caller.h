@@ -4,19 +4,27 @@
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
 #include <cassert>
 
 #include "base_sys_caller.h"
 
 namespace sys_caller_nms {
 
-class sys_caller_t : protected base_sys_caller_t {
+struct posix_policy_t {
+    static int error() { return errno; }
+    typedef errors_t<EAGAIN, EWOULDBLOCK, EINPROGRESS> ignore;
+    typedef errors_t<EINTR> retry_on;
+};
+
+class sys_caller_t : protected base_sys_caller_t<posix_policy_t> {
 public:
 
     sys_caller_t(const std::function<void (const char *)> &message_f
                  , const std::function<bool (operation_t)> &except_f = no_catch_f)
-        : base_sys_caller_t(message_f, [](){ return errno; }
-                            , { EAGAIN, EWOULDBLOCK }, { EINTR }, except_f) {}
+        : base_sys_caller_t(message_f, except_f) {}
 
     template <class OnError> int epoll_create(OnError a) {
         return call(a, "create epoll descriptor", [](){ return ::epoll_create1(0); });
@@ -31,10 +39,26 @@ public:
         return call(a, "epoll_ctl", [=](){ return ::epoll_ctl(epfd, op, fd, event); });
     }
 
+    template <class OnError> int open(OnError a, const char *path, int flags, mode_t mode = 0) {
+        return call(a, "open file", [=](){ return ::open(path, flags, mode); });
+    }
+
+    template <class OnError> int unlink(OnError a, const char *path) {
+        return call(a, "unlink file", [=](){ return ::unlink(path); });
+    }
+
+    template <class OnError> int ftruncate(OnError a, int fd, off_t length) {
+        return call(a, "truncate file", [=](){ return ::ftruncate(fd, length); });
+    }
+
     template <class OnError> int close(OnError a, int fd) {
         return call(a, "close descriptor", [fd](){ return ::close(fd); }, call_once);
     }
 
+    template <class OnError> int sched_getaffinity(OnError a, pid_t pid, size_t size, cpu_set_t *set) {
+        return call(a, "sched_getaffinity", [=](){ return ::sched_getaffinity(pid, size, set); });
+    }
+
     template <class OnError> int socket(OnError a, int domain, int type, int protocol) {
         return call(a, "create socket descriptor", [=](){ return ::socket(domain, type, protocol); });
     }
@@ -68,6 +92,34 @@ public:
             return ::getsockopt(sockfd, level, optname, optval, optlen);
         });
     }
+
+    template <class OnError>
+    int setsockopt(OnError a, int sockfd, int level, int optname, const void *optval, socklen_t optlen) {
+        return call(a, "setsockopt", [=](){
+            return ::setsockopt(sockfd, level, optname, optval, optlen);
+        });
+    }
+
+    template <class OnError> int recv(OnError a, int sockfd, void *buf, size_t len, int flags) {
+        return call(a, "recv", [=](){ return ::recv(sockfd, buf, len, flags); });
+    }
+
+    template <class OnError> int send(OnError a, int sockfd, const void *buf, size_t len, int flags) {
+        return call(a, "send", [=](){ return ::send(sockfd, buf, len, flags); });
+    }
+
+    template <class OnError> int sendmsg(OnError a, int sockfd, const msghdr *msg, int flags) {
+        return call(a, "sendmsg", [=](){ return ::sendmsg(sockfd, msg, flags); });
+    }
+
+    template <class OnError> int recvmsg(OnError a, int sockfd, msghdr *msg, int flags) {
+        return call(a, "recvmsg", [=](){ return ::recvmsg(sockfd, msg, flags); });
+    }
+
+    template <class OnError> int poll(OnError a, pollfd *fds, nfds_t nfds, int timeout) {
+        return call(a, "poll", [=](){ return ::poll(fds, nfds, timeout); });
+    }
+
     template <class OnError>
     int write(OnError a, int fd, void *buf, size_t count) {
         return call(a, "write", [=](){ return ::write(fd, buf, count); });
@@ -77,6 +129,22 @@ public:
     int read(OnError a, int fd, void *buf, size_t count) {
         return call(a, "read", [=](){ return ::read(fd, buf, count); });
     }
+
+    // writes until everything is written or write returns -1 or 0,
+    // the result of the last write is stored in *last_res
+    template <class OnError>
+    unsigned write_all(OnError a, int fd, const int8_t *buf, unsigned count, int *last_res) {
+        unsigned bytes_written = 0;
+        *last_res = 0;
+        while(bytes_written != count){
+            *last_res = write(a, fd, (void *)(buf + bytes_written), count - bytes_written);
+            if(*last_res <= 0){
+                break;
+            }
+            bytes_written += *last_res;
+        }
+        return bytes_written;
+    }
 };
 
 }
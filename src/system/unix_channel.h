@@ -0,0 +1,160 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include "sys_caller.h"
+
+namespace unix_channel_nms {
+
+using std::string;
+using std::vector;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+
+const unsigned max_record_size = 32 * 1024;     // bytes
+const unsigned max_record_fds = 4;
+
+// SOCK_SEQPACKET unix socket carrying typed records,
+// each with up to max_record_fds descriptors attached
+class unix_channel_t : protected sys_caller_t {
+    int fd_ = -1;
+    int listening_fd_ = -1;
+    string path_;
+
+    sockaddr_un address(const string &path) {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if(sizeof(addr.sun_path) <= path.size()){
+            throw_error("unix socket path", ENAMETOOLONG);
+        }
+        memcpy(addr.sun_path, path.c_str(), path.size());
+        return addr;
+    }
+
+    template <class R, class P> bool wait_for(int fd, const std::chrono::duration<R, P> &timeout) {
+        pollfd pfd = { fd, POLLIN, 0 };
+        return 0 < poll(message_on_error, &pfd, 1, duration_cast<milliseconds>(timeout).count());
+    }
+
+public:
+
+    unix_channel_t(const std::function<void (const char *)> &message_f) : sys_caller_t(message_f) {}
+
+    ~unix_channel_t() {
+        for(int fd : { fd_, listening_fd_ }){
+            if(fd != -1){
+                close(message_on_error, fd);
+            }
+        }
+        if(!path_.empty()){
+            ::unlink(path_.c_str());
+        }
+    }
+
+    void listen(const string &path) {
+        auto addr = address(path);
+        ::unlink(path.c_str());
+        listening_fd_ = socket(throw_on_error, AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        bind(throw_on_error, listening_fd_, (sockaddr *)&addr, sizeof(addr));
+        path_ = path;
+        sys_caller_t::listen(throw_on_error, listening_fd_, 1);
+    }
+
+    template <class R, class P> bool accept(const std::chrono::duration<R, P> &timeout) {
+        if(!wait_for(listening_fd_, timeout)){
+            return false;
+        }
+        fd_ = sys_caller_t::accept(message_on_error, listening_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        return fd_ != -1;
+    }
+
+    void connect(const string &path) {
+        auto addr = address(path);
+        fd_ = socket(throw_on_error, AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        sys_caller_t::connect(throw_on_error, fd_, (sockaddr *)&addr, sizeof(addr));
+    }
+
+    // payload is split into records of max_record_size, a shorter record ends the payload;
+    // the descriptors go with the first record
+    bool send(char kind, const string &payload, const vector<int> &fds = {}) {
+        size_t pos = 0;
+        size_t sz;
+        do{
+            sz = std::min<size_t>(payload.size() - pos, max_record_size - 1);
+            string record(1, kind);
+            record.append(payload, pos, sz);
+            iovec iov = { &record[0], record.size() };
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            char control[CMSG_SPACE(sizeof(int) * max_record_fds)];
+            if(!pos && !fds.empty()){
+                memset(control, 0, sizeof(control));
+                msg.msg_control = control;
+                msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+                cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+                memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+            }
+            if(sendmsg(message_on_error, fd_, &msg, MSG_NOSIGNAL) != static_cast<int>(record.size())){
+                return false;
+            }
+            pos += sz;
+        } while(sz == max_record_size - 1);
+        return true;
+    }
+
+    // returns the kind of the record or 0 on error, timeout or end of channel
+    template <class R, class P>
+    char receive(string *payload, vector<int> *fds, const std::chrono::duration<R, P> &timeout) {
+        char kind = 0;
+        payload->clear();
+        fds->clear();
+        string record(max_record_size, '\0');
+        for(;;){
+            if(!wait_for(fd_, timeout)){
+                return 0;
+            }
+            iovec iov = { &record[0], record.size() };
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            char control[CMSG_SPACE(sizeof(int) * max_record_fds)];
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            int res = recvmsg(message_on_error, fd_, &msg, MSG_CMSG_CLOEXEC);
+            if(res <= 0){
+                return 0;
+            }
+            for(cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+                if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+                    unsigned cnt = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    const int *data = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+                    fds->insert(fds->end(), data, data + cnt);
+                }
+            }
+            if(!kind){
+                kind = record[0];
+            }
+            payload->append(record, 1, res - 1);
+            if(res < static_cast<int>(max_record_size)){
+                return kind;
+            }
+        }
+    }
+};
+
+}
+
+using unix_channel_nms::unix_channel_t;
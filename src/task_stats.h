@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <atomic>
+#include <utility>
+
+#include "trace.h"
+
+namespace task_stats_nms {
+
+using std::string;
+using std::atomic;
+
+// written by the thread of the task only, read by any
+struct task_stats_t {
+    atomic<uint64_t> steps = { 0 };
+    atomic<uint64_t> busy_ns = { 0 };
+    atomic<uint64_t> idle_ns = { 0 };       // waiting for work or paused
+    atomic<uint64_t> memory_ns = { 0 };     // waiting for free pages
+    atomic<uint64_t> wakeups = { 0 };
+    atomic<uint64_t> spurious = { 0 };      // wakeups finding no work: timeouts, work taken by others
+
+    static void add(atomic<uint64_t> *counter, uint64_t val) {
+        counter->store(counter->load(std::memory_order_relaxed) + val, std::memory_order_relaxed);
+    }
+
+    // sums up the tasks of a role
+    void add_to(task_stats_t *total) const {
+        for(auto p : { std::make_pair(&steps, &total->steps), std::make_pair(&busy_ns, &total->busy_ns)
+                     , std::make_pair(&idle_ns, &total->idle_ns), std::make_pair(&memory_ns, &total->memory_ns)
+                     , std::make_pair(&wakeups, &total->wakeups), std::make_pair(&spurious, &total->spurious) }){
+            p.second->fetch_add(p.first->load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+    }
+
+    string summary() const {
+        const uint64_t busy = busy_ns.load(std::memory_order_relaxed);
+        const uint64_t total = busy + idle_ns.load(std::memory_order_relaxed)
+                + memory_ns.load(std::memory_order_relaxed);
+        return "busy " + std::to_string(total ? busy * 1000 / total / 10 : 0) + '.'
+                + std::to_string(total ? busy * 1000 / total % 10 : 0) + "% of "
+                + std::to_string(total / 1000000) + " ms, "
+                + std::to_string(steps.load(std::memory_order_relaxed)) + " steps, "
+                + std::to_string(wakeups.load(std::memory_order_relaxed)) + " wakeups, "
+                + std::to_string(spurious.load(std::memory_order_relaxed)) + " spurious, memory blocked "
+                + std::to_string(memory_ns.load(std::memory_order_relaxed) / 1000000) + " ms";
+    }
+
+    void reset() {
+        for(auto counter : { &steps, &busy_ns, &idle_ns, &memory_ns, &wakeups, &spurious }){
+            counter->store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+// the statistics of the task the thread runs, the waits are subtracted from its steps
+class task_account_t {
+    static inline thread_local task_stats_t *stats_ = nullptr;
+    static inline thread_local uint64_t waited_ = 0;
+
+    friend class wait_scope_t;
+
+public:
+
+    static void attach(task_stats_t *stats) { stats_ = stats; }
+
+    static uint64_t step_start() {
+        waited_ = 0;
+        return trace_nms::now_ns();
+    }
+
+    static void step_end(uint64_t start) {
+        if(stats_){
+            const uint64_t ns = trace_nms::now_ns() - start;
+            task_stats_t::add(&stats_->steps, 1);
+            task_stats_t::add(&stats_->busy_ns, waited_ < ns ? ns - waited_ : 0);
+        }
+    }
+};
+
+// a wait of the task the thread runs, if any
+class wait_scope_t {
+    const bool memory_;
+    uint64_t start_ = 0;
+    int woken_ = -1;            // 1 - the work is there, 0 - it isn't, -1 - not a wakeup
+
+    wait_scope_t(const wait_scope_t &) = delete;
+    wait_scope_t &operator=(const wait_scope_t &) = delete;
+
+public:
+
+    explicit wait_scope_t(bool memory = false) : memory_(memory) {
+        if(task_account_t::stats_){
+            start_ = trace_nms::now_ns();
+        }
+    }
+
+    void woken(bool productive) { woken_ = productive; }
+
+    ~wait_scope_t() {
+        auto stats = task_account_t::stats_;
+        if(!stats){
+            return;
+        }
+        const uint64_t ns = trace_nms::now_ns() - start_;
+        task_account_t::waited_ += ns;
+        task_stats_t::add(memory_ ? &stats->memory_ns : &stats->idle_ns, ns);
+        if(woken_ != -1){
+            task_stats_t::add(&stats->wakeups, 1);
+            task_stats_t::add(&stats->spurious, !woken_);
+        }
+    }
+};
+
+}
+
+using task_stats_nms::task_stats_t;
+using task_stats_nms::task_account_t;
+using task_stats_nms::wait_scope_t;
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "logger.h"
+#include "../backend_msg.h"
+
+namespace backend_logger_nms {
+
+using std::string;
+
+// logs the outcome of the server's responses: command tags with the rows sent,
+// errors and notices, and the transaction status when it isn't idle
+template <class ConveyerSide> class backend_logger_t : public logger_t<ConveyerSide> {
+    static inline backend_msg_t bmsg_;
+    typedef logger_t<ConveyerSide> Base;
+
+    const char *message() override {
+        return "! This is server side logging: command tags with the rows sent, errors and notices !\n"
+                "-----------------------\n";
+    }
+
+public:
+
+    backend_logger_t(unsigned reader_num, signal_pack_t *data_signal, task_control_t *ctrl
+                     , resource_waiter_t *memory_waiter, transfer_conveyer_t *conveyer
+                     , log_detail_t *detail, capture_file_t *capture
+                  , const std::function<void (const char *)> &message_f)
+        : Base(reader_num, data_signal, ctrl, memory_waiter, conveyer, detail, capture, message_f) {}
+
+    unsigned read_data(const string &dsc, int sock, page_wrapper_t &&wpage, int *) override {
+        Base::capture(sock, wpage);
+        Base::update_detail();
+        exceptor_t::except([&](){
+            bmsg_.add_data(sock, wpage.data(), wpage.size(), [&](const backend_event_t &e){
+                switch(e.type){
+                case 'C':
+                    if(Base::filter_.pass_details()){
+                        Base::log_ << '(' << Base::time_stamp() << ") " << dsc << " : "
+                                   << e.body.c_str() << ", rows " << e.rows << '\n';
+                    }
+                    break;
+                case 'E':
+                case 'N':
+                    if(e.type == 'E' ? Base::filter_.pass_statement() : Base::filter_.pass_details()){
+                        Base::log_ << '(' << Base::time_stamp() << ") " << dsc << " : "
+                                   << backend_msg_nms::error_summary(e.body) << '\n';
+                    }
+                    break;
+                case 'Z':
+                    if(!e.body.empty() && e.body[0] != 'I' && Base::filter_.pass_details()){
+                        Base::log_ << '(' << Base::time_stamp() << ") " << dsc << " : "
+                                   << (e.body[0] == 'E' ? "in failed transaction" : "in transaction")
+                                   << '\n';
+                    }
+                    break;
+                }
+            }, &wpage.index(), wpage.pos());
+        });
+        return wpage.size();
+    }
+
+    static void reset() { bmsg_.reset(); }
+
+    static void clear_from(int sock) { bmsg_.clear_from(sock); }
+
+    static string save_state(int sock) { return bmsg_.save(sock); }
+
+    static void load_state(int sock, const string &state) { bmsg_.load(sock, state); }
+
+    static string summary() { return bmsg_.stats.summary(); }
+
+    static void reset_stats() { bmsg_.stats.reset(); }
+};
+
+}
+
+using backend_logger_nms::backend_logger_t;
@@ -1,4 +1,8 @@
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <cstring>
+#include <charconv>
+#include <algorithm>
 #include <string>
 #include <thread>
 #include <memory>
@@ -7,6 +11,8 @@
 #include "connector.h"
 #include "../transfer_conveyer.h"
 #include "../exceptions/destructoid.h"
+#include "../postgre_msg.h"
+#include "../query_tracker.h"
 
 using std::string;
 using std::unique_ptr;
@@ -18,16 +24,203 @@ class connected_peer_t : public peer_t {
 public:
 
     connected_peer_t(int client_sock, int server_sock) : peer_t(client_sock, server_sock) {}
+
+    void hand_over() override {
+        disconnector_.dismiss();
+        disconnector_.append([client_sock = descriptor<clients_side>()
+                              , server_sock = descriptor<server_side>()](){
+            ::close(client_sock);
+            ::close(server_sock);
+        });
+    }
 };
 
-void connector_t::add_peer(int sock) {
-    sockaddr_in client_addr;
-    socklen_t addr_l = sizeof(sockaddr_in);
-    int client_sock = accept(message_on_error, sock, (sockaddr *)&client_addr, &addr_l
+void connector_t::accept_peers(int sock) {
+    const unsigned budget = options_.accept_budget ? options_.accept_budget : 1;
+    accepted_.clear();
+    while(accepted_.size() < budget){
+        accepted_t client;
+        socklen_t addr_l = sizeof(client.addr);
+        client.sock = accept(message_on_error, sock, (sockaddr *)&client.addr, &addr_l
                              , SOCK_NONBLOCK);
-    if(client_sock == -1){
+        if(client.sock == -1){
+            break;
+        }
+        client.time = steady_clock::now();
+        accepted_.push_back(client);
+    }
+    if(accepted_.empty()){
+        return;
+    }
+    stats_->batches.fetch_add(1, std::memory_order_relaxed);
+    for(const auto &client : accepted_){
+        if(admit(client)){
+            add_peer(client);
+        }
+    }
+}
+
+// refuses the clients over their address rate, queues the ones finding all backend slots taken
+bool connector_t::admit(const accepted_t &client) {
+    auto admission = options_.admission;
+    if(!admission){
+        return true;
+    }
+    if(!admission->rate_ok(client.addr)){
+        admission_nms::refuse(client.sock, "too many connections from the client address");
+        close(message_on_error, client.sock);
+        return false;
+    }
+    if(admission->try_acquire()){
+        return true;
+    }
+    if(!except([&](){ admission->enqueue(client); })){
+        close(message_on_error, client.sock);
+    }
+    return false;
+}
+
+void connector_t::admit_waiting() {
+    std::vector<int> expired;
+    accepted_t client;
+    while(options_.admission->next(&client, &expired)){
+        add_peer(client);
+    }
+    for(int sock : expired){
+        admission_nms::refuse(sock, "no backend connection available in time");
+        close(message_on_error, sock);
+    }
+}
+
+// the client holds an admission slot, if the admission is controlled
+void connector_t::add_peer(const accepted_t &client) {
+    if(options_.startup_epoll != -1){
+        wait_startup(client);
+    } else{
+        route_peer(client, false);
+    }
+}
+
+// the client is watched until its startup packet tells where to route it
+void connector_t::wait_startup(const accepted_t &client) {
+    bool ok = except([&](){
+        std::lock_guard<std::mutex> lg(startups_mx_);
+        startups_[client.sock] = { client, steady_clock::now() + startup_timeout, false };
+    });
+    if(ok){
+        epoll_event ee;
+        ee.events = EPOLLIN | EPOLLONESHOT;
+        ee.data.fd = client.sock;
+        if(epoll_ctl(message_on_error, options_.startup_epoll, EPOLL_CTL_ADD, client.sock, &ee) != -1){
+            return;
+        }
+        std::lock_guard<std::mutex> lg(startups_mx_);
+        startups_.erase(client.sock);
+    }
+    close(message_on_error, client.sock);
+    if(options_.admission){
+        options_.admission->release();
+    }
+}
+
+// the connector taking a client out of the wait routes it or drops it
+bool connector_t::take_startup(int sock, accepted_t *client) {
+    {
+        std::lock_guard<std::mutex> lg(startups_mx_);
+        auto it = startups_.find(sock);
+        if(it == startups_.end()){
+            return false;
+        }
+        *client = it->second.client;
+        startups_.erase(it);
+    }
+    epoll_ctl(message_on_error, options_.startup_epoll, EPOLL_CTL_DEL, sock, nullptr);
+    return true;
+}
+
+// peeks at the startup packet, leaving it for the server; the encryption is negotiated
+// with the primary as the startup packet after it can't be read here
+void connector_t::on_startup(int sock) {
+    accepted_t client;
+    steady_clock::time_point deadline;
+    {
+        std::lock_guard<std::mutex> lg(startups_mx_);
+        auto it = startups_.find(sock);
+        if(it == startups_.end()){
+            // routed on its time out meanwhile
+            return;
+        }
+        client = it->second.client;
+        deadline = it->second.deadline;
+    }
+    int8_t buf[postgre_msg_nms::max_startup_size];
+    int res = recv(message_on_error, sock, buf, sizeof(buf), MSG_PEEK);
+    const bool gone = res == 0 || (res == -1 && errno != EAGAIN && errno != EWOULDBLOCK);
+    int kind = postgre_msg_nms::classify_startup(buf, res == -1 ? 0 : res);
+    if(!gone && kind == postgre_msg_nms::startup_kind::incomplete && steady_clock::now() < deadline){
+        // a rearmed watch would report the part in at once, it waits for the next pass
+        std::lock_guard<std::mutex> lg(startups_mx_);
+        auto it = startups_.find(sock);
+        if(it != startups_.end()){
+            it->second.partial = true;
+        }
         return;
     }
+    if(!take_startup(sock, &client)){
+        return;
+    }
+    if(gone){
+        close(message_on_error, sock);
+        if(options_.admission){
+            options_.admission->release();
+        }
+        return;
+    }
+    route_peer(client, kind == postgre_msg_nms::startup_kind::read_only);
+}
+
+// the clients silent past their time go to the primary, the ones with a part of the packet in
+// are watched again
+void connector_t::route_late() {
+    std::vector<int> late;
+    {
+        std::lock_guard<std::mutex> lg(startups_mx_);
+        if(startups_.empty()){
+            return;
+        }
+        const auto now = steady_clock::now();
+        for(auto &s : startups_){
+            if(s.second.deadline < now){
+                if(!except([&](){ late.push_back(s.first); })){
+                    break;
+                }
+            } else if(s.second.partial){
+                s.second.partial = false;
+                epoll_event ee;
+                ee.events = EPOLLIN | EPOLLONESHOT;
+                ee.data.fd = s.first;
+                epoll_ctl(message_on_error, options_.startup_epoll, EPOLL_CTL_MOD, s.first, &ee);
+            }
+        }
+    }
+    accepted_t client;
+    for(int sock : late){
+        if(take_startup(sock, &client)){
+            route_peer(client, false);
+        }
+    }
+}
+
+void connector_t::clear_startups() {
+    std::lock_guard<std::mutex> lg(startups_mx_);
+    for(const auto &s : startups_){
+        ::close(s.first);
+    }
+    startups_.clear();
+}
+
+void connector_t::route_peer(const accepted_t &client, bool read_only) {
+    const int client_sock = client.sock;
     destructoid_t cleaner;
     if(!prepend_or_call(&cleaner, [client_sock, this](){
                         shutdown(message_on_error, client_sock, SHUT_RDWR);
@@ -35,71 +228,43 @@ void connector_t::add_peer(int sock) {
                         show_message("peer dropped"); })){
         return;
     }
-    int server_sock = socket(message_on_error, PF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    if(options_.admission && !prepend_or_call(&cleaner, [admission = options_.admission](){
+                                              admission->release(); })){
+        return;
+    }
+    const unsigned backend = backends_->attach(read_only);
+    if(!prepend_or_call(&cleaner, [backend, this](){ backends_->detach(backend); })){
+        return;
+    }
+    const endpoint_t &server_addr = backends_->addr(backend);
+    const bool local_server = server_addr.is_local();
+    int server_sock = socket(message_on_error, server_addr.family(), SOCK_STREAM | SOCK_NONBLOCK
+                             , local_server ? 0 : IPPROTO_TCP);
     if(server_sock == -1){
         return;
     }
     if(!prepend_or_call(&cleaner, [server_sock, this](){ close(message_on_error, server_sock); })){
         return;
     }
+    client_options_.apply(client_sock);
+    server_options_.apply(server_sock);
+    if(options_.fast_open && !local_server){
+        // connect returns at once and the SYN goes out with the first data sent
+        int opt = 1;
+        setsockopt(message_on_error, server_sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &opt, sizeof(opt));
+    }
     for(int i = 0; ; ++i){
-        int res = connect(message_on_error, server_sock, (sockaddr *)&server_addr_
-                          , sizeof(sockaddr_in));
+        int res = connect(message_on_error, server_sock, server_addr.addr(), server_addr.size());
         if(res == -1){
             int error = errno;
             if(error == EINPROGRESS){
-                int epoll_fd = epoll_create(message_on_error);
-                if(epoll_fd == -1){
-                    return;
-                }
-                destructoid_t epoll_cleaner;
-                if(!prepend_or_call(&epoll_cleaner, [epoll_fd, this](){
-                                    close(message_on_error, epoll_fd); })){
-                    return;
-                }
-                epoll_event ee;
-                ee.events = EPOLLOUT;
-                ee.data.fd = server_sock;
-                res = epoll_ctl(message_on_error, epoll_fd, EPOLL_CTL_ADD, server_sock, &ee);
-                if(res == -1){
-                    return;
-                }
-                if(!prepend_or_call(&epoll_cleaner, [epoll_fd, server_sock, this]{
-                                    epoll_ctl(message_on_error, epoll_fd, EPOLL_CTL_DEL, server_sock
-                                              , nullptr); })){
-                    return;
-                }
-                {
-                    unique_ptr<epoller_t<1>> epoller;
-                    if(!except([&](){ epoller = std::make_unique<epoller_t<1>>(epoll_fd, max_response
-                                            , [this](const char *m){ show_message(m); }
-                                            , [this](operation_t op){ return except(op); }); })){
-                        return;
-                    }
-                    while((res = epoller->epoll([](int){})) == 0){
-                        if(stop_flag()){
-                            return;
-                        }
-                    }
-                    if(res == -1){
-                        return;
-                    }
-                }
-                socklen_t len = sizeof(int);
-                res = getsockopt(message_on_error, server_sock, SOL_SOCKET, SO_ERROR, &error, &len);
-                if(res == -1){
-                    return;
-                }
-                if(!error){
-                    break;
-                }
-                if(error != EAGAIN){
-                    message_error("connect", error);
-                    return;
-                }
+                // completed by the connector seeing the socket writable, the others go on accepting
+                wait_connect(client, server_sock, cleaner);
+                return;
             }
             if(error == EAGAIN){
-                show_message("connect: insufficient entries in the routing cache");
+                show_message(local_server ? "connect: server backlog is full"
+                                          : "connect: insufficient entries in the routing cache");
                 if(i < 5){
                     std::this_thread::sleep_for(max_response);
                     if(stop_flag()){
@@ -112,22 +277,145 @@ void connector_t::add_peer(int sock) {
         }
         break;
     }
+    complete_peer(client, server_sock, cleaner);
+}
+
+void connector_t::wait_connect(const accepted_t &client, int server_sock, destructoid_t &cleaner) {
+    {
+        std::lock_guard<std::mutex> lg(connects_mx_);
+        if(!except([&](){ connects_[server_sock] = { client, std::move(cleaner) }; })){
+            return;
+        }
+    }
+    epoll_event ee;
+    ee.events = EPOLLOUT | EPOLLONESHOT;
+    ee.data.fd = server_sock;
+    if(epoll_ctl(message_on_error, options_.connect_epoll, EPOLL_CTL_ADD, server_sock, &ee) == -1){
+        destructoid_t dropped;
+        std::lock_guard<std::mutex> lg(connects_mx_);
+        auto it = connects_.find(server_sock);
+        if(it != connects_.end()){
+            dropped = std::move(it->second.cleaner);
+            connects_.erase(it);
+        }
+    }
+}
+
+void connector_t::on_connect(int server_sock) {
+    connect_wait_t wait;
+    {
+        std::lock_guard<std::mutex> lg(connects_mx_);
+        auto it = connects_.find(server_sock);
+        if(it == connects_.end()){
+            return;
+        }
+        wait.client = it->second.client;
+        wait.cleaner = std::move(it->second.cleaner);
+        connects_.erase(it);
+    }
+    epoll_ctl(message_on_error, options_.connect_epoll, EPOLL_CTL_DEL, server_sock, nullptr);
+    int error = 0;
+    socklen_t len = sizeof(int);
+    if(getsockopt(message_on_error, server_sock, SOL_SOCKET, SO_ERROR, &error, &len) == -1){
+        return;
+    }
+    if(error){
+        message_error("connect", error);
+        return;
+    }
+    complete_peer(wait.client, server_sock, wait.cleaner);
+}
+
+void connector_t::complete_peer(const accepted_t &client, int server_sock, destructoid_t &cleaner) {
+    const int client_sock = client.sock;
     if(!prepend_or_call(&cleaner, [server_sock, this](){
                         shutdown(message_on_error, server_sock, SHUT_RDWR); })){
         return;
     }
-    unique_ptr<connected_peer_t> peer;
-    if(!except([&](){ peer = std::make_unique<connected_peer_t>(client_sock, server_sock); })){
-        return;
+    // unix socket clients are unnamed, the descriptor tells them apart
+    char name[INET_ADDRSTRLEN + 6];
+    char *end = name;
+    if(client.addr.ss_family == AF_INET){
+        auto addr = reinterpret_cast<const sockaddr_in *>(&client.addr);
+        inet_ntop(AF_INET, &addr->sin_addr, name, INET_ADDRSTRLEN);
+        end += std::strlen(name);
+        *end++ = ':';
+        end = std::to_chars(end, name + sizeof(name), ntohs(addr->sin_port)).ptr;
+    } else{
+        end = std::copy_n("local:", 6, end);
+        end = std::to_chars(end, name + sizeof(name), client_sock).ptr;
     }
     string client_name;
-    if(!except([&](){ client_name = string(inet_ntoa(client_addr.sin_addr))+ ":"
-                                                + std::to_string(client_addr.sin_port); })){
+    if(!except([&](){ client_name.assign(name, end); })){
         return;
     }
+    if(register_peer(client_sock, server_sock, client_name, cleaner)){
+        stats_->add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        steady_clock::now() - client.time).count());
+    }
+}
+
+unsigned connector_t::connects_pending() {
+    std::lock_guard<std::mutex> lg(connects_mx_);
+    return connects_.size();
+}
+
+void connector_t::clear_connects() {
+    std::unordered_map<int, connect_wait_t> connects;
+    {
+        std::lock_guard<std::mutex> lg(connects_mx_);
+        connects.swap(connects_);
+    }
+    // the cleaners drop the peers
+}
+
+bool connector_t::adopt_peer(int client_sock, int server_sock, const string &client_name) {
+    destructoid_t cleaner;
+    if(!prepend_or_call(&cleaner, [client_sock, server_sock, this](){
+                        shutdown(message_on_error, client_sock, SHUT_RDWR);
+                        close(message_on_error, client_sock);
+                        close(message_on_error, server_sock);
+                        show_message("peer dropped"); })){
+        return false;
+    }
+    if(!prepend_or_call(&cleaner, [server_sock, this](){
+                        shutdown(message_on_error, server_sock, SHUT_RDWR); })){
+        return false;
+    }
+    if(options_.admission){
+        options_.admission->acquire_forced();
+        if(!prepend_or_call(&cleaner, [admission = options_.admission](){ admission->release(); })){
+            return false;
+        }
+    }
+    // the state of the queries in flight is unknown, such peers are not tracked
+    return register_peer(client_sock, server_sock, client_name, cleaner, false);
+}
+
+bool connector_t::register_peer(int client_sock, int server_sock, const string &client_name
+                                , destructoid_t &cleaner, bool track) {
+    unique_ptr<connected_peer_t> peer;
+    if(!except([&](){
+            peer = std::make_unique<connected_peer_t>(client_sock, server_sock);
+            peer->mid_stream = !track;
+            if(track && options_.cache && options_.cache->enabled()){
+                peer->tracker = std::make_shared<query_tracker_t>(options_.cache);
+            }})){
+        return false;
+    }
     auto *peer_disconnector = &peer->disconnector_;
-    if(!except([&](){ conveyer_->add_peer(client_name, std::move(peer)); })){
-        return;
+    const auto resume_f = [this, client_sock, server_sock](int sock){
+        if(conveyer_->input_held()){
+            return;
+        }
+        epoll_event ee;
+        ee.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+        ee.data.fd = sock;
+        int epoll_fd = sock == client_sock ? clients_receivers_epoll_ : server_receivers_epoll_;
+        epoll_ctl(message_on_error, epoll_fd, EPOLL_CTL_MOD, sock, &ee);
+    };
+    if(!except([&](){ conveyer_->add_peer(client_name, std::move(peer), resume_f); })){
+        return false;
     }
     const auto register_epoll = [&cleaner, this](int epoll_fd, int socket_fd, uint32_t events){
         epoll_event ee;
@@ -144,12 +432,13 @@ void connector_t::add_peer(int sock) {
         }
         return true;
     };
-    register_epoll(clients_receivers_epoll_, client_sock, EPOLLIN | EPOLLET | EPOLLONESHOT);
-    register_epoll(clients_senders_epoll_, client_sock, EPOLLOUT | EPOLLET);
-    register_epoll(server_receivers_epoll_, server_sock, EPOLLIN | EPOLLET | EPOLLONESHOT);
-    register_epoll(server_senders_epoll_, server_sock, EPOLLOUT | EPOLLET);
+    bool registered = register_epoll(clients_receivers_epoll_, client_sock
+                                     , EPOLLIN | EPOLLET | EPOLLONESHOT);
+    registered = register_epoll(server_receivers_epoll_, server_sock
+                                , EPOLLIN | EPOLLET | EPOLLONESHOT) && registered;
     string msg;
     except([&](){ msg = client_name + " : disconnecting peer"; });
     except([&](){ cleaner.prepend([this, m = std::move(msg)](){ show_message(m.c_str()); }); });
     peer_disconnector->swap(cleaner);
+    return registered;
 }
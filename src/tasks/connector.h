@@ -1,47 +1,197 @@
 #pragma once
 
 #include <netinet/in.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
 
 #include "../exceptions/exceptor.h"
 #include "../system/epoller.h"
+#include "../system/socket_profile.h"
+#include "../system/endpoint.h"
+#include "../backends.h"
+#include "../result_cache.h"
+#include "../admission.h"
+#include "../exceptions/destructoid.h"
 
 namespace conveyer_nms { class transfer_conveyer_t; }
 
 namespace connector_nms {
 
 using conveyer_nms::transfer_conveyer_t;
+using std::chrono::steady_clock;
+
+// how long a client has to send its startup packet before it is routed to the primary,
+// a client asking for encryption goes to the primary at once, as its startup packet can't be read
+constexpr auto startup_timeout = std::chrono::seconds(2);
+
+struct connect_options_t {
+    unsigned accept_budget = 64;    // connections accepted per wakeup
+    bool fast_open = false;         // TCP Fast Open towards the server
+    socket_profile_t client_profile;
+    socket_profile_t server_profile;
+    result_cache_t *cache = nullptr;    // the peers are tracked if it is enabled
+    admission_t *admission = nullptr;   // null if the clients are let in at once
+    int startup_epoll = -1;     // the clients to route by their startup packets, watched in connectors_epoll
+    int connect_epoll = -1;     // the server connects in progress, watched in connectors_epoll
+};
+
+// time from accepting a client to having its peer registered
+struct setup_stats_t {
+    std::atomic<uint64_t> accepted = { 0 };
+    std::atomic<uint64_t> batches = { 0 };
+    std::atomic<uint64_t> total_ns = { 0 };
+    std::atomic<uint64_t> max_ns = { 0 };
+
+    void add(uint64_t ns) {
+        accepted.fetch_add(1, std::memory_order_relaxed);
+        total_ns.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t cur = max_ns.load(std::memory_order_relaxed);
+        while(cur < ns && !max_ns.compare_exchange_weak(cur, ns, std::memory_order_relaxed)){}
+    }
+
+    void reset() {
+        for(auto counter : { &accepted, &batches, &total_ns, &max_ns }){
+            counter->store(0, std::memory_order_relaxed);
+        }
+    }
+};
 
 class connector_t : public exceptor_t, protected epoller_t<1> {
+
+    using accepted_t = accepted_client_t;
+
+    // the clients whose startup packets are awaited to route them, shared by the connectors
+    struct startup_wait_t {
+        accepted_t client;
+        steady_clock::time_point deadline;
+        bool partial;       // a part of the packet is in, the watch is rearmed on the next pass
+    };
+    static inline std::mutex startups_mx_;
+    static inline std::unordered_map<int, startup_wait_t> startups_;
+
+    // the peers whose server connects are in progress, by server socket, shared by the connectors
+    struct connect_wait_t {
+        accepted_t client;
+        destructoid_t cleaner;     // drops the peer unless it is registered
+    };
+    static inline std::mutex connects_mx_;
+    static inline std::unordered_map<int, connect_wait_t> connects_;
+
     transfer_conveyer_t *conveyer_;
-    sockaddr_in server_addr_;
+    backends_t *backends_;
     int clients_receivers_epoll_;
     int server_receivers_epoll_;
-    int clients_senders_epoll_;
-    int server_senders_epoll_;
+    const connect_options_t options_;
+    setup_stats_t *stats_;
+    socket_options_t client_options_;
+    socket_options_t server_options_;
+    std::vector<accepted_t> accepted_;
+    std::atomic_uint connecting_ = { 0 };
+    epoller_t<16> startup_epoller_;
+    epoller_t<16> connect_epoller_;
+
+    void accept_peers(int sock);
+
+    bool admit(const accepted_t &client);
+
+    void admit_waiting();
+
+    void add_peer(const accepted_t &client);
+
+    void route_peer(const accepted_t &client, bool read_only);
 
-    void add_peer(int sock);
+    void wait_connect(const accepted_t &client, int server_sock, destructoid_t &cleaner);
+
+    void on_connect(int server_sock);
+
+    void complete_peer(const accepted_t &client, int server_sock, destructoid_t &cleaner);
+
+    void wait_startup(const accepted_t &client);
+
+    bool take_startup(int sock, accepted_t *client);
+
+    void on_startup(int sock);
+
+    void route_late();
+
+    bool register_peer(int client_sock, int server_sock, const std::string &client_name
+                       , destructoid_t &cleaner, bool track = true);
 
 public:
 
-    connector_t(const sockaddr_in &server_addr, int connectors_epoll, int clients_receivers_epoll
-                , int server_receivers_epoll, int clients_senders_epoll, int server_senders_epoll
-                , task_control_t *ctrl, resource_waiter_t *memory_waiter, transfer_conveyer_t *conveyer
+    connector_t(backends_t *backends, int connectors_epoll, int clients_receivers_epoll
+                , int server_receivers_epoll, task_control_t *ctrl, resource_waiter_t *memory_waiter, transfer_conveyer_t *conveyer
+                , const connect_options_t &options, setup_stats_t *stats
                 , const std::function<void (const char *)> &message_f)
         : exceptor_t(memory_waiter, ctrl, message_f)
         , epoller_t(connectors_epoll, max_response, message_f
                     , [this](operation_t op){ return except(op); })
-        , conveyer_(conveyer), server_addr_(server_addr)
+        , conveyer_(conveyer), backends_(backends)
         , clients_receivers_epoll_(clients_receivers_epoll)
         , server_receivers_epoll_(server_receivers_epoll)
-        , clients_senders_epoll_(clients_senders_epoll)
-        , server_senders_epoll_(server_senders_epoll) {}
+        , options_(options), stats_(stats)
+        , client_options_(options.client_profile, message_f, [this](operation_t op){ return except(op); })
+        , server_options_(options.server_profile, message_f, [this](operation_t op){ return except(op); })
+        , startup_epoller_(options.startup_epoll, std::chrono::milliseconds(0), message_f
+                           , [this](operation_t op){ return except(op); })
+        , connect_epoller_(options.connect_epoll, std::chrono::milliseconds(0), message_f
+                           , [this](operation_t op){ return except(op); }) {
+        accepted_.reserve(options_.accept_budget ? options_.accept_budget : 1);
+    }
 
     const char *name() const override { return "connector"; }
 
+    // takes over a connected pair of sockets received from another process
+    bool adopt_peer(int client_sock, int server_sock, const std::string &client_name);
+
+    bool connecting() const { return connecting_.load(std::memory_order_acquire); }
+
+    // closes the clients still to send their startup packets
+    static void clear_startups();
+
+    // the peers still waiting for their servers to accept
+    static unsigned connects_pending();
+
+    // drops the peers still waiting for their servers
+    static void clear_connects();
+
 protected:
 
     bool one_step() override {
-        return epoll([this](int sock){ add_peer(sock); }) != -1;
+        auto admission = options_.admission;
+        int res = epoll([this, admission](int sock){
+            connecting_.store(1, std::memory_order_release);
+            if(admission && sock == admission->wakeup_fd()){
+                admission->take_wakeup();
+            } else if(sock == options_.startup_epoll){
+                startup_epoller_.epoll([this](int client_sock){ on_startup(client_sock); }
+                                       , epoller_nms::empty_op, false);
+            } else if(sock == options_.connect_epoll){
+                connect_epoller_.epoll([this](int server_sock){ on_connect(server_sock); }
+                                       , epoller_nms::empty_op, false);
+            } else{
+                accept_peers(sock);
+            }
+            connecting_.store(0, std::memory_order_release);
+        });
+        if(options_.startup_epoll != -1){
+            connecting_.store(1, std::memory_order_release);
+            route_late();
+            connecting_.store(0, std::memory_order_release);
+        }
+        if(admission && admission->max_backends()){
+            // the clients queued here and the ones out of time are seen to on every wakeup
+            connecting_.store(1, std::memory_order_release);
+            admit_waiting();
+            connecting_.store(0, std::memory_order_release);
+        }
+        return res != -1;
     }
 
     bool on_start() override {
@@ -57,3 +207,5 @@ protected:
 }
 
 using connector_nms::connector_t;
+using connector_nms::connect_options_t;
+using connector_nms::setup_stats_t;
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+
+namespace log_detail_nms {
+
+using std::atomic_int;
+
+namespace detail_level {
+
+    const int full = 0;             // every message with its parameters
+    const int statements = 1;       // query texts only
+    const int sampled = 2;          // every sample_rate-th query text
+    const int counters = 3;         // nothing but the number of skipped records
+
+}
+
+using namespace detail_level;
+
+const unsigned sample_rate = 16;
+
+inline const char *level_name(int level) {
+    switch(level){
+    case full: return "full";
+    case statements: return "statements";
+    case sampled: return "sampled statements";
+    }
+    return "counters";
+}
+
+// logging detail chosen by the superviser from the load, in percents;
+// each level is entered at its threshold and left 10% below it
+class log_detail_t {
+    atomic_int level_ = { full };
+    const unsigned thresholds_[counters] = { 50, 65, 80 };
+    static const unsigned hysteresis = 10;
+
+public:
+
+    int level() const { return level_.load(std::memory_order_relaxed); }
+
+    // returns true if the level has changed
+    bool update(unsigned pressure) {
+        int cur = level();
+        int level = cur;
+        while(level < counters && thresholds_[level] <= pressure){
+            ++level;
+        }
+        while(full < level && pressure + hysteresis < thresholds_[level - 1]){
+            --level;
+        }
+        if(level == cur){
+            return false;
+        }
+        level_.store(level, std::memory_order_relaxed);
+        return true;
+    }
+};
+
+// per logger state of the current detail level
+struct log_filter_t {
+    int level = full;
+    unsigned skipped = 0;
+    unsigned statements = 0;
+
+    // a statement is logged at every level but counters, sampled ones only once per sample_rate
+    bool pass_statement() {
+        if(level == counters || (level == sampled && statements++ % sample_rate)){
+            ++skipped;
+            return false;
+        }
+        return true;
+    }
+
+    bool pass_details() {
+        if(level != full){
+            ++skipped;
+            return false;
+        }
+        return true;
+    }
+};
+
+}
+
+using log_detail_nms::log_detail_t;
+using log_detail_nms::log_filter_t;
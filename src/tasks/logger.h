@@ -5,8 +5,11 @@
 #include <chrono>
 #include <iomanip>
 #include <sstream>
+#include <type_traits>
 
 #include "reader.h"
+#include "log_detail.h"
+#include "../capture.h"
 
 namespace logger_nms {
 
@@ -28,6 +31,8 @@ template <class ConveyerSide> class logger_t : public reader_t<ConveyerSide, lan
     using Base::show_message_except;
 
     sys_time_t start;
+    log_detail_t *detail_;
+    capture_file_t *capture_;
 
     virtual const char *file_name() { return "to_clients_"; }
 
@@ -39,6 +44,7 @@ template <class ConveyerSide> class logger_t : public reader_t<ConveyerSide, lan
 protected:
 
     ofstream log_;
+    log_filter_t filter_;
 
     string time_stamp() {
         unsigned msecs = duration_cast<milliseconds>(sys_clock_t::now() - start).count();
@@ -55,12 +61,46 @@ protected:
         return ss.str();
     }
 
+    void log_skipped() {
+        if(filter_.skipped){
+            log_ << '(' << time_stamp() << ") " << filter_.skipped << " records not logged\n";
+            filter_.skipped = 0;
+        }
+    }
+
+    // both directions go to the capture file under the client socket
+    void capture(int sock, const page_wrapper_t &wpage) {
+        if(capture_->active()){
+            except([&](){
+                constexpr bool from_server = std::is_same<ConveyerSide, server_side>::value;
+                int client_sock = from_server ? Base::conveyer()->other_side(sock) : sock;
+                capture_->add(client_sock, from_server ? capture_nms::from_server : capture_nms::from_client
+                              , wpage.data(), wpage.size());
+            });
+        }
+    }
+
+    // records the changes of the logging detail level
+    void update_detail() {
+        int level = detail_->level();
+        if(level != filter_.level){
+            except([&](){
+                log_skipped();
+                log_ << '(' << time_stamp() << ") --- logging detail: "
+                     << log_detail_nms::level_name(level) << " ---\n";
+            });
+            filter_.level = level;
+        }
+    }
+
 public:
 
     logger_t(unsigned reader_num, signal_pack_t *data_signal, task_control_t *ctrl
              , resource_waiter_t *memory_waiter, transfer_conveyer_t *conveyer
+             , log_detail_t *detail, capture_file_t *capture
              , const std::function<void (const char *)> &message_f)
-        : Base(reader_num, data_signal, ctrl, memory_waiter, conveyer, message_f) {
+        : Base(reader_num, data_signal, ctrl, memory_waiter, conveyer, message_f)
+        , detail_(detail), capture_(capture) {
         log_.exceptions(std::ofstream::failbit | std::ofstream::badbit);
     }
 
@@ -93,11 +133,19 @@ protected:
     }
 
     void on_finish() override {
-        except([&](){ log_.close(); });
+        except([&](){
+            log_skipped();
+            log_.close();
+        });
         show_message("logger thread finished");
     }
 
-    unsigned read_data(const string &dsc, int, page_wrapper_t &&wpage, int *) override {
+    unsigned read_data(const string &dsc, int sock, page_wrapper_t &&wpage, int *) override {
+        capture(sock, wpage);
+        update_detail();
+        if(!filter_.pass_details()){
+            return wpage.size();
+        }
         except([&](){
             log_ << '(' << time_stamp() << ") "
                  << dsc << " : " << wpage.size() << " bytes transferred\n";
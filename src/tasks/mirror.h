@@ -0,0 +1,71 @@
+#pragma once
+
+#include "reader.h"
+#include "../mirror.h"
+
+namespace mirror_task_nms {
+
+const unsigned lane_num = 2;    // on the client lines only
+
+// tees the client traffic to the shadow backend; the pages of the lane are always
+// read to the end, what the shadow can't take at once is dropped rather than held
+class mirror_t : public reader_t<clients_side, lane_num> {
+    typedef reader_t<clients_side, lane_num> Base;
+    using Base::show_message;
+
+    static inline mirror_links_t links_;
+
+public:
+
+    mirror_t(unsigned reader_num, signal_pack_t *data_signal, task_control_t *ctrl
+             , resource_waiter_t *memory_waiter, transfer_conveyer_t *conveyer
+             , const std::function<void (const char *)> &message_f)
+        : Base(reader_num, data_signal, ctrl, memory_waiter, conveyer, message_f) {}
+
+    const char *name() const override { return "mirror"; }
+
+    static bool start(const endpoint_t &shadow, unsigned backlog_max
+                      , const std::function<void (const char *)> &message_f) {
+        return links_.start(shadow, backlog_max, message_f);
+    }
+
+    static void reset() { links_.reset(); }
+
+    static void clear_from(int sock) { links_.clear_from(sock); }
+
+    static std::string summary() { return links_.stats.summary(); }
+
+    static void reset_stats() { links_.stats.reset(); }
+
+protected:
+
+    bool on_start() override {
+        show_message("mirror thread started");
+        return true;
+    }
+
+    void on_finish() override {
+        show_message("mirror thread finished");
+    }
+
+    // the shadow responses are read away between the lane wakeups
+    bool one_step() override {
+        links_.drain();
+        return Base::one_step();
+    }
+
+    unsigned read_data(const std::string &, int sock, page_wrapper_t &&wpage, int *) override {
+        // the index of a stream taken over in the middle is never valid
+        const bool from_start = wpage.index().valid();
+        Base::except([&](){
+            links_.add_data(sock, wpage.data(), wpage.size(), from_start);
+        });
+        return wpage.size();
+    }
+
+    bool read_if(int transfer_flag) override { return transfer_flag == no_transfer_flag; }
+};
+
+}
+
+using mirror_task_nms::mirror_t;
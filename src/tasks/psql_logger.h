@@ -20,23 +20,34 @@ public:
 
     psql_logger_t(unsigned reader_num, signal_pack_t *data_signal, task_control_t *ctrl
                   , resource_waiter_t *memory_waiter, transfer_conveyer_t *conveyer
+                  , log_detail_t *detail, capture_file_t *capture
                   , const std::function<void (const char *)> &message_f)
-        : Base(reader_num, data_signal, ctrl, memory_waiter, conveyer, message_f) {}
+        : Base(reader_num, data_signal, ctrl, memory_waiter, conveyer, detail, capture, message_f) {}
 
     unsigned read_data(const string &dsc, int sock
                        , page_wrapper_t &&wpage, int *) override {
         auto sz = wpage.size();
+        Base::capture(sock, wpage);
+        Base::update_detail();
         const auto except_f = [this](operation_t op){ return exceptor_t::except(op); };
         exceptor_t::except([&](){
             string preamble = "(" + Base::time_stamp() + ") " + dsc + " : ";
-            pmsg_.add_data(sock, std::move(wpage), preamble, Base::log_, except_f);
+            pmsg_.add_data(sock, std::move(wpage), preamble, Base::log_, except_f, Base::filter_);
         });
         return sz;
     }
 
     static void reset() { pmsg_.reset(); }
 
+    static void set_filter(const string &types) { postgre_msg_t::set_filter(types); }
+
     static void clear_from(int sock) { pmsg_.clear_from(sock); }
+
+    static string save_state(int sock) { return pmsg_.save(sock); }
+
+    static void load_state(int sock, const string &state, memory_pager_t *pager) {
+        pmsg_.load(sock, state, pager);
+    }
 };
 
 }
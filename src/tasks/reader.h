@@ -24,9 +24,11 @@ protected:
 
     transfer_conveyer_t *conveyer() const { return conveyer_; }
 
+    signal_pack_t *data_signal() const { return data_signal_; }
+
     unsigned num() const { return reader_num_; }
 
-    bool one_step() override {
+    void read_line(int sock) {
         const auto message_f = [this](const char *default_msg
                                       , const std::function<std::string ()> &full_msg_f){
             show_message_except(default_msg, full_msg_f);
@@ -36,22 +38,35 @@ protected:
                 , page_wrapper_t &&wpage, int *transfer_flag){
             return read_data(dsc, sock, std::move(wpage), transfer_flag);
         };
-        if(conveyer_->read<ConveyerSide>(this, LANE_NUM, message_f, except_f, read_f
-                , [this](int transfer_flag){ return read_if(transfer_flag); })){
+        const auto ready_f = [this](int sock, unsigned lane_num){
+            data_signal_->push(lane_num, sock, reader_num_);
+        };
+        conveyer_->read_claimed(this, sock, LANE_NUM, message_f, except_f, read_f, ready_f
+                , [this](int transfer_flag){ return read_if(transfer_flag); });
+        line_read(sock);
+    }
+
+    bool one_step() override {
+        int sock;
+        if(data_signal_->pop(LANE_NUM, reader_num_, &sock)){
+            read_line(sock);
             return true;
         }
-        const auto cond_f = [&](){
-            return conveyer_->ready_read<ConveyerSide>(this, LANE_NUM, message_f, except_f
-                        , [this](int transfer_flag){ return read_if(transfer_flag); })
-                    <= reader_num_;
-        };
-        return data_signal_->wait(LANE_NUM, max_response, [this](){ return stop_flag(); }, cond_f);
+        return wait_data();
+    }
+
+    virtual bool wait_data() {
+        return data_signal_->wait(LANE_NUM, max_response
+                                  , [this](){ return stop_flag(); });
     }
 
     virtual unsigned read_data(const std::string &description, int descriptor
                                , page_wrapper_t &&wpage, int *transfer_flag) = 0;
 
     virtual bool read_if(int transfer_flag) = 0;
+
+    // called once the pages queued for the socket have been read or reading has stopped
+    virtual void line_read(int) {}
 };
 
 }
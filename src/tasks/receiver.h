@@ -2,30 +2,83 @@
 
 #include <cstdint>
 #include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <type_traits>
 //#include <sstream>
 
 #include "../exceptions/exceptor.h"
 #include "../system/epoller.h"
+#include "../system/socket_profile.h"
 #include "../transfer_conveyer.h"
 #include "../synchronization/signal_pack.h"
+#include "../result_cache.h"
+#include "../query_tracker.h"
+#include "sender.h"
 
 namespace receiver_nms {
 
 const unsigned buffer_size = 8192;
 
 using std::string;
+using std::vector;
+using std::shared_ptr;
 
 template <class ConveyerSide> class receiver_t : public exceptor_t, protected epoller_t<128> {
+    static constexpr bool from_clients = std::is_same_v<ConveyerSide, clients_side>;
+
     transfer_conveyer_t *conveyer_;
     signal_pack_t *data_signal_;
+    signal_pack_t *other_signal_;   // of the senders and loggers of the other side
+    const bool tracking_;
+    vector<int> hits_;              // client sockets with a cached response to be sent
+    socket_options_t options_;
+    socket_options_t dest_options_; // of the other side, corked while cutting through
+    int corked_sock_ = -1;
+    latency_histogram_t *latency_;  // of the data cut through
     int8_t buf_[buffer_size];
 
+    void note_hit(int sock) {
+        if(std::find(hits_.begin(), hits_.end(), sock) == hits_.end()){
+            hits_.push_back(sock);
+        }
+    }
+
     unsigned receive(const string &dsc, int sock_fd, const int8_t **data, int *transfer_flag) {
+        shared_ptr<query_tracker_t> tracker;
+        if(tracking_){
+            tracker = conveyer_->tracker(sock_fd);
+        }
+        if constexpr(from_clients){
+            // nothing more goes to the server until the client has its response
+            if(tracker && tracker->hit_pending()){
+                note_hit(sock_fd);
+                *transfer_flag = data_pending;
+                return 0;
+            }
+            if(tracker && tracker->has_rest()){
+                *transfer_flag = data_pending;
+                return tracker->from_rest(data);
+            }
+        }
         int bytes_read = read(message_on_error, sock_fd, buf_, sizeof buf_);
         //show_message(("from socket: " + std::to_string(sock_fd) + " received bytes: " + std::to_string(bytes_read)).c_str());
         if(0 < bytes_read){
+            options_.rearm_quickack(sock_fd);
             *transfer_flag = data_pending;
             *data = buf_;
+            if(tracker){
+                if constexpr(from_clients){
+                    unsigned res = tracker->from_client(buf_, bytes_read, data);
+                    if(tracker->hit_pending()){
+                        note_hit(sock_fd);
+                    }
+                    return res;
+                } else{
+                    tracker->from_server(buf_, bytes_read);
+                }
+            }
             return bytes_read;
         }
         if(bytes_read == 0){
@@ -33,6 +86,10 @@ template <class ConveyerSide> class receiver_t : public exceptor_t, protected ep
             return 0;
         }
         if(errno == EWOULDBLOCK || errno == EAGAIN){
+            if(conveyer_->input_held()){
+                *transfer_flag = no_transfer_flag;
+                return 0;
+            }
             epoll_event ee;
             ee.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
             ee.data.fd = sock_fd;
@@ -52,13 +109,124 @@ template <class ConveyerSide> class receiver_t : public exceptor_t, protected ep
         return 0;
     }
 
+    // cut-through: writes to the other side straight away, whatever
+    // the destination socket doesn't take is left in the lane for the senders
+    unsigned forward(const string &dsc, int sock, page_wrapper_t &&wpage, int *transfer_flag) {
+        int dest_sock = conveyer_->other_side(sock);
+        const bool cork = dest_options_.profile().cork;
+        const bool boundary = cork && sender_nms::at_boundary(wpage, !from_clients);
+        if(cork && corked_sock_ == -1 && dest_sock != -1
+                && sender_nms::min_cork_size <= wpage.size() && !boundary){
+            dest_options_.cork(dest_sock, true);
+            corked_sock_ = dest_sock;
+        }
+        int res;
+        unsigned bytes_send = write_all(message_on_error, dest_sock, wpage.data(), wpage.size()
+                                        , &res);
+        if(boundary && bytes_send == wpage.size()){
+            uncork();
+        }
+        // EINPROGRESS - a fast open connect has not completed yet, the senders take the rest
+        if(res == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINPROGRESS){
+            *transfer_flag = descriptor_error;
+            show_message_except("unable to send data", [&](){
+                return dsc + " : unable to send data";
+            });
+        } else if(res == 0){
+            *transfer_flag = descriptor_shutdown;
+        }
+        if(bytes_send && wpage.ingress()){
+            latency_->record(buffer_t::ingress_time() - wpage.ingress());
+        }
+        return bytes_send;
+    }
+
+    void uncork() {
+        if(corked_sock_ != -1){
+            dest_options_.cork(corked_sock_, false);
+            corked_sock_ = -1;
+        }
+    }
+
+    // cut-through for the sending lane, the rest go to the tasks waiting on the signal
+    template <class MessageExceptF, class ExceptF>
+    void ready(int sock, unsigned lane_num, signal_pack_t *signal, const MessageExceptF &message_f
+               , const ExceptF &except_f) {
+        const auto push_f = [signal](int sock, unsigned lane_num){
+            signal->push(lane_num, sock, sock);
+        };
+        if(lane_num == sender_nms::lane_num){
+            conveyer_->read_claimed(this, sock, lane_num, message_f, except_f
+                                    , [this](const string &dsc, int sock, page_wrapper_t &&wpage
+                                             , int *transfer_flag){
+                return forward(dsc, sock, std::move(wpage), transfer_flag);
+            }, push_f, [](int transfer_flag){
+                return transfer_flag == no_transfer_flag;
+            });
+            // whatever is left goes to the senders, which cork on their own
+            uncork();
+        } else{
+            push_f(sock, lane_num);
+        }
+    }
+
+    // writes the cached responses to the server lines as if the server had sent them,
+    // the ones that would land in the middle of a server message wait for the next step;
+    // returns true if any has been written
+    template <class MessageExceptF, class ExceptF>
+    bool send_hits(const MessageExceptF &message_f, const ExceptF &except_f) {
+        bool res = false;
+        unsigned waiting = 0;
+        for(int sock : hits_){
+            auto tracker = conveyer_->tracker(sock);
+            auto entry = tracker ? tracker->take_hit() : nullptr;
+            if(!entry){
+                continue;
+            }
+            const unsigned page_size = entry->pages.empty() ? 0 : entry->pages.front()->size();
+            unsigned offset = 0;
+            bool between = true;
+            conveyer_->write(this, conveyer_->other_side(sock), message_f, except_f
+                             , [&](const string &, int, const int8_t **data, int *){
+                if(offset == 0 && !(between = tracker->server_between())){
+                    return 0u;
+                }
+                if(entry->size <= offset){
+                    return 0u;
+                }
+                *data = entry->pages[offset / page_size]->data();
+                unsigned res = std::min(page_size, entry->size - offset);
+                offset += res;
+                return res;
+            }, [&](int server_sock, unsigned lane_num){
+                ready(server_sock, lane_num, other_signal_, message_f, except_f);
+            }, true);
+            if(between){
+                tracker->hit_sent();
+                res = true;
+            } else{
+                tracker->put_back(std::move(entry));
+                hits_[waiting++] = sock;
+            }
+        }
+        hits_.resize(waiting);
+        return res;
+    }
+
 public:
 
-    receiver_t(signal_pack_t *data_signal, int epoll_fd, task_control_t *ctrl, resource_waiter_t *memory_waiter
-               , transfer_conveyer_t *conveyer, const std::function<void (const char *)> &message_f)
+    receiver_t(signal_pack_t *data_signal, signal_pack_t *other_signal, int epoll_fd
+               , task_control_t *ctrl, resource_waiter_t *memory_waiter
+               , transfer_conveyer_t *conveyer, const socket_profile_t &profile
+               , const socket_profile_t &dest_profile, const result_cache_t *cache, latency_histogram_t *latency
+               , const std::function<void (const char *)> &message_f)
         : exceptor_t(memory_waiter, ctrl, message_f)
         , epoller_t(epoll_fd, max_response, message_f, [this](operation_t op){ return except(op); })
-        , conveyer_(conveyer), data_signal_(data_signal) {}
+        , conveyer_(conveyer), data_signal_(data_signal), other_signal_(other_signal)
+        , tracking_(cache && cache->enabled())
+        , options_(profile, message_f, [this](operation_t op){ return except(op); })
+        , dest_options_(dest_profile, message_f, [this](operation_t op){ return except(op); })
+        , latency_(latency) {}
 
     const char *name() const override { return "receiver"; }
 
@@ -74,14 +242,20 @@ protected:
                 , int *transfer_flag){
             return receive(dsc, sock, data, transfer_flag);
         };
+        const auto ready_f = [&](int sock, unsigned lane_num){
+            ready(sock, lane_num, data_signal_, message_f, except_f);
+        };
         unsigned cnt = conveyer_->write<ConveyerSide>(this, message_f, except_f, receive_f
-                                                      , [](int transfer_flag){
+                                                      , ready_f, [](int transfer_flag){
             return transfer_flag == data_pending;
         });
-        data_signal_->notify_n(cnt);
-        return epoll([this, message_f, except_f, receive_f](int sock){
-                if(conveyer_->write(this, sock, message_f, except_f, receive_f)){
-                    data_signal_->notify_one();
+        if(!hits_.empty() && send_hits(message_f, except_f)){
+            ++cnt;
+        }
+        return epoll([this, message_f, except_f, receive_f, &ready_f](int sock){
+                conveyer_->write(this, sock, message_f, except_f, receive_f, ready_f);
+                if(!hits_.empty()){
+                    send_hits(message_f, except_f);
                 }
             }, [this](int){ show_message("out of band data ignored"); }, !cnt
         ) != - 1;
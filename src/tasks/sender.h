@@ -1,30 +1,83 @@
 #pragma once
 
+#include <type_traits>
+
 #include "reader.h"
+#include "../postgre_msg.h"
 #include "../system/epoller.h"
+#include "../system/socket_profile.h"
+#include "../latency_stats.h"
 
 namespace sender_nms {
 
 const unsigned lane_num = 0;
+const unsigned max_events = 64;
+const unsigned min_cork_size = 2048;    // smaller writes are not worth a pair of setsockopt calls
+
+// end of a response for the client or of an extended query batch for the server,
+// told by the page index unless the stream couldn't be followed
+inline bool at_boundary(const page_wrapper_t &wpage, bool from_server) {
+    const char type = from_server ? 'Z' : 'S';
+    if(wpage.index().valid()){
+        return wpage.index().ends_with(wpage.pos() + wpage.size(), type);
+    }
+    return postgre_msg_nms::ends_with_message(wpage.data(), wpage.size(), type, from_server);
+}
 
-template <class ConveyerSide> class senders_helper_t : public exceptor_t, protected epoller_t<1024> {
-    transfer_conveyer_t *conveyer_;
-    signal_pack_t *data_signal_;
+// sleeps in its own epoll instance, which holds the lane wakeup descriptor
+// and the destination sockets this sender has hit EAGAIN on
+template <class ConveyerSide> class sender_t : public reader_t<ConveyerSide, lane_num> {
+    typedef reader_t<ConveyerSide, lane_num> Base;
+    using Base::show_message;
+    using Base::show_message_except;
+    using Base::conveyer;
+    using Base::data_signal;
+    using Base::read_line;
+    using Base::stop_flag;
+    using Base::write_all;
+    using Base::epoll_ctl;
+    using Base::message_on_error;
+    using Base::throw_on_error;
 
-public:
+    epoller_t<max_events> epoller_;
+    unsigned blocked_cnt_ = 0;
+    socket_options_t options_;
+    int corked_sock_ = -1;
+    latency_histogram_t *latency_;
 
-    senders_helper_t(signal_pack_t *data_signal, int epoll_fd, task_control_t *ctrl
-                     , resource_waiter_t *memory_waiter, transfer_conveyer_t *conveyer
-                     , const std::function<void (const char *)> &message_f)
-        : exceptor_t(memory_waiter, ctrl, message_f)
-        , epoller_t(epoll_fd, max_response, message_f, [this](operation_t op){ return except(op); })
-        , conveyer_(conveyer), data_signal_(data_signal) {}
+    static constexpr bool from_server = std::is_same<ConveyerSide, server_side>::value;
 
-    const char *name() const override { return "senders helper"; }
+    void uncork() {
+        if(corked_sock_ != -1){
+            options_.cork(corked_sock_, false);
+            corked_sock_ = -1;
+        }
+    }
 
-protected:
+    bool watch_writable(int sock, int dest_sock) {
+        epoll_event ee;
+        ee.events = EPOLLOUT | EPOLLET | EPOLLONESHOT;
+        ee.data.fd = sock;
+        if(epoll_ctl(message_on_error, epoller_.epoll_fd(), EPOLL_CTL_ADD, dest_sock, &ee) == -1){
+            return false;
+        }
+        ++blocked_cnt_;
+        return true;
+    }
 
-    bool one_step() override {
+    void on_event(int fd) {
+        auto signal = data_signal()->signal(lane_num);
+        if(fd == signal->wakeup_fd()){
+            signal->take_wakeup();
+            return;
+        }
+        if(blocked_cnt_){
+            --blocked_cnt_;
+        }
+        int dest_sock = conveyer()->other_side(fd);
+        if(dest_sock != -1){
+            epoll_ctl(message_on_error, epoller_.epoll_fd(), EPOLL_CTL_DEL, dest_sock, nullptr);
+        }
         const auto flag_f = [](int *transfer_flag){
             if(*transfer_flag == data_pending){
                 *transfer_flag = no_transfer_flag;
@@ -32,36 +85,29 @@ protected:
             }
             return false;
         };
-        return epoll([&](int sock){
-                if(conveyer_->flag(this, sock, lane_num, flag_f))
-                    { data_signal_->notify_one_waiter(lane_num); }
-               }) != -1;
-    }
-
-    bool on_start() override {
-        show_message("senders helper thread started");
-        return true;
-    }
-
-    void on_finish() override {
-        show_message("senders helper thread finished");
+        if(conveyer()->flag_and_claim(this, fd, lane_num, flag_f)){
+            read_line(fd);
+        }
     }
-};
-
-template <class ConveyerSide> class sender_t : public reader_t<ConveyerSide, lane_num> {
-    typedef reader_t<ConveyerSide, lane_num> Base;
-    using Base::show_message;
-    using Base::show_message_except;
-    using Base::conveyer;
-    using Base::write;
-    using Base::message_on_error;
 
 public:
 
     sender_t(unsigned reader_num, signal_pack_t *data_signal, task_control_t *ctrl
              , resource_waiter_t *memory_waiter, transfer_conveyer_t *conveyer
+             , const socket_profile_t &profile, latency_histogram_t *latency
              , const std::function<void (const char *)> &message_f)
-        : Base(reader_num, data_signal, ctrl, memory_waiter, conveyer, message_f) {}
+        : Base(reader_num, data_signal, ctrl, memory_waiter, conveyer, message_f)
+        , epoller_(Base::epoll_create(throw_on_error), max_response, message_f
+                   , [this](operation_t op){ return Base::except(op); })
+        , options_(profile, message_f, [this](operation_t op){ return Base::except(op); })
+        , latency_(latency) {
+        epoll_event ee;
+        ee.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ee.data.fd = data_signal->signal(lane_num)->wakeup_fd();
+        epoll_ctl(throw_on_error, epoller_.epoll_fd(), EPOLL_CTL_ADD, ee.data.fd, &ee);
+    }
+
+    ~sender_t() { Base::close(message_on_error, epoller_.epoll_fd()); }
 
     const char *name() const override { return "sender"; }
 
@@ -76,38 +122,66 @@ protected:
         show_message("sender thread finished");
     }
 
+    bool one_step() override {
+        if(blocked_cnt_){
+            epoller_.epoll([this](int fd){ on_event(fd); }, epoller_nms::empty_op, false);
+        }
+        return Base::one_step();
+    }
+
+    bool wait_data() override {
+        auto signal = data_signal()->signal(lane_num);
+        if(signal->enter_wait()){
+            int cnt = epoller_.epoll([this](int fd){ on_event(fd); });
+            signal->leave_wait();
+            if(cnt == 0){
+                blocked_cnt_ = 0;
+            }
+        }
+        return !stop_flag();
+    }
+
     unsigned read_data(const std::string &dsc, int sock
                        , page_wrapper_t &&wpage, int *transfer_flag) override {
         int dest_sock = conveyer()->other_side(sock);
-        unsigned bytes_send = 0;
-        while(bytes_send != wpage.size()){
-            int res = write(message_on_error, dest_sock
-                            , (void *)(wpage.data() + bytes_send), wpage.size() - bytes_send);
-            //show_message(("to socket: " + std::to_string(dest_sock) + " sent bytes: " + std::to_string(res)).c_str());
-            if(res == -1){
-                if(errno == EAGAIN || errno == EWOULDBLOCK){
-                    *transfer_flag =  data_pending;
-                } else{
-                    *transfer_flag =  descriptor_error;
-                    show_message_except("unable to send data", [&](){
-                        return dsc + " : unable to send data";
-                    });
-                }
-                break;
-            }
-            if(res == 0){
-                *transfer_flag = descriptor_shutdown;
-                break;
+        const bool boundary = options_.profile().cork && at_boundary(wpage, from_server);
+        if(options_.profile().cork && corked_sock_ == -1 && dest_sock != -1
+                && min_cork_size <= wpage.size() && !boundary){
+            options_.cork(dest_sock, true);
+            corked_sock_ = dest_sock;
+        }
+        int res;
+        unsigned bytes_send = write_all(message_on_error, dest_sock, wpage.data(), wpage.size()
+                                        , &res);
+        if(boundary && bytes_send == wpage.size()){
+            uncork();
+        }
+        if(bytes_send && wpage.ingress()){
+            latency_->record(buffer_t::ingress_time() - wpage.ingress());
+        }
+        if(res == -1){
+            // EINPROGRESS - a fast open connect has not completed yet
+            if((errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS)
+                    && watch_writable(sock, dest_sock)){
+                *transfer_flag =  data_pending;
+            } else{
+                *transfer_flag =  descriptor_error;
+                show_message_except("unable to send data", [&](){
+                    return dsc + " : unable to send data";
+                });
             }
-            bytes_send += res;
+        } else if(res == 0){
+            *transfer_flag = descriptor_shutdown;
         }
         return bytes_send;
     }
 
     bool read_if(int transfer_flag) override { return transfer_flag == no_transfer_flag; }
+
+    // nothing more is queued right now, whatever is held back goes out
+    void line_read(int) override { uncork(); }
 };
 
 }
 
 using sender_nms::sender_t;
-using sender_nms::senders_helper_t;
@@ -4,6 +4,9 @@
 #include "../transfer_conveyer.h"
 #include "../memory/memory_pager.h"
 #include "psql_logger.h"
+#include "backend_logger.h"
+#include "mirror.h"
+#include "log_detail.h"
 
 #include <vector>
 #include <thread>
@@ -21,24 +24,40 @@ class superviser_t : public exceptor_t {
     vector<task_t *> consumers_;
     vector<task_t *> producers_;
     memory_pager_t *pager_;
+    log_detail_t *log_detail_;
+    capture_file_t *capture_;
     mutex mx_;
 
+    // the larger of pager occupancy and logging backlog, in percents of the cache
+    unsigned load_pressure() {
+        unsigned cache = pager_->cache_size();
+        unsigned available = pager_->pages_available();
+        unsigned used = available < cache ? cache - available : 0;
+        unsigned backlog = conveyer_->lane_backlog(logger_nms::lane_num);
+        unsigned pages = used < backlog ? backlog : used;
+        return pages < cache ? pages * 100ull / cache : 100;
+    }
+
 public:
 
     superviser_t(vector<task_control_t *> consumers_ctrls
                  , vector<task_control_t *> producers_ctrls
                  , vector<task_t *> consumers, vector<task_t *> producers
                  , task_control_t *ctrl, resource_waiter_t *memory_waiter
-                 , transfer_conveyer_t *conveyer, memory_pager_t *pager
-                 , const std::function<void (const char *)> &message_f)
+                 , transfer_conveyer_t *conveyer, memory_pager_t *pager, log_detail_t *log_detail
+                 , capture_file_t *capture, const std::function<void (const char *)> &message_f)
         : exceptor_t(memory_waiter, ctrl, message_f), conveyer_(conveyer)
         , consumers_ctrls_(std::move(consumers_ctrls)), producers_ctrls_(std::move(producers_ctrls))
         , consumers_(std::move(consumers)), producers_(std::move(producers)), pager_(pager)
+        , log_detail_(log_detail), capture_(capture)
     {}
 
     const char *name() const override { return "superviser"; }
 
     void on_task_blocked(task_t *) {
+        if(conveyer_->squeeze_heaviest()){
+            return;
+        }
         for(auto ctrl : consumers_ctrls_){
             ctrl->pause();
         }
@@ -55,10 +74,18 @@ protected:
             return transfer_flag == descriptor_shutdown || transfer_flag == descriptor_error
                     || transfer_flag == operational_error;
         };
-        const auto clear_f = [](int cln_desc, int){
+        const auto clear_f = [this](int cln_desc, int srv_desc){
             psql_logger_t<clients_side>::clear_from(cln_desc);
+            backend_logger_t<server_side>::clear_from(srv_desc);
+            mirror_t::clear_from(cln_desc);
+            capture_->clear_from(cln_desc);
         };
         conveyer_->drop_peers(flag_pred, message_f, clear_f);
+        if(log_detail_->update(load_pressure())){
+            show_message_except("logging detail changed", [this](){
+                return std::string("logging detail: ") + log_detail_nms::level_name(log_detail_->level());
+            });
+        }
         bool producers_blocked = false;
         for(auto task : producers_){
             if((producers_blocked = task->utility_flag() == task_blocked)){
@@ -84,6 +111,7 @@ protected:
                 }
             }
         }
+        wait_scope_t ws;
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
         return true;
     }
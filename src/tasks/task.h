@@ -5,6 +5,9 @@
 #include <mutex>
 #include <chrono>
 
+#include "../trace.h"
+#include "../task_stats.h"
+
 namespace task_nms {
 
 using namespace std::chrono_literals;
@@ -65,6 +68,8 @@ private:
             return false;
         }
         if(pause_flag()){
+            trace_scope_t ts("paused");
+            wait_scope_t ws;
             unique_lock<mutex> ul(resume_mx_);
             while(pause_flag()){
                 resume_cv_.wait_for(ul, max_response);
@@ -81,6 +86,7 @@ class task_t {
     task_control_t *tctrl_;
     atomic_int utility_flag_ = { 0 };
     atomic_uint yield_flag_ = { 0 };
+    task_stats_t stats_;
 
 public:
 
@@ -106,11 +112,21 @@ public:
 
     void yield() { yield_flag_.store(1, std::memory_order_release); }
 
+    const task_stats_t &stats() const { return stats_; }
+
+    void reset_stats() { stats_.reset(); }
+
     void run() {
+        tracer_t::name_thread(name());
+        task_account_t::attach(&stats_);
         if(on_start()){
             for(;;){
                 if(tctrl_->tick()){
-                    if(one_step()){
+                    trace_scope_t ts("step");
+                    const uint64_t start = task_account_t::step_start();
+                    const bool res = one_step();
+                    task_account_t::step_end(start);
+                    if(res){
                         continue;
                     }
                 }
@@ -118,6 +134,7 @@ public:
             }
         }
         on_finish();
+        task_account_t::attach(nullptr);
         yield_flag_.store(0, std::memory_order_release);
         utility_flag_.store(0, std::memory_order_release);
     }
@@ -0,0 +1,79 @@
+#include "trace.h"
+
+#include <cstdio>
+#include <algorithm>
+
+namespace trace_nms {
+
+ring_t *tracer_t::ring() {
+    if(!ring_){
+        try{
+            lock_guard<mutex> lg(mx_);
+            auto ring = std::make_shared<ring_t>(next_tid_, thread_name_);
+            rings_.push_back(ring);
+            ++next_tid_;
+            ring_ = std::move(ring);
+        } catch(...){
+            // the event is lost
+            return nullptr;
+        }
+    }
+    return ring_.get();
+}
+
+void tracer_t::enable(bool on) {
+    if(on && !enabled()){
+        lock_guard<mutex> lg(mx_);
+        // the rings of the threads gone are only kept for a dump
+        rings_.erase(std::remove_if(rings_.begin(), rings_.end(), [](const shared_ptr<ring_t> &r){
+                         return r.use_count() == 1; }), rings_.end());
+        since_.store(now_ns(), std::memory_order_relaxed);
+    }
+    enabled_.store(on, std::memory_order_relaxed);
+}
+
+long tracer_t::dump(const string &path) {
+    vector<shared_ptr<ring_t>> rings;
+    {
+        lock_guard<mutex> lg(mx_);
+        rings = rings_;
+    }
+    FILE *file = std::fopen(path.c_str(), "w");
+    if(!file){
+        return -1;
+    }
+    const uint64_t since = since_.load(std::memory_order_relaxed);
+    const auto us = [](uint64_t ns){ return static_cast<double>(ns) / 1000; };
+    long cnt = 0;
+    bool ok = std::fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", file) != EOF;
+    const char *sep = "\n";
+    vector<event_t> events;
+    for(const auto &r : rings){
+        ok = ok && 0 < std::fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u"
+                                    ",\"args\":{\"name\":\"%s %u\"}}", sep, r->tid_, r->thread_name_.c_str(), r->tid_);
+        sep = ",\n";
+        // the events the thread may have overwritten while they were copied are left out
+        const uint64_t head = r->head_.load(std::memory_order_acquire);
+        uint64_t first = head < ring_size ? 0 : head - ring_size;
+        events.clear();
+        for(uint64_t idx = first; idx < head; ++idx){
+            events.push_back(r->events_[idx % ring_size]);
+        }
+        const uint64_t new_head = r->head_.load(std::memory_order_acquire);
+        const uint64_t skipped = new_head - head < events.size() ? new_head - head : events.size();
+        for(auto it = events.begin() + skipped; ok && it != events.end(); ++it){
+            if(it->start < since){
+                continue;
+            }
+            ok = 0 < std::fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u"
+                                  ",\"ts\":%.3f,\"dur\":%.3f}", it->name, r->tid_, us(it->start - since)
+                                  , us(it->end - it->start));
+            ++cnt;
+        }
+    }
+    ok = ok && std::fputs("\n]}\n", file) != EOF;
+    ok = std::fclose(file) == 0 && ok;
+    return ok ? cnt : -1;
+}
+
+}
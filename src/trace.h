@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+namespace trace_nms {
+
+using std::string;
+using std::vector;
+using std::shared_ptr;
+using std::mutex;
+using std::lock_guard;
+using std::atomic;
+
+const unsigned ring_size = 8192;    // events kept per thread, the older ones are overwritten
+
+inline uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct event_t {
+    uint64_t start;
+    uint64_t end;
+    const char *name;   // a literal
+};
+
+// written by its thread only, the dump may read it meanwhile
+class ring_t {
+    friend class tracer_t;
+
+    const unsigned tid_;
+    const string thread_name_;
+    vector<event_t> events_;
+    atomic<uint64_t> head_ = { 0 };
+
+public:
+
+    ring_t(unsigned tid, const string &thread_name)
+        : tid_(tid), thread_name_(thread_name), events_(ring_size) {}
+
+    void add(uint64_t start, uint64_t end, const char *name) {
+        const uint64_t head = head_.load(std::memory_order_relaxed);
+        events_[head % ring_size] = { start, end, name };
+        head_.store(head + 1, std::memory_order_release);
+    }
+};
+
+// the rings are made on the first event of a thread with tracing on,
+// so a proxy never traced pays a relaxed load per traced scope only
+class tracer_t {
+    static inline atomic<int> enabled_ = { 0 };
+    static inline atomic<uint64_t> since_ = { 0 };     // events started before are not dumped
+    static inline mutex mx_;
+    static inline vector<shared_ptr<ring_t>> rings_;
+    static inline unsigned next_tid_ = 1;
+    static inline thread_local shared_ptr<ring_t> ring_;
+    static inline thread_local const char *thread_name_ = "thread";
+
+    static ring_t *ring();
+
+public:
+
+    static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+    static void enable(bool on);
+
+    static void name_thread(const char *name) { thread_name_ = name; }
+
+    static void add(uint64_t start, uint64_t end, const char *name) {
+        if(auto r = ring()){
+            r->add(start, end, name);
+        }
+    }
+
+    // writes the events in the Chrome trace format, returns their number or -1
+    static long dump(const string &path);
+};
+
+// records the time from its construction to its destruction, if tracing is on at the start
+class trace_scope_t {
+    const char *name_;
+    uint64_t start_ = 0;
+
+    trace_scope_t(const trace_scope_t &) = delete;
+    trace_scope_t &operator=(const trace_scope_t &) = delete;
+
+public:
+
+    explicit trace_scope_t(const char *name) : name_(name) {
+        if(tracer_t::enabled()){
+            start_ = now_ns();
+        }
+    }
+
+    ~trace_scope_t() {
+        if(start_){
+            tracer_t::add(start_, now_ns(), name_);
+        }
+    }
+};
+
+}
+
+using trace_nms::tracer_t;
+using trace_nms::trace_scope_t;
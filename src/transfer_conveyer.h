@@ -19,6 +19,8 @@
 #include "tasks/task.h"
 #include "memory/buffer.h"
 
+namespace query_tracker_nms { class query_tracker_t; }
+
 namespace conveyer_nms {
 
 using std::vector;
@@ -34,6 +36,7 @@ using std::shared_ptr;
 using std::unique_ptr;
 using std::string;
 using std::function;
+using query_tracker_nms::query_tracker_t;
 using namespace std::chrono_literals;
 
 namespace transfer_flags {
@@ -43,6 +46,7 @@ const int descriptor_error = -2;
 const int descriptor_shutdown = -1;
 const int no_transfer_flag = 0;
 const int data_pending = 1;
+const int data_paused = 2;
 
 }
 
@@ -55,18 +59,26 @@ class transfer_line_t {
     buffer_t buffer_;
     const unsigned index_cnt_;
     vector<atomic_flag> locks_;
+    vector<atomic_flag> claims_;
     vector<atomic_int> flags_;
     vector<task_t *> tasks_;
+    message_indexer_t<page_t> indexer_;     // used by the writer only
 
 public:
 
     transfer_line_t(const string &description, unsigned lane_cnt
-                    , memory_pager_t *pager)
-        : description_(description), buffer_(lane_cnt, pager), index_cnt_(lane_cnt + 1)
-        , locks_(index_cnt_), flags_(index_cnt_), tasks_(index_cnt_, nullptr) {
+                    , memory_pager_t *pager, shared_ptr<page_quota_t> quota = nullptr
+                    , spill_file_t *spill = nullptr, bool typeless_start = false)
+        : description_(description), buffer_(lane_cnt, pager, std::move(quota), spill)
+        , index_cnt_(lane_cnt + 1)
+        , locks_(index_cnt_), claims_(lane_cnt), flags_(index_cnt_)
+        , tasks_(index_cnt_, nullptr), indexer_(typeless_start) {
         for(auto &l : locks_){
             l.clear(std::memory_order_relaxed);
         }
+        for(auto &c : claims_){
+            c.clear(std::memory_order_relaxed);
+        }
         for(auto &f : flags_){
             f.store(no_transfer_flag, std::memory_order_relaxed);
         }
@@ -88,13 +100,26 @@ public:
         flags_[idx].store(val, mo);
     }
 
+    bool exchange_transfer_flag(unsigned idx, int expected, int val) {
+        assert(idx < flags_.size());
+        return flags_[idx].compare_exchange_strong(expected, val);
+    }
+
+    bool over_quota() const { return buffer_.quota() && buffer_.quota()->exceeded(); }
+
+    void throttle() { if(buffer_.quota()){ buffer_.quota()->throttle(); } }
+
     bool acquire_buffer_lock(task_t *task, unsigned idx, bool force = false) {
         assert(idx < locks_.size() && idx < tasks_.size());
-        while(locks_[idx].test_and_set(std::memory_order_acquire)){
+        if(locks_[idx].test_and_set(std::memory_order_acquire)){
             if(!force){
                 return false;
             }
-            std::this_thread::sleep_for(1ms);
+            trace_scope_t ts("lock spin");
+            wait_scope_t ws;
+            do{
+                std::this_thread::sleep_for(1ms);
+            } while(locks_[idx].test_and_set(std::memory_order_acquire));
         }
         tasks_[idx] = task;
         return true;
@@ -106,8 +131,21 @@ public:
         locks_[idx].clear(std::memory_order_release);
     }
 
+    bool claim(unsigned lane_num) {
+        assert(lane_num < claims_.size());
+        return !claims_[lane_num].test_and_set();
+    }
+
+    void release_claim(unsigned lane_num) {
+        assert(lane_num < claims_.size());
+        claims_[lane_num].clear();
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
     buffer_t *buffer() { return &buffer_; }
 
+    message_indexer_t<page_t> *indexer() { return &indexer_; }
+
     task_t *active_task(unsigned idx) {
         assert(idx < tasks_.size());
         return tasks_[idx];
@@ -163,6 +201,8 @@ public:
 
     const string &description() const { assert(line_); return line_->description(); }
 
+    unsigned lane_count() const { assert(line_); return line_->index_count() - reader_index_start; }
+
     transfer_handle_t(transfer_handle_t &&other) { move(std::move(other)); }
 
     transfer_handle_t &operator=(transfer_handle_t &&other) {
@@ -180,6 +220,12 @@ protected:
     }
 
     buffer_t *buffer() const { assert(valid_); return line_->buffer(); }
+
+    transfer_line_t *line() const { assert(valid_); return line_; }
+
+    bool claim(unsigned lane_num) const { assert(valid_); return line_->claim(lane_num); }
+
+    void release_claim(unsigned lane_num) const { assert(valid_); line_->release_claim(lane_num); }
 };
 
 class write_handle_t : public transfer_handle_t {
@@ -196,6 +242,17 @@ public:
     shared_ptr<page_t> page() const { return buffer()->writer_page(); }
 
     unsigned pos() const { return buffer()->writer_pos(); }
+
+    bool claim_lane(unsigned lane_num) const { return claim(lane_num); }
+
+    bool over_quota() const { return line()->over_quota(); }
+
+    void throttle() const { line()->throttle(); }
+
+    // marks the messages in the data just copied to the page at pos
+    void index(const shared_ptr<page_t> &page, unsigned pos, const int8_t *data, unsigned size) const {
+        line()->indexer()->feed(page, pos, data, size);
+    }
 };
 
 class read_handle_t : public transfer_handle_t {
@@ -212,9 +269,15 @@ public:
         return buffer()->advance_reader(lane_num_, bytes_read);
     }
 
-    shared_ptr<page_t> page() const { return buffer()->reader_page(lane_num_); }
+    shared_ptr<page_t> page(uint64_t *ingress = nullptr) const {
+        return buffer()->reader_page(lane_num_, ingress);
+    }
 
     unsigned pos() const { return buffer()->reader_pos(lane_num_); }
+
+    bool claim_lane() const { return claim(lane_num_); }
+
+    void release_lane() const { release_claim(lane_num_); }
 };
 
 struct server_side {};
@@ -237,6 +300,12 @@ public:
 
     virtual ~peer_t() {}
 
+    shared_ptr<query_tracker_t> tracker;    // null unless results are cached
+    bool mid_stream = false;                // taken over from another process
+
+    // the descriptors are passed to another process, they must only be closed here
+    virtual void hand_over() {}
+
     template <class ConveyerSide> Descriptor descriptor() const;
 };
 
@@ -245,17 +314,62 @@ template<> inline Descriptor peer_t::descriptor<server_side>() const { return se
 template<> inline Descriptor peer_t::descriptor<clients_side>() const { return client_descriptor_; }
 
 class transfer_loop_t {
+    const string name_;
+    function<void (Descriptor)> resume_f_;
+    shared_ptr<page_quota_t> quota_;
     transfer_line_t client_line_;
     transfer_line_t server_line_;
     unique_ptr<peer_t> peer_;
 
+    void resume() {
+        if(client_line_.exchange_transfer_flag(writer_index, data_paused, no_transfer_flag)){
+            resume_f_(descriptor<clients_side>());
+        }
+        if(server_line_.exchange_transfer_flag(writer_index, data_paused, no_transfer_flag)){
+            resume_f_(descriptor<server_side>());
+        }
+    }
+
 public:
 
-    transfer_loop_t(const string &client_description, const string &server_description
-                , unsigned lane_cnt, memory_pager_t *pager, unique_ptr<peer_t> &&peer)
-        : client_line_(client_description, lane_cnt, pager)
-        , server_line_(server_description, lane_cnt, pager)
-        , peer_(std::move(peer)) { assert(peer_); }
+    transfer_loop_t(const string &name, const string &client_description
+                , const string &server_description, unsigned lane_cnt, unsigned client_lane_cnt
+                , memory_pager_t *pager, unique_ptr<peer_t> &&peer
+                , unsigned page_quota, spill_file_t *spill, const function<void (Descriptor)> &resume_f)
+        : name_(name), resume_f_(resume_f)
+        , quota_(std::make_shared<page_quota_t>(page_quota, [this](){ resume(); }))
+        , client_line_(client_description, client_lane_cnt, pager, quota_, spill, true)
+        , server_line_(server_description, lane_cnt, pager, quota_, spill)
+        , peer_(std::move(peer)) {
+        assert(peer_);
+        if(peer_->mid_stream){
+            client_line_.indexer()->lose();
+            server_line_.indexer()->lose();
+        }
+    }
+
+    ~transfer_loop_t() { quota_->detach(); }
+
+    page_quota_t *quota() const { return quota_.get(); }
+
+    const string &name() const { return name_; }
+
+    bool live() const {
+        return 0 <= client_line_.transfer_flag(writer_index)
+                && 0 <= server_line_.transfer_flag(writer_index);
+    }
+
+    void hand_over() { peer_->hand_over(); }
+
+    const shared_ptr<query_tracker_t> &tracker() const { return peer_->tracker; }
+
+    bool writers_idle() {
+        return !client_line_.active_task(writer_index) && !server_line_.active_task(writer_index);
+    }
+
+    unsigned queued_pages(unsigned lane) {
+        return client_line_.buffer()->queued_pages(lane) + server_line_.buffer()->queued_pages(lane);
+    }
 
     template <class ConveyerSide>
     Descriptor descriptor() const { return peer_->descriptor<ConveyerSide>(); }
@@ -287,24 +401,35 @@ class page_wrapper_t {
     shared_ptr<page_t> page_;
     unsigned pos_;
     unsigned sz_;
+    uint64_t ingress_;
 
 public:
 
     page_wrapper_t() = default;
 
-    page_wrapper_t(shared_ptr<page_t> &&page, unsigned pos, unsigned sz)
-        : page_(std::move(page)), pos_(pos), sz_(sz) {}
+    page_wrapper_t(shared_ptr<page_t> &&page, unsigned pos, unsigned sz, uint64_t ingress = 0)
+        : page_(std::move(page)), pos_(pos), sz_(sz), ingress_(ingress) {}
 
    int8_t *data() const { return page_->data() + pos_; }
 
+   unsigned pos() const { return pos_; }
+
+   const page_index_t &index() const { return page_->index(); }
+
    unsigned size() const { return sz_; }
 
+   // when the data was written to the page, on the buffer_t::ingress_time clock
+   uint64_t ingress() const { return ingress_; }
+
    void adjust_pos(unsigned inc) { assert(inc <= sz_); pos_ += inc; sz_ -= inc; }
 };
 
 class transfer_conveyer_t {
     const unsigned lane_cnt_;
+    const unsigned client_lane_cnt_;
     memory_pager_t *pager_;
+    const unsigned page_quota_;
+    spill_file_t *spill_;
     list<transfer_loop_t> conveyer_;
 
 public:
@@ -315,6 +440,7 @@ private:
 
     unordered_map<Descriptor, conveyer_iterator> descriptors_hash_;
     shared_mutex conveyer_mutex_;
+    atomic_int input_held_ = { 0 };
 
     conveyer_iterator find_loop(Descriptor descriptor) {
         auto it = descriptors_hash_.find(descriptor);
@@ -396,13 +522,18 @@ private:
         return peers_processed;
     }
 
-    template <class MessageExceptF, class ExceptF, class GetDataF>
+    template <class MessageExceptF, class ExceptF, class GetDataF, class ReadyF>
     bool write_operation(const MessageExceptF &message_f, const ExceptF &except_f
-                         , const GetDataF &get_f, const write_handle_t &handle) {
+                         , const GetDataF &get_f, const ReadyF &ready_f
+                         , const write_handle_t &handle, bool whole = false) {
         int flag = handle.transfer_flag();
         unsigned total_written = 0;
-        while(total_written < one_time_max){
+        while(whole || total_written < one_time_max){
             const int8_t *data;
+            if(!whole && handle.over_quota()){
+                flag = data_paused;
+                break;
+            }
             unsigned to_write = get_f(handle.description(), handle.descriptor(), &data, &flag);
             if(to_write == 0){
                 break;
@@ -419,6 +550,7 @@ private:
                     if(except_f([&](){ page = handle.page(); })){
                         bytes_written = to_write < bytes_available ? to_write : bytes_available;
                         memcpy(page->data() + handle.pos(), data, bytes_written);
+                        handle.index(page, handle.pos(), data, bytes_written);
                         data += bytes_written;
                         to_write -= bytes_written;
                         continue;
@@ -432,7 +564,18 @@ private:
             }
         }
         handle.set_transfer_flag(flag);
-        return total_written != 0;
+        if(flag == data_paused){
+            handle.throttle();
+        }
+        if(total_written == 0){
+            return false;
+        }
+        for(unsigned lane_num = 0; lane_num < handle.lane_count(); ++lane_num){
+            if(handle.claim_lane(lane_num)){
+                ready_f(handle.descriptor(), lane_num);
+            }
+        }
+        return true;
     }
 
     template <class MessageExceptF, class ExceptF, class TakeDataF>
@@ -445,15 +588,16 @@ private:
         for(;;){
             unsigned to_read;
             if(except_f([&](){ to_read = handle.advance(bytes_read); })){
-                if(to_read == 0 || one_time_max < total_read){
+                if(to_read == 0 || one_time_max < total_read || flag != orig_flag){
                     break;
                 }
                 shared_ptr<page_t> page;
-                if(except_f([&](){ page = handle.page(); })){
+                uint64_t ingress;
+                if(except_f([&](){ page = handle.page(&ingress); })){
                     flag = orig_flag;
                     page_wrapper_t wpage;
                     bool ok = except_f([&](){
-                        wpage = page_wrapper_t(std::move(page), handle.pos(), to_read);
+                        wpage = page_wrapper_t(std::move(page), handle.pos(), to_read, ingress);
                     });
                     if(ok){
                         bytes_read = take_f(handle.description(), handle.descriptor()
@@ -531,6 +675,8 @@ private:
                             sleep_delay += max_response;
                         }
                     }
+                    trace_scope_t ts("lock spin");
+                    wait_scope_t ws;
                     std::this_thread::sleep_for(sleep_delay);
                     delay += sleep_delay;
                 }
@@ -568,12 +714,20 @@ private:
 
 public:
 
-    transfer_conveyer_t(unsigned lane_cnt, memory_pager_t *pager)
-        : lane_cnt_(lane_cnt), pager_(pager) { assert(lane_cnt_); }
+    // the client lines may have lanes of their own past the common ones
+    transfer_conveyer_t(unsigned lane_cnt, memory_pager_t *pager, unsigned page_quota = 0
+                        , spill_file_t *spill = nullptr, unsigned extra_client_lanes = 0)
+        : lane_cnt_(lane_cnt), client_lane_cnt_(lane_cnt + extra_client_lanes)
+        , pager_(pager), page_quota_(page_quota), spill_(spill) { assert(lane_cnt_); }
 
     unsigned lane_count() const { return lane_cnt_; }
 
-    conveyer_iterator add_peer(const string &peer_name, unique_ptr<peer_t> &&peer) {
+    unsigned client_lane_count() const { return client_lane_cnt_; }
+
+    unsigned page_quota() const { return page_quota_; }
+
+    conveyer_iterator add_peer(const string &peer_name, unique_ptr<peer_t> &&peer
+                               , const function<void (Descriptor)> &resume_f) {
         decltype(descriptors_hash_)::iterator cit, sit;
         bool client_inserted = false;
         bool server_inserted = false;
@@ -588,8 +742,9 @@ public:
             assert(res.second);
             server_inserted = res.second;
             sit = res.first;
-            auto it = conveyer_.emplace(end, "from " + peer_name, "to " + peer_name
-                                        , lane_cnt_, pager_, std::move(peer));
+            auto it = conveyer_.emplace(end, peer_name, "from " + peer_name, "to " + peer_name
+                                        , lane_cnt_, client_lane_cnt_, pager_, std::move(peer), page_quota_
+                                        , spill_, resume_f);
             cit->second = it;
             sit->second = it;
             return it;
@@ -641,6 +796,66 @@ public:
         drop_peer(it, message_f, clear_f);
     }
 
+    // lowers the quota of the connection holding the most pages
+    bool squeeze_heaviest() {
+        if(!page_quota_){
+            return false;
+        }
+        shared_lock<shared_mutex> sl(conveyer_mutex_);
+        page_quota_t *heaviest = nullptr;
+        for(auto &loop : conveyer_){
+            if(!heaviest || heaviest->pages() < loop.quota()->pages()){
+                heaviest = loop.quota();
+            }
+        }
+        return heaviest && heaviest->pages() && heaviest->squeeze();
+    }
+
+    // calls f(peer name, client descriptor, server descriptor) for every peer not being dropped
+    template <class F> void for_each_live_peer(const F &f) {
+        shared_lock<shared_mutex> sl(conveyer_mutex_);
+        for(auto &loop : conveyer_){
+            if(loop.live()){
+                f(loop.name(), loop.descriptor<clients_side>(), loop.descriptor<server_side>());
+            }
+        }
+    }
+
+    // while input is held receivers leave their sockets disarmed after draining them
+    void hold_input(bool hold) { input_held_.store(hold); }
+
+    bool input_held() const { return input_held_.load(); }
+
+    // dropping the peers afterwards closes their descriptors without shutting the connections down
+    void hand_over() {
+        shared_lock<shared_mutex> sl(conveyer_mutex_);
+        for(auto &loop : conveyer_){
+            loop.hand_over();
+        }
+    }
+
+    // true if no line is being written to
+    bool writers_idle() {
+        shared_lock<shared_mutex> sl(conveyer_mutex_);
+        for(auto &loop : conveyer_){
+            if(!loop.writers_idle()){
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // pages queued in the lane of all lines
+    unsigned lane_backlog(unsigned lane) {
+        assert(lane < lane_cnt_);
+        unsigned res = 0;
+        shared_lock<shared_mutex> sl(conveyer_mutex_);
+        for(auto &loop : conveyer_){
+            res += loop.queued_pages(lane);
+        }
+        return res;
+    }
+
     void clear() {
         lock_guard<shared_mutex> lg(conveyer_mutex_);
         descriptors_hash_.clear();
@@ -652,23 +867,25 @@ public:
         return conveyer_.size();
     }
 
-    template <class ConveyerSide, class MessageExceptF, class ExceptF, class GetDataF
+    template <class ConveyerSide, class MessageExceptF, class ExceptF, class GetDataF, class ReadyF
               , class FlagPredicate = decltype(always_true)>
     unsigned write(task_t *task, const MessageExceptF &message_f, const ExceptF &except_f
-                   , const GetDataF &get_f, const FlagPredicate &pred = always_true) {
+                   , const GetDataF &get_f, const ReadyF &ready_f
+                   , const FlagPredicate &pred = always_true) {
         return iterate(pred, [&](const write_handle_t &handle){
-            return write_operation(message_f, except_f, get_f, handle);
+            return write_operation(message_f, except_f, get_f, ready_f, handle);
         }, [this, task](const FlagPredicate &pred, Descriptor descriptor) {
             return find_to_write<ConveyerSide>(task, pred, descriptor);
         });
     }
 
-    template <class MessageExceptF, class ExceptF, class GetDataF>
+    // whole writes everything get_f has, regardless of the quota
+    template <class MessageExceptF, class ExceptF, class GetDataF, class ReadyF>
     bool write(task_t *task, Descriptor descriptor, const MessageExceptF &message_f, const ExceptF &except_f
-               , const GetDataF &get_f) {
+               , const GetDataF &get_f, const ReadyF &ready_f, bool whole = false) {
         write_handle_t handle = write_handle(task, descriptor);
         if(handle.is_valid()){
-            return write_operation(message_f, except_f, get_f, handle);
+            return write_operation(message_f, except_f, get_f, ready_f, handle, whole);
         }
         return false;
     }
@@ -695,6 +912,31 @@ public:
         return false;
     }
 
+    // reads a line claimed for the lane, then gives the claim back and hands the line
+    // to ready_f again if data has arrived in the meantime
+    template <class MessageExceptF, class ExceptF, class TakeDataF, class ReadyF
+              , class FlagPredicate = decltype(always_true)>
+    bool read_claimed(task_t *task, Descriptor descriptor, unsigned lane_num
+                      , const MessageExceptF &message_f, const ExceptF &except_f
+                      , const TakeDataF &take_f, const ReadyF &ready_f
+                      , const FlagPredicate &pred = always_true) {
+        read_handle_t handle = read_handle(task, descriptor, lane_num);
+        if(!handle.is_valid()){
+            return false;
+        }
+        bool res = false;
+        if(pred(handle.transfer_flag())){
+            res = read_operation(message_f, except_f, take_f, handle);
+        }
+        handle.release_lane();
+        if(pred(handle.transfer_flag()) && ready_read_operation(message_f, except_f, handle)){
+            if(handle.claim_lane()){
+                ready_f(descriptor, lane_num);
+            }
+        }
+        return res;
+    }
+
     template <class ConveyerSide, class MessageExceptF, class ExceptF
               , class FlagPredicate = decltype(always_true)>
     unsigned ready_read(task_t *task, unsigned lane_num, const MessageExceptF &message_f
@@ -712,11 +954,27 @@ public:
         return flag_handle(handle, flag_f);
     }
 
+    template <class FlagF>
+    bool flag_and_claim(task_t *task, Descriptor descriptor, unsigned lane_num
+                        , const FlagF &flag_f) {
+        read_handle_t handle = read_handle(task, descriptor, lane_num);
+        if(flag_handle(handle, flag_f)){
+            return handle.claim_lane();
+        }
+        return false;
+    }
+
     template <class FlagF> bool flag(task_t *task, Descriptor descriptor, const FlagF &flag_f) {
         write_handle_t handle = write_handle(task, descriptor);
         return flag_handle(handle, flag_f);
     }
 
+    shared_ptr<query_tracker_t> tracker(Descriptor descriptor) {
+        shared_lock<shared_mutex> sl(conveyer_mutex_);
+        auto loop = find_loop(descriptor);
+        return loop != conveyer_.end() ? loop->tracker() : nullptr;
+    }
+
     Descriptor other_side(Descriptor descriptor) {
         shared_lock<shared_mutex> sl(conveyer_mutex_);
         auto loop = find_loop(descriptor);
@@ -743,4 +1001,5 @@ using conveyer_nms::descriptor_error;
 using conveyer_nms::descriptor_shutdown;
 using conveyer_nms::no_transfer_flag;
 using conveyer_nms::data_pending;
+using conveyer_nms::data_paused;
 using conveyer_nms::page_wrapper_t;